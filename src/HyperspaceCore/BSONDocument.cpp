@@ -1,283 +1,354 @@
 #include "BSONDocument.h"
+#include "BSONDocument_p.h"
 
 #include <QtCore/QDebug>
 #include <QtCore/QHash>
 
-#include <endian.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 
-#define TYPE_DOUBLE 0x01
-#define TYPE_STRING 0x02
-#define TYPE_DOCUMENT 0x03
-#define TYPE_BINARY 0x05
-#define TYPE_BOOLEAN 0x08
-#define TYPE_DATETIME 0x09
-#define TYPE_INT32 0x10
-#define TYPE_INT64 0x12
-
 namespace Hyperspace
 {
 
 namespace Util
 {
 
-static uint32_t read_uint32(const void *u)
+BSONView::BSONView()
+    : m_data(nullptr)
+    , m_size(0)
 {
-    const unsigned char *b = (const unsigned char *) u;
-    return le32toh(((uint32_t) b[0]) | (((uint32_t) b[1]) << 8) | (((uint32_t) b[2]) << 16) | (((uint32_t) b[3]) << 24));
 }
 
-static uint64_t read_uint64(const void *u)
+BSONView::BSONView(const QByteArray &owner, const char *data, int size)
+    : m_owner(owner)
+    , m_data(data)
+    , m_size(size)
 {
-    const unsigned char *b = (const unsigned char *) u;
-    return le64toh((uint64_t) b[0] | ((uint64_t) b[1] << 8) | ((uint64_t) b[2] << 16) | ((uint64_t) b[3] << 24) | ((uint64_t) b[4] << 32) | ((uint64_t) b[5] << 40) | ((uint64_t) b[6] << 48) | ((uint64_t) b[7] << 56));
 }
 
-static unsigned int bson_next_item_offset(unsigned int offset, unsigned int keyLen, const void *document)
+QByteArray BSONView::toByteArray() const
 {
-    const char *docBytes = (const char *) document;
-    uint8_t elementType = (uint8_t) docBytes[offset];
+    if (m_data == m_owner.constData() && m_size == m_owner.size()) {
+        return m_owner;
+    }
 
-    /* offset <- type (uint8_t) + key (const char *) + '\0' (char) */
-    offset += 1 + keyLen + 1;
+    return m_data ? QByteArray(m_data, m_size) : QByteArray();
+}
 
-    switch (elementType) {
-        case TYPE_STRING: {
-            uint32_t stringLen = read_uint32(docBytes + offset);
-            offset += stringLen + 4;
-        }
-        break;
+QByteArray BSONView::toRawByteArray() const
+{
+    return m_data ? QByteArray::fromRawData(m_data, m_size) : QByteArray();
+}
 
-        case TYPE_DOCUMENT: {
-            uint32_t docLen = read_uint32(docBytes + offset);
-            offset += docLen;
-        }
-        break;
+bool BSONView::operator==(const QByteArray &other) const
+{
+    return m_size == other.size() && !memcmp(m_data, other.constData(), m_size);
+}
 
-        case TYPE_BINARY: {
-            uint32_t binLen = read_uint32(docBytes + offset);
-            offset += 4 + 1 + binLen; /* int32 (len) + byte (subtype) + binLen */
-        }
-        break;
+BSONElement::BSONElement()
+    : m_document(nullptr)
+    , m_key(nullptr)
+    , m_value(nullptr)
+    , m_keySize(0)
+    , m_valueSize(0)
+    , m_type(BSONType::Double)
+{
+}
 
-        case TYPE_INT32: {
-           offset += sizeof(int32_t);
-        }
-        break;
+BSONView BSONElement::key() const
+{
+    return m_key ? BSONView(m_document->m_buffer, m_key, m_keySize) : BSONView();
+}
 
-        case TYPE_DOUBLE:
-        case TYPE_DATETIME:
-        case TYPE_INT64: {
-            offset += sizeof(int64_t);
-        }
-        break;
+BSONView BSONElement::value() const
+{
+    return m_key ? BSONView(m_document->m_buffer, m_value, m_valueSize) : BSONView();
+}
 
-        case TYPE_BOOLEAN: {
-            offset += 1;
-        }
-        break;
+double BSONElement::toDouble(double defaultValue) const
+{
+    if (Q_LIKELY(m_key)) {
+        if (m_type == BSONType::Double) {
+            return bson_value_to_double(m_value);
 
-        default: {
-            qWarning() << "BSON parser: unrecognized BSON type: " << elementType;
-            return 0;
+        } else if (m_type == BSONType::Int64) {
+            return bson_value_to_int64(m_value);
+
+        } else if (m_type == BSONType::Int32) {
+            return bson_value_to_int32(m_value);
         }
     }
 
-    return offset;
+    return defaultValue;
 }
 
-static const void *bson_key_lookup(const char *key, const void *document, uint8_t *type)
+BSONView BSONElement::byteArrayView() const
 {
-    const char *docBytes = (const char *) document;
-    uint32_t docLen = read_uint32(document);
+    uint32_t len = 0;
 
-    /* TODO: it would be nice to check len validity here */
+    if (m_key && (m_type == BSONType::String)) {
+        const char *data = bson_value_to_string(m_value, &len);
+        return BSONView(m_document->m_buffer, data, len);
 
-    unsigned int offset = 4;
-    while (offset + 1 < docLen) {
-       uint8_t elementType = (uint8_t) docBytes[offset];
-       int keyLen = strnlen(docBytes + offset + 1, docLen - offset);
+    } else if (m_key && (m_type == BSONType::Binary)) {
+        const char *data = bson_value_to_binary(m_value, &len);
+        return BSONView(m_document->m_buffer, data, len);
+    }
 
-       if (!strncmp(key, docBytes + offset + 1, docLen - offset)) {
-           if (type) {
-               *type = elementType;
-           }
-           return (void *) (docBytes + offset + 1 + keyLen + 1);
-       }
+    return BSONView();
+}
 
-       unsigned int newOffset = bson_next_item_offset(offset, keyLen, document);
-       if (!newOffset) {
-           return NULL;
-       }
-       offset = newOffset;
+QByteArray BSONElement::toByteArray(const QByteArray &defaultValue) const
+{
+    if (m_key && (m_type == BSONType::String || m_type == BSONType::Binary)) {
+        return bson_value_to_byte_array((uint8_t) m_type, m_value);
     }
 
-    return NULL;
+    return defaultValue;
 }
 
-static void *bson_next_item(const void *document, const void *current_item)
+QString BSONElement::toString(const QString &defaultValue) const
 {
-    const char *docBytes = (const char *) document;
-    uint32_t docLen = read_uint32(document);
-    unsigned int offset = ((const char *) current_item) - docBytes;
+    BSONView encoded = byteArrayView();
+    if (encoded.isEmpty()) {
+        return defaultValue;
+    } else {
+        return bson_utf8_to_string(encoded.constData(), encoded.size());
+    }
+}
 
-    if (offset + 1 >= docLen) {
-        return NULL;
+QLatin1String BSONElement::toLatin1String() const
+{
+    if (m_key && (m_type == BSONType::String)) {
+        uint32_t len = 0;
+        const char *data = bson_value_to_string(m_value, &len);
+        return QLatin1String(data, len);
     }
 
-    int keyLen = strnlen(docBytes + offset + 1, docLen - offset);
-    unsigned int newOffset = bson_next_item_offset(offset, keyLen, document);
+    return QLatin1String();
+}
 
-    if (!newOffset) {
-        return NULL;
+QDateTime BSONElement::toDateTime(const QDateTime &defaultValue) const
+{
+    if (Q_LIKELY(m_key && (m_type == BSONType::DateTime))) {
+        return QDateTime::fromMSecsSinceEpoch(bson_value_to_int64(m_value), m_document->m_dateTimeSpec);
     }
 
-    if (newOffset + 1 >= docLen) {
-        return NULL;
+    return defaultValue;
+}
+
+int32_t BSONElement::toInt32(int32_t defaultValue) const
+{
+    if (Q_LIKELY(m_key && (m_type == BSONType::Int32))) {
+        return bson_value_to_int32(m_value);
     }
 
-    return ((char *) docBytes) + newOffset;
+    return defaultValue;
 }
 
-static const void *bson_first_item(const void *document)
+int64_t BSONElement::toInt64(int64_t defaultValue) const
 {
-    const char *docBytes = (const char *) document;
-    return docBytes + 4;
+    return m_key ? bson_value_to_integer((uint8_t) m_type, m_value, defaultValue) : defaultValue;
 }
 
-static const char *bson_key(const void *item)
+bool BSONElement::toBoolean(bool defaultValue) const
 {
-    return ((const char *) item) + 1;
+    if (Q_LIKELY(m_key && (m_type == BSONType::Boolean))) {
+        return bson_value_to_int8(m_value) == '\1';
+    }
+
+    return defaultValue;
 }
 
-static const char *bson_value_to_string(const void *valuePtr, uint32_t *len)
+int64_t BSONElement::toMSecsSinceEpoch(int64_t defaultValue) const
 {
-    const char *valueBytes = (const char *) valuePtr;
-    uint32_t stringLen = read_uint32(valueBytes);
+    if (Q_LIKELY(m_key && (m_type == BSONType::DateTime))) {
+        return bson_value_to_int64(m_value);
+    }
 
-    if (len) {
-        *len = stringLen - 1;
+    return defaultValue;
+}
+
+BSONDocument BSONElement::toDocument() const
+{
+    if (Q_LIKELY(m_key && (m_type == BSONType::Document || m_type == BSONType::Array))) {
+        BSONDocument subdocument(m_document->m_buffer, m_value, m_valueSize);
+        // Validation is recursive: embedded documents of a valid document are valid as well
+        if (m_document->m_validity == BSONDocument::Validity::Valid) {
+            subdocument.m_validity = BSONDocument::Validity::Valid;
+        }
+        subdocument.m_dateTimeSpec = m_document->m_dateTimeSpec;
+        return subdocument;
     }
 
-    return valueBytes + 4;
+    return BSONDocument(QByteArray());
 }
 
-static const char *bson_value_to_binary(const void *valuePtr, uint32_t *len)
+QVector<double> BSONElement::toDoubleArray() const
 {
-    const char *valueBytes = (const char *) valuePtr;
-    uint32_t binLen = read_uint32(valueBytes);
+    QVector<double> values;
 
-    if (len) {
-        *len = binLen;
+    if (m_key && (m_type == BSONType::Array) && Q_UNLIKELY(!bson_decode_double_array(m_value, &values))) {
+        values.clear();
     }
 
-    return valueBytes + 5;
+    return values;
 }
 
-static const void *bson_value_to_document(const void *valuePtr, uint32_t *len)
+QVector<int64_t> BSONElement::toInt64Array() const
 {
-    const char *valueBytes = (const char *) valuePtr;
-    uint32_t binLen = read_uint32(valueBytes);
+    QVector<int64_t> values;
 
-    if (len) {
-        *len = binLen;
+    if (m_key && (m_type == BSONType::Array) && Q_UNLIKELY(!bson_decode_int64_array(m_value, &values))) {
+        values.clear();
     }
 
-    return valueBytes;
+    return values;
 }
 
-static int8_t bson_value_to_int8(const void *valuePtr)
+BSONDocument::BSONDocument(const QByteArray &document)
+    : BSONDocument(document, document.constData(), document.count())
 {
-    return ((int8_t *) valuePtr)[0];
 }
 
-static int32_t bson_value_to_int32(const void *valuePtr)
+BSONDocument::BSONDocument(const QByteArray &buffer, const char *data, int size)
+    : m_buffer(buffer)
+    , m_data(data)
+    , m_size(size)
+    , m_indexed(false)
+    , m_validity(Validity::Unknown)
+    , m_dateTimeSpec(Qt::LocalTime)
 {
-    return (int32_t) read_uint32(valuePtr);
 }
 
-static int64_t bson_value_to_int64(const void *valuePtr)
+void BSONDocument::index() const
 {
-    return (int64_t) read_uint64(valuePtr);
+    if (m_indexed) {
+        return;
+    }
+
+    m_indexed = true;
+    m_fields.clear();
+
+    // Elements which do not fit in the document are not iterated: lookups will not see them
+    for (const BSONElement &element : *this) {
+        Field field = { (uint32_t) (element.m_key - m_data), element.m_keySize, element.m_valueSize, (uint8_t) element.m_type };
+        m_fields.append(field);
+    }
 }
 
-static double bson_value_to_double(const void *valuePtr)
+BSONDocument::const_iterator BSONDocument::begin() const
 {
-    union data64 {
-        uint64_t u64value;
-        double dvalue;
-    } v;
-    v.u64value = read_uint64(valuePtr);
-    return v.dvalue;
+    if (Q_UNLIKELY(m_size < 5)) {
+        return const_iterator();
+    }
+
+    int32_t declaredLen = bson_document_size(m_data);
+    if (Q_UNLIKELY(declaredLen < 5)) {
+        return const_iterator();
+    }
+
+    // The last byte is the document terminator
+    return const_iterator(this, 4, qMin(declaredLen, m_size) - 1);
 }
 
-static int bson_check_validity(const void *document, unsigned int fileSize)
+BSONDocument::const_iterator::const_iterator(const BSONDocument *document, uint32_t offset, uint32_t end)
+    : m_end(end)
 {
-    const char *docBytes = (const char *) document;
-    uint32_t docLen = read_uint32(document);
-    int offset;
+    m_element.m_document = document;
+    read(offset);
+}
 
-    if (!fileSize) {
-        qWarning() << "Empty buffer: no BSON document found";
-        return 0;
+BSONDocument::const_iterator &BSONDocument::const_iterator::operator++()
+{
+    if (Q_LIKELY(m_element.m_key)) {
+        read(m_element.m_value + m_element.m_valueSize - m_element.m_document->m_data);
     }
 
-    if ((docLen == 5) && (fileSize >= 5) && (docBytes[4] == 0)) {
-        // empty document
-        return 1;
-    }
+    return *this;
+}
 
-    if (fileSize < 4 + 1 + 2 + 1) {
-        qWarning() << "BSON data too small";
-        return 0;
-    }
+void BSONDocument::const_iterator::read(uint32_t offset)
+{
+    const char *docBytes = m_element.m_document->m_data;
+
+    if (offset + 1 < m_end) {
+        const char *key = docBytes + offset + 1;
+        const char *keyEnd = (const char *) memchr(key, '\0', m_end - offset - 1);
 
-    if (docLen > fileSize) {
-        qWarning() << "BSON document is bigger than data: data: " << fileSize << " document: " << docLen;
-        return 0;
+        if (Q_LIKELY(keyEnd)) {
+            uint8_t type = (uint8_t) docBytes[offset];
+            uint32_t valueOffset = keyEnd - docBytes + 1;
+            uint32_t valueEnd = bson_value_end(docBytes, valueOffset, type, m_end);
+
+            if (Q_LIKELY(valueEnd)) {
+                m_element.m_key = key;
+                m_element.m_keySize = keyEnd - key;
+                m_element.m_value = docBytes + valueOffset;
+                m_element.m_valueSize = valueEnd - valueOffset;
+                m_element.m_type = (BSONType) type;
+                return;
+            }
+        }
     }
 
-    if (docBytes[docLen - 1] != 0) {
-        qWarning() << "BSON document is not terminated by null byte.";
-        return 0;
+    m_element = BSONElement();
+}
+
+const BSONDocument::Field *BSONDocument::findField(const char *name) const
+{
+    if (!m_indexed) {
+        index();
     }
 
-    offset = 4;
-    switch (docBytes[offset]) {
-       case TYPE_DOUBLE:
-       case TYPE_STRING:
-       case TYPE_DOCUMENT:
-       case TYPE_BINARY:
-       case TYPE_BOOLEAN:
-       case TYPE_DATETIME:
-       case TYPE_INT32:
-       case TYPE_INT64:
-       break;
+    const char *docBytes = m_data;
+    const uint32_t nameLen = strlen(name);
 
-       default:
-           qWarning() << "Unrecognized BSON document first type\n";
-           return 0;
+    for (const Field &field : m_fields) {
+        if (field.keySize == nameLen && !memcmp(docBytes + field.keyOffset, name, nameLen)) {
+            return &field;
+        }
     }
 
-    return 1;
+    return nullptr;
 }
 
-static int32_t bson_document_size(const void *document)
+const char *BSONDocument::lookup(const char *name, uint8_t *type) const
 {
-    return read_uint32(document);
+    const Field *field = findField(name);
+
+    if (!field) {
+        return nullptr;
+    }
+
+    if (type) {
+        *type = field->type;
+    }
+    return m_data + field->keyOffset + field->keySize + 1;
 }
 
-BSONDocument::BSONDocument(const QByteArray &document)
-    : m_doc(document)
+BSONElement BSONDocument::element(const char *name) const
 {
+    BSONElement element;
+    const Field *field = findField(name);
+
+    if (field) {
+        element.m_document = this;
+        element.m_key = m_data + field->keyOffset;
+        element.m_keySize = field->keySize;
+        element.m_value = element.m_key + field->keySize + 1;
+        element.m_valueSize = field->valueSize;
+        element.m_type = (BSONType) field->type;
+    }
+
+    return element;
 }
 
 int BSONDocument::size() const
 {
-    if (Q_LIKELY(m_doc.count() >= 4)) {
-        return bson_document_size(m_doc.constData());
+    if (Q_LIKELY(m_size >= 4)) {
+        return bson_document_size(m_data);
     }
 
     return 0;
@@ -285,18 +356,22 @@ int BSONDocument::size() const
 
 bool BSONDocument::isValid() const
 {
-    return !m_doc.isEmpty() && bson_check_validity(m_doc.constData(), m_doc.count());
+    if (m_validity == Validity::Unknown) {
+        m_validity = m_size > 0 && bson_validate(m_data, m_size) ? Validity::Valid : Validity::Invalid;
+    }
+
+    return m_validity == Validity::Valid;
 }
 
 bool BSONDocument::contains(const char *name) const
 {
-    return bson_key_lookup(name, m_doc.constData(), nullptr);
+    return lookup(name, nullptr);
 }
 
 QVariant BSONDocument::value(const char *name, QVariant defaultValue) const
 {
     uint8_t type;
-    const void *value = bson_key_lookup(name, m_doc.constData(), &type);
+    const void *value = lookup(name, &type);
 
     if (Q_UNLIKELY(!value)) {
         return defaultValue;
@@ -306,10 +381,14 @@ QVariant BSONDocument::value(const char *name, QVariant defaultValue) const
         case TYPE_DOUBLE:
             return QVariant(bson_value_to_double(value));
 
-        case TYPE_STRING:
-            return QVariant(QString::fromUtf8(bson_value_to_string(value, nullptr)));
+        case TYPE_STRING: {
+            uint32_t len = 0;
+            const char *data = bson_value_to_string(value, &len);
+            return QVariant(bson_utf8_to_string(data, len));
+        }
 
-        case TYPE_DOCUMENT: {
+        case TYPE_DOCUMENT:
+        case TYPE_ARRAY: {
             uint32_t len = 0;
             const char *subdocumentData = (const char *) bson_value_to_document(value, &len);
             return QVariant(QByteArray(subdocumentData, len));
@@ -323,7 +402,7 @@ QVariant BSONDocument::value(const char *name, QVariant defaultValue) const
             return QVariant((bool) (bson_value_to_int8(value) == '\1'));
 
         case TYPE_DATETIME:
-            return QVariant(QDateTime::fromMSecsSinceEpoch(bson_value_to_int64(value)).toLocalTime());
+            return QVariant(QDateTime::fromMSecsSinceEpoch(bson_value_to_int64(value), m_dateTimeSpec));
 
         case TYPE_INT32:
             return QVariant(bson_value_to_int32(value));
@@ -339,7 +418,7 @@ QVariant BSONDocument::value(const char *name, QVariant defaultValue) const
 double BSONDocument::doubleValue(const char *name, double defaultValue) const
 {
     uint8_t type;
-    const void *value = bson_key_lookup(name, m_doc.constData(), &type);
+    const void *value = lookup(name, &type);
 
     if (Q_LIKELY(value)) {
         if (type == TYPE_DOUBLE) {
@@ -359,48 +438,107 @@ double BSONDocument::doubleValue(const char *name, double defaultValue) const
 QByteArray BSONDocument::byteArrayValue(const char *name, const QByteArray &defaultValue) const
 {
     uint8_t type;
-    const void *value = bson_key_lookup(name, m_doc.constData(), &type);
+    const void *value = lookup(name, &type);
+
+    if (value && (type == TYPE_STRING || type == TYPE_BINARY)) {
+        return bson_value_to_byte_array(type, (const char *) value);
+    }
+
+    return defaultValue;
+}
+
+BSONView BSONDocument::byteArrayView(const char *name) const
+{
+    uint8_t type;
+    const void *value = lookup(name, &type);
 
-    const char *data;
     if (value && (type == TYPE_STRING)) {
-        data = bson_value_to_string(value, nullptr);
-        return QByteArray(data);
+        uint32_t len = 0;
+        const char *data = bson_value_to_string(value, &len);
+        return BSONView(m_buffer, data, len);
 
     } else if (value && (type == TYPE_BINARY)) {
         uint32_t len = 0;
-        data = bson_value_to_binary(value, &len);
-        return QByteArray(data, len);
+        const char *data = bson_value_to_binary(value, &len);
+        return BSONView(m_buffer, data, len);
     }
 
-    return defaultValue;
+    return BSONView();
+}
+
+QLatin1String BSONDocument::latin1StringView(const char *name) const
+{
+    uint8_t type;
+    const void *value = lookup(name, &type);
+
+    if (value && (type == TYPE_STRING)) {
+        uint32_t len = 0;
+        const char *data = bson_value_to_string(value, &len);
+        return QLatin1String(data, len);
+    }
+
+    return QLatin1String();
 }
 
 QString BSONDocument::stringValue(const char *name, const QString &defaultValue) const
 {
-    QByteArray encoded = byteArrayValue(name);
-    if (encoded.isEmpty()) {
+    uint8_t type;
+    const void *value = lookup(name, &type);
+
+    // Decode straight from the document: no temporary QByteArray, and no strlen
+    uint32_t len = 0;
+    const char *data = nullptr;
+    if (value && (type == TYPE_STRING)) {
+        data = bson_value_to_string(value, &len);
+    } else if (value && (type == TYPE_BINARY)) {
+        data = bson_value_to_binary(value, &len);
+    }
+
+    if (!data || !len) {
         return defaultValue;
-    } else {
-        return QString::fromUtf8(encoded);
     }
+
+    return bson_utf8_to_string(data, len);
 }
 
 QDateTime BSONDocument::dateTimeValue(const char *name, const QDateTime &defaultValue) const
 {
     uint8_t type;
-    const void *value = bson_key_lookup(name, m_doc.constData(), &type);
+    const void *value = lookup(name, &type);
 
     if (Q_LIKELY(value && (type == TYPE_DATETIME))) {
-        return QDateTime::fromMSecsSinceEpoch(bson_value_to_int64(value)).toLocalTime();
+        return QDateTime::fromMSecsSinceEpoch(bson_value_to_int64(value), m_dateTimeSpec);
     }
 
     return defaultValue;
 }
 
+int64_t BSONDocument::dateTimeMSecsValue(const char *name, int64_t defaultValue) const
+{
+    uint8_t type;
+    const void *value = lookup(name, &type);
+
+    if (Q_LIKELY(value && (type == TYPE_DATETIME))) {
+        return bson_value_to_int64(value);
+    }
+
+    return defaultValue;
+}
+
+Qt::TimeSpec BSONDocument::dateTimeSpec() const
+{
+    return m_dateTimeSpec;
+}
+
+void BSONDocument::setDateTimeSpec(Qt::TimeSpec spec)
+{
+    m_dateTimeSpec = spec == Qt::UTC ? Qt::UTC : Qt::LocalTime;
+}
+
 int32_t BSONDocument::int32Value(const char *name, int32_t defaultValue) const
 {
     uint8_t type;
-    const void *value = bson_key_lookup(name, m_doc.constData(), &type);
+    const void *value = lookup(name, &type);
 
     if (Q_LIKELY(value && (type == TYPE_INT32))) {
         return bson_value_to_int32(value);
@@ -412,7 +550,7 @@ int32_t BSONDocument::int32Value(const char *name, int32_t defaultValue) const
 int64_t BSONDocument::int64Value(const char *name, int64_t defaultValue) const
 {
     uint8_t type;
-    const void *value = bson_key_lookup(name, m_doc.constData(), &type);
+    const void *value = lookup(name, &type);
 
     if (Q_LIKELY(value)) {
         if (type == TYPE_INT64) {
@@ -428,7 +566,7 @@ int64_t BSONDocument::int64Value(const char *name, int64_t defaultValue) const
 bool BSONDocument::booleanValue(const char *name, bool defaultValue) const
 {
     uint8_t type;
-    const void *value = bson_key_lookup(name, m_doc.constData(), &type);
+    const void *value = lookup(name, &type);
 
     if (Q_LIKELY(value && (type == TYPE_BOOLEAN))) {
         return bson_value_to_int8(value) == '\1';
@@ -437,16 +575,50 @@ bool BSONDocument::booleanValue(const char *name, bool defaultValue) const
     return defaultValue;
 }
 
+QVector<double> BSONDocument::doubleArrayValue(const char *name) const
+{
+    uint8_t type;
+    const char *value = lookup(name, &type);
+    QVector<double> values;
+
+    if (value && (type == TYPE_ARRAY) && Q_UNLIKELY(!bson_decode_double_array(value, &values))) {
+        values.clear();
+    }
+
+    return values;
+}
+
+QVector<int64_t> BSONDocument::int64ArrayValue(const char *name) const
+{
+    uint8_t type;
+    const char *value = lookup(name, &type);
+    QVector<int64_t> values;
+
+    if (value && (type == TYPE_ARRAY) && Q_UNLIKELY(!bson_decode_int64_array(value, &values))) {
+        values.clear();
+    }
+
+    return values;
+}
+
 BSONDocument BSONDocument::subdocument(const char *name) const
 {
     uint8_t type;
-    const void *value = bson_key_lookup(name, m_doc.constData(), &type);
+    const void *value = lookup(name, &type);
 
     if (Q_LIKELY(value && (type == TYPE_DOCUMENT))) {
         uint32_t len = 0;
         const char *subdocumentData = (const char *) bson_value_to_document(value, &len);
         if (len) {
-            return BSONDocument(QByteArray(subdocumentData, len));
+            // Never let the view reach past the parent's end: validation will catch the inconsistency.
+            uint32_t available = m_data + m_size - subdocumentData;
+            BSONDocument subdocument(m_buffer, subdocumentData, qMin(len, available));
+            // Validation is recursive: embedded documents of a valid document are valid as well
+            if (m_validity == Validity::Valid) {
+                subdocument.m_validity = Validity::Valid;
+            }
+            subdocument.m_dateTimeSpec = m_dateTimeSpec;
+            return subdocument;
         }
     }
 
@@ -457,8 +629,8 @@ QHash<QByteArray, QByteArray> BSONDocument::byteArrayValuesHash() const
 {
     QHash<QByteArray, QByteArray> tmp;
 
-    for (const void *item = bson_first_item(m_doc.constData()); item != nullptr; item = bson_next_item(m_doc.constData(), item)) {
-        tmp.insert(QByteArray(bson_key(item)), byteArrayValue(bson_key(item)));
+    for (const BSONElement &element : *this) {
+        tmp.insert(QByteArray(element.keyData(), element.keySize()), element.toByteArray());
     }
 
     return tmp;
@@ -466,7 +638,7 @@ QHash<QByteArray, QByteArray> BSONDocument::byteArrayValuesHash() const
 
 QByteArray BSONDocument::toByteArray() const
 {
-    return m_doc;
+    return BSONView(m_buffer, m_data, m_size).toByteArray();
 }
 
 } // Utils
@@ -4,7 +4,13 @@
 #include <QtCore/QByteArray>
 #include <QtCore/QDateTime>
 #include <QtCore/QHash>
+#include <QtCore/QString>
+#include <QtCore/QVarLengthArray>
 #include <QtCore/QVariant>
+#include <QtCore/QVector>
+
+#include <iterator>
+#include <utility>
 
 namespace Hyperspace
 {
@@ -12,11 +18,194 @@ namespace Hyperspace
 namespace Util
 {
 
+/**
+ * @brief A read-only view over a range of a BSON buffer
+ *
+ * BSONView borrows the bytes of the buffer it was taken from and keeps that buffer alive through
+ * QByteArray's implicit sharing, so that no copy happens until one is explicitly requested.
+ */
+class BSONView
+{
+    public:
+        BSONView();
+        BSONView(const QByteArray &owner, const char *data, int size);
+
+        inline bool isNull() const { return !m_data; }
+        inline bool isEmpty() const { return m_size == 0; }
+        inline const char *constData() const { return m_data; }
+        inline int size() const { return m_size; }
+
+        /// @returns A deep copy of the viewed bytes, or the owner itself if the view spans all of it.
+        QByteArray toByteArray() const;
+        /**
+         * @returns A QByteArray pointing to the viewed bytes without copying them.
+         *
+         * @note The returned array does not own its data: it is valid only as long as this view, or the
+         *       buffer it was taken from, is alive.
+         */
+        QByteArray toRawByteArray() const;
+
+        bool operator==(const QByteArray &other) const;
+        inline bool operator!=(const QByteArray &other) const { return !operator==(other); }
+
+    private:
+        QByteArray m_owner;
+        const char *m_data;
+        int m_size;
+};
+
+class BSONDocument;
+
+/// The types of BSON values understood by BSONDocument. Values match the type bytes of the encoding.
+enum class BSONType : uint8_t {
+    Double = 0x01,
+    String = 0x02,
+    Document = 0x03,
+    Array = 0x04,
+    Binary = 0x05,
+    Boolean = 0x08,
+    DateTime = 0x09,
+    Int32 = 0x10,
+    Int64 = 0x12
+};
+
+/// A UTF-8 string value, as handed out by BSONElement::visit. It points into the document and is not NUL terminated.
+struct BSONStringView {
+    const char *data;
+    int size;
+};
+
+/// A binary value, as handed out by BSONElement::visit. It points into the document.
+struct BSONBinaryView {
+    const char *data;
+    int size;
+};
+
+/// A datetime value, as handed out by BSONElement::visit: milliseconds since the epoch, in UTC.
+struct BSONDateTime {
+    int64_t msecsSinceEpoch;
+};
+
+/**
+ * @brief A single element of a BSONDocument
+ *
+ * Elements are handed out by BSONDocument's iterator and point into the document they were read from,
+ * which must outlive them. Reading an element never allocates, unless its value is explicitly copied.
+ */
+class BSONElement
+{
+    public:
+        BSONElement();
+
+        inline bool isNull() const { return !m_key; }
+        inline BSONType type() const { return m_type; }
+
+        /// @returns The key of this element. It is NUL terminated within the document.
+        inline const char *keyData() const { return m_key; }
+        inline int keySize() const { return m_keySize; }
+        BSONView key() const;
+        /// @returns The encoded value of this element, length prefix included.
+        BSONView value() const;
+
+        double toDouble(double defaultValue = 0.0) const;
+        /// @returns The contents of a string or binary value, without copying them.
+        BSONView byteArrayView() const;
+        QByteArray toByteArray(const QByteArray &defaultValue = QByteArray()) const;
+        QString toString(const QString &defaultValue = QString()) const;
+        /// See BSONDocument::latin1StringView
+        QLatin1String toLatin1String() const;
+        /// @returns The datetime value, in the time spec of the document it was read from.
+        QDateTime toDateTime(const QDateTime &defaultValue = QDateTime()) const;
+        int32_t toInt32(int32_t defaultValue = 0) const;
+        int64_t toInt64(int64_t defaultValue = 0) const;
+        bool toBoolean(bool defaultValue = false) const;
+        /// @returns The embedded document or array held by this element. Arrays are documents keyed by index.
+        BSONDocument toDocument() const;
+        /// See BSONDocument::doubleArrayValue
+        QVector<double> toDoubleArray() const;
+        /// See BSONDocument::int64ArrayValue
+        QVector<int64_t> toInt64Array() const;
+        /// @returns The milliseconds since the epoch of a datetime value, without going through QDateTime.
+        int64_t toMSecsSinceEpoch(int64_t defaultValue = 0) const;
+
+        /**
+         * @brief Hands the native value of this element to @p visitor
+         *
+         * The visitor is called with exactly one of double, int32_t, int64_t, bool, BSONStringView,
+         * BSONBinaryView, BSONDateTime, or with this element itself for documents and arrays. Nothing is
+         * copied or converted on the way, which makes this cheaper than going through QVariant:
+         *
+         * @code
+         * struct Printer {
+         *     void operator()(BSONStringView string) { qDebug() << QByteArray::fromRawData(string.data, string.size); }
+         *     void operator()(BSONDateTime dateTime) { qDebug() << dateTime.msecsSinceEpoch; }
+         *     template <typename T> void operator()(const T &) { }
+         * };
+         * element.visit(Printer());
+         * @endcode
+         */
+        template <typename Visitor>
+        void visit(Visitor &&visitor) const;
+
+    private:
+        friend class BSONDocument;
+
+        const BSONDocument *m_document;
+        const char *m_key;
+        const char *m_value;
+        uint32_t m_keySize;
+        uint32_t m_valueSize;
+        BSONType m_type;
+};
+
 class BSONDocument
 {
     public:
+        /**
+         * @brief Forward iterator over the elements of a BSONDocument
+         *
+         * Iterating walks the document in place: it neither allocates nor builds the field index.
+         * Iteration stops at the first element which does not fit in the document.
+         */
+        class const_iterator
+        {
+            public:
+                typedef std::forward_iterator_tag iterator_category;
+                typedef BSONElement value_type;
+                typedef std::ptrdiff_t difference_type;
+                typedef const BSONElement *pointer;
+                typedef const BSONElement &reference;
+
+                inline const_iterator() : m_end(0) {}
+
+                inline reference operator*() const { return m_element; }
+                inline pointer operator->() const { return &m_element; }
+
+                const_iterator &operator++();
+                inline const_iterator operator++(int) { const_iterator it = *this; operator++(); return it; }
+
+                inline bool operator==(const const_iterator &other) const { return m_element.m_key == other.m_element.m_key; }
+                inline bool operator!=(const const_iterator &other) const { return m_element.m_key != other.m_element.m_key; }
+
+            private:
+                friend class BSONDocument;
+
+                const_iterator(const BSONDocument *document, uint32_t offset, uint32_t end);
+                void read(uint32_t offset);
+
+                BSONElement m_element;
+                uint32_t m_end;
+        };
+        typedef const_iterator iterator;
+
         BSONDocument(const QByteArray &document);
         int size() const;
+        /**
+         * @returns Whether the whole document, embedded documents included, is well formed.
+         *
+         * The document is checked once and the outcome is cached, so calling this method again is free.
+         * Subdocuments of a valid document are known to be valid without checking them again.
+         */
         bool isValid() const;
         bool contains(const char *name) const;
 
@@ -24,21 +213,182 @@ class BSONDocument
 
         double doubleValue(const char *name, double defaultValue = 0.0) const;
         QByteArray byteArrayValue(const char *name, const QByteArray &defaultValue = QByteArray()) const;
+        /// Like byteArrayValue, but borrows the string or binary value from this document instead of copying it.
+        BSONView byteArrayView(const char *name) const;
         QString stringValue(const char *name, const QString &defaultValue = QString()) const;
+        /**
+         * @returns The string @p name as a QLatin1String pointing into this document, or a null QLatin1String.
+         *
+         * Meant for ASCII values like interface names and paths, which can then be compared or converted
+         * without any UTF-8 decoding. The view is valid as long as this document's buffer is alive.
+         */
+        QLatin1String latin1StringView(const char *name) const;
         QDateTime dateTimeValue(const char *name, const QDateTime &defaultValue = QDateTime()) const;
+        /// @returns The milliseconds since the epoch of the datetime @p name, without going through QDateTime.
+        int64_t dateTimeMSecsValue(const char *name, int64_t defaultValue = 0) const;
         int32_t int32Value(const char *name, int32_t defaultValue = 0) const;
         int64_t int64Value(const char *name, int64_t defaultValue = 0) const;
         bool booleanValue(const char *name, bool defaultValue = false) const;
 
+        /**
+         * @returns The values of the array @p name, decoded in a single pass.
+         *
+         * Integer elements are converted to double. An empty vector is returned if @p name is missing,
+         * is not an array, or holds anything but numbers.
+         */
+        QVector<double> doubleArrayValue(const char *name) const;
+        /// Like doubleArrayValue, for arrays of int32 or int64 elements.
+        QVector<int64_t> int64ArrayValue(const char *name) const;
+
+        /// @returns The embedded document @p name. It shares this document's buffer, no data is copied.
         BSONDocument subdocument(const char *name) const;
         QHash<QByteArray, QByteArray> byteArrayValuesHash() const;
 
+        /// @returns The element @p name, or a null element if there is none.
+        BSONElement element(const char *name) const;
+        /**
+         * @brief Hands the native value of @p name to @p visitor, as BSONElement::visit does
+         *
+         * @returns false if there is no element named @p name.
+         */
+        template <typename Visitor>
+        bool visit(const char *name, Visitor &&visitor) const;
+        /// Calls @p visitor with the key of each element, as a NUL terminated string, and its native value.
+        template <typename Visitor>
+        void forEachTyped(Visitor &&visitor) const;
+
+        const_iterator begin() const;
+        inline const_iterator end() const { return const_iterator(); }
+        inline const_iterator constBegin() const { return begin(); }
+        inline const_iterator constEnd() const { return end(); }
+
         QByteArray toByteArray() const;
 
+        /// @returns The time spec of the QDateTimes returned by this document. Defaults to Qt::LocalTime.
+        Qt::TimeSpec dateTimeSpec() const;
+        /**
+         * @brief Sets the time spec of the QDateTimes returned by this document
+         *
+         * BSON datetimes are UTC. By default they are converted to local time, which costs a time zone
+         * lookup on every value: with Qt::UTC they are returned as they are encoded. Only Qt::LocalTime
+         * and Qt::UTC are supported. Subdocuments inherit the time spec of their parent.
+         */
+        void setDateTimeSpec(Qt::TimeSpec spec);
+
+        /**
+         * @brief Builds the field index of this document
+         *
+         * Walks the document once and records the type and offset of each field, so that
+         * lookups done afterwards are a short probe over a packed array instead of a rescan of
+         * the whole buffer. The index is built lazily by the first lookup anyway: calling this
+         * method is only needed to pay the cost upfront.
+         *
+         * @note The index is cached in the document: do not share a BSONDocument between threads
+         *       before it has been indexed.
+         */
+        void index() const;
+
     private:
-        const QByteArray m_doc;
+        friend class BSONElement;
+
+        struct Field {
+            uint32_t keyOffset;
+            uint32_t keySize;
+            uint32_t valueSize;
+            uint8_t type;
+        };
+
+        enum class Validity : uint8_t {
+            Unknown,
+            Valid,
+            Invalid
+        };
+
+        BSONDocument(const QByteArray &buffer, const char *data, int size);
+
+        /// Passes the key along with the value to a forEachTyped visitor
+        template <typename Visitor>
+        struct KeyedVisitor {
+            inline KeyedVisitor(Visitor &visitor, const char *key) : visitor(visitor), key(key) {}
+            template <typename T>
+            inline void operator()(const T &value) const { visitor(key, value); }
+
+            Visitor &visitor;
+            const char *key;
+        };
+
+        const Field *findField(const char *name) const;
+        const char *lookup(const char *name, uint8_t *type) const;
+
+        QByteArray m_buffer;
+        const char *m_data;
+        int m_size;
+        mutable QVarLengthArray<Field, 8> m_fields;
+        mutable bool m_indexed;
+        mutable Validity m_validity;
+        Qt::TimeSpec m_dateTimeSpec;
 };
 
+template <typename Visitor>
+void BSONElement::visit(Visitor &&visitor) const
+{
+    switch (m_type) {
+        case BSONType::Double:
+            visitor(toDouble());
+            break;
+        case BSONType::String: {
+            // int32 (length) + string + '\0'
+            BSONStringView string = { m_value + 4, (int) m_valueSize - 5 };
+            visitor(string);
+            break;
+        }
+        case BSONType::Binary: {
+            // int32 (length) + byte (subtype) + data
+            BSONBinaryView binary = { m_value + 5, (int) m_valueSize - 5 };
+            visitor(binary);
+            break;
+        }
+        case BSONType::Boolean:
+            visitor(toBoolean());
+            break;
+        case BSONType::DateTime: {
+            BSONDateTime dateTime = { toMSecsSinceEpoch() };
+            visitor(dateTime);
+            break;
+        }
+        case BSONType::Int32:
+            visitor(toInt32());
+            break;
+        case BSONType::Int64:
+            visitor(toInt64());
+            break;
+        case BSONType::Document:
+        case BSONType::Array:
+            visitor(*this);
+            break;
+    }
+}
+
+template <typename Visitor>
+bool BSONDocument::visit(const char *name, Visitor &&visitor) const
+{
+    BSONElement found = element(name);
+    if (found.isNull()) {
+        return false;
+    }
+
+    found.visit(std::forward<Visitor>(visitor));
+    return true;
+}
+
+template <typename Visitor>
+void BSONDocument::forEachTyped(Visitor &&visitor) const
+{
+    for (const BSONElement &element : *this) {
+        element.visit(KeyedVisitor<Visitor>(visitor, element.keyData()));
+    }
+}
+
 } // Util
 } // Hyperspace
 
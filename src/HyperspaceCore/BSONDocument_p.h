@@ -0,0 +1,422 @@
+#ifndef _HYPERSPACE_BSONDOCUMENT_P_H_
+#define _HYPERSPACE_BSONDOCUMENT_P_H_
+
+#include <QtCore/QByteArray>
+#include <QtCore/QDebug>
+#include <QtCore/QHash>
+#include <QtCore/QString>
+#include <QtCore/QVector>
+
+#include "BSONEndian_p.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#define TYPE_DOUBLE 0x01
+#define TYPE_STRING 0x02
+#define TYPE_DOCUMENT 0x03
+#define TYPE_ARRAY 0x04
+#define TYPE_BINARY 0x05
+#define TYPE_BOOLEAN 0x08
+#define TYPE_DATETIME 0x09
+#define TYPE_INT32 0x10
+#define TYPE_INT64 0x12
+
+/* Types Hyperspace never produces, known only to skip over them */
+#define TYPE_UNDEFINED 0x06
+#define TYPE_OBJECTID 0x07
+#define TYPE_NULL 0x0A
+#define TYPE_REGEX 0x0B
+#define TYPE_DBPOINTER 0x0C
+#define TYPE_JAVASCRIPT 0x0D
+#define TYPE_SYMBOL 0x0E
+#define TYPE_JAVASCRIPT_WITH_SCOPE 0x0F
+#define TYPE_TIMESTAMP 0x11
+#define TYPE_DECIMAL128 0x13
+#define TYPE_MAXKEY 0x7F
+#define TYPE_MINKEY 0xFF
+
+namespace Hyperspace
+{
+
+namespace Util
+{
+
+static inline uint32_t read_uint32(const void *u)
+{
+    return bson_load_le32(u);
+}
+
+static inline uint64_t read_uint64(const void *u)
+{
+    return bson_load_le64(u);
+}
+
+static inline const char *bson_value_to_string(const void *valuePtr, uint32_t *len)
+{
+    const char *valueBytes = (const char *) valuePtr;
+    uint32_t stringLen = read_uint32(valueBytes);
+
+    if (len) {
+        /* A valid string counts at least its trailing NUL: never let a zero length wrap around */
+        *len = stringLen > 0 ? stringLen - 1 : 0;
+    }
+
+    return valueBytes + 4;
+}
+
+static inline const char *bson_value_to_binary(const void *valuePtr, uint32_t *len)
+{
+    const char *valueBytes = (const char *) valuePtr;
+    uint32_t binLen = read_uint32(valueBytes);
+
+    if (len) {
+        *len = binLen;
+    }
+
+    return valueBytes + 5;
+}
+
+static inline const void *bson_value_to_document(const void *valuePtr, uint32_t *len)
+{
+    const char *valueBytes = (const char *) valuePtr;
+    uint32_t binLen = read_uint32(valueBytes);
+
+    if (len) {
+        *len = binLen;
+    }
+
+    return valueBytes;
+}
+
+static inline int8_t bson_value_to_int8(const void *valuePtr)
+{
+    return ((int8_t *) valuePtr)[0];
+}
+
+static inline int32_t bson_value_to_int32(const void *valuePtr)
+{
+    return (int32_t) read_uint32(valuePtr);
+}
+
+static inline int64_t bson_value_to_int64(const void *valuePtr)
+{
+    return (int64_t) read_uint64(valuePtr);
+}
+
+static inline double bson_value_to_double(const void *valuePtr)
+{
+    return bson_load_le_double(valuePtr);
+}
+
+static inline int32_t bson_document_size(const void *document)
+{
+    return read_uint32(document);
+}
+
+/* Returns the offset right past a value of the given type starting at offset, or 0 if it does not end before end */
+static inline uint32_t bson_value_end(const char *docBytes, uint32_t offset, uint8_t type, uint32_t end)
+{
+    uint64_t valueEnd;
+
+    switch (type) {
+        case TYPE_STRING:
+        case TYPE_JAVASCRIPT:
+        case TYPE_SYMBOL:
+        case TYPE_DBPOINTER:
+            if (Q_UNLIKELY(offset + 4 > end)) {
+                return 0;
+            }
+            valueEnd = read_uint32(docBytes + offset);
+            /* The length accounts for the string terminator */
+            if (Q_UNLIKELY(valueEnd < 1)) {
+                return 0;
+            }
+            valueEnd += (uint64_t) offset + 4;
+            if (type == TYPE_DBPOINTER) {
+                /* The string is followed by an ObjectId */
+                valueEnd += 12;
+            }
+            break;
+
+        case TYPE_DOCUMENT:
+        case TYPE_ARRAY:
+            if (Q_UNLIKELY(offset + 4 > end)) {
+                return 0;
+            }
+            valueEnd = read_uint32(docBytes + offset);
+            /* int32 (len) + '\0' at least */
+            if (Q_UNLIKELY(valueEnd < 5)) {
+                return 0;
+            }
+            valueEnd += offset;
+            break;
+
+        case TYPE_BINARY:
+            /* int32 (len) + byte (subtype) + len */
+            if (Q_UNLIKELY(offset + 5 > end)) {
+                return 0;
+            }
+            valueEnd = (uint64_t) offset + 5 + read_uint32(docBytes + offset);
+            break;
+
+        case TYPE_INT32:
+            valueEnd = (uint64_t) offset + sizeof(int32_t);
+            break;
+
+        case TYPE_DOUBLE:
+        case TYPE_DATETIME:
+        case TYPE_INT64:
+            valueEnd = (uint64_t) offset + sizeof(int64_t);
+            break;
+
+        case TYPE_BOOLEAN:
+            valueEnd = (uint64_t) offset + 1;
+            break;
+
+        case TYPE_UNDEFINED:
+        case TYPE_NULL:
+        case TYPE_MINKEY:
+        case TYPE_MAXKEY:
+            valueEnd = offset;
+            break;
+
+        case TYPE_OBJECTID:
+            valueEnd = (uint64_t) offset + 12;
+            break;
+
+        case TYPE_TIMESTAMP:
+            valueEnd = (uint64_t) offset + sizeof(uint64_t);
+            break;
+
+        case TYPE_DECIMAL128:
+            valueEnd = (uint64_t) offset + 16;
+            break;
+
+        case TYPE_REGEX: {
+            /* Two cstrings: the pattern and the options */
+            const char *pattern = offset < end ? (const char *) memchr(docBytes + offset, '\0', end - offset) : nullptr;
+            if (Q_UNLIKELY(!pattern)) {
+                return 0;
+            }
+            uint32_t optionsOffset = pattern - docBytes + 1;
+            const char *options = optionsOffset < end ? (const char *) memchr(docBytes + optionsOffset, '\0', end - optionsOffset) : nullptr;
+            if (Q_UNLIKELY(!options)) {
+                return 0;
+            }
+            valueEnd = (uint64_t) (options - docBytes) + 1;
+            break;
+        }
+
+        case TYPE_JAVASCRIPT_WITH_SCOPE:
+            if (Q_UNLIKELY(offset + 4 > end)) {
+                return 0;
+            }
+            valueEnd = read_uint32(docBytes + offset);
+            /* int32 (len) + string + document, at least 4 + 5 + 5 bytes */
+            if (Q_UNLIKELY(valueEnd < 14)) {
+                return 0;
+            }
+            valueEnd += offset;
+            break;
+
+        default:
+            /* Types this side does not know have no way to be skipped */
+            return 0;
+    }
+
+    return valueEnd <= end ? valueEnd : 0;
+}
+
+/**
+ * Walks once the elements of the document at docBytes, which spans at most size bytes, calling
+ * handler(const char *key, uint32_t keyLen, uint8_t type, const char *value) for each of them.
+ * Every element is bounds checked before being handed out.
+ *
+ * Returns false if the document is malformed or if the handler returned false.
+ */
+template <typename Handler>
+static inline bool bson_walk_elements(const char *docBytes, uint32_t size, Handler &&handler)
+{
+    if (Q_UNLIKELY(size < 5)) {
+        return false;
+    }
+
+    uint32_t docLen = read_uint32(docBytes);
+    if (Q_UNLIKELY(docLen < 5 || docLen > size || docBytes[docLen - 1] != '\0')) {
+        return false;
+    }
+
+    /* The last byte is the document terminator */
+    const uint32_t end = docLen - 1;
+    uint32_t offset = 4;
+    while (offset < end) {
+        uint8_t type = (uint8_t) docBytes[offset];
+        const char *key = docBytes + offset + 1;
+        const char *keyEnd = (const char *) memchr(key, '\0', end - offset - 1);
+        if (Q_UNLIKELY(!keyEnd)) {
+            return false;
+        }
+
+        uint32_t keyLen = keyEnd - key;
+        uint32_t valueOffset = offset + 1 + keyLen + 1;
+        uint32_t next = bson_value_end(docBytes, valueOffset, type, end);
+        if (Q_UNLIKELY(!next)) {
+            return false;
+        }
+
+        if (!handler(key, keyLen, type, docBytes + valueOffset)) {
+            return false;
+        }
+
+        offset = next;
+    }
+
+    return true;
+}
+
+#define BSON_MAXIMUM_NESTING_DEPTH 100
+
+/**
+ * Checks the whole structure of the document at docBytes, which spans at most size bytes, in a single pass:
+ * every element must fit in its parent, every key and string must be terminated and every embedded document
+ * or array must be valid itself, down to BSON_MAXIMUM_NESTING_DEPTH levels.
+ *
+ * Keys are scanned with memchr, which the C library implements with vector instructions.
+ */
+static inline bool bson_validate(const char *docBytes, uint32_t size, int depth = 0)
+{
+    if (Q_UNLIKELY(depth > BSON_MAXIMUM_NESTING_DEPTH)) {
+        return false;
+    }
+
+    return bson_walk_elements(docBytes, size, [depth] (const char *, uint32_t, uint8_t type, const char *value) {
+        switch (type) {
+            case TYPE_STRING:
+            case TYPE_JAVASCRIPT:
+            case TYPE_SYMBOL:
+            case TYPE_DBPOINTER:
+                /* bson_value_end made sure the length is at least 1 */
+                return value[4 + read_uint32(value) - 1] == '\0';
+
+            case TYPE_DOCUMENT:
+            case TYPE_ARRAY:
+                return bson_validate(value, read_uint32(value), depth + 1);
+
+            default:
+                return true;
+        }
+    });
+}
+
+/* Whether the len bytes at data are all 7 bit ASCII. Scans 8 bytes at a time, which compilers vectorize further. */
+static inline bool bson_is_ascii(const char *data, uint32_t len)
+{
+    uint64_t bits = 0;
+    uint32_t i = 0;
+
+    for (; i + sizeof(uint64_t) <= len; i += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, data + i, sizeof(word));
+        bits |= word;
+    }
+    for (; i < len; ++i) {
+        bits |= (uint8_t) data[i];
+    }
+
+    return !(bits & UINT64_C(0x8080808080808080));
+}
+
+/* Decodes len bytes of UTF-8. ASCII, by far the common case, takes the cheaper Latin-1 path, which needs no validation. */
+static inline QString bson_utf8_to_string(const char *data, uint32_t len)
+{
+    if (bson_is_ascii(data, len)) {
+        return QString::fromLatin1(data, len);
+    }
+
+    return QString::fromUtf8(data, len);
+}
+
+/* Same semantics as BSONDocument::byteArrayValue: strings and binaries are copied, anything else is empty */
+static inline QByteArray bson_value_to_byte_array(uint8_t type, const char *value)
+{
+    uint32_t len = 0;
+    if (type == TYPE_STRING) {
+        const char *data = bson_value_to_string(value, &len);
+        return QByteArray(data, len);
+    } else if (type == TYPE_BINARY) {
+        const char *data = bson_value_to_binary(value, &len);
+        return QByteArray(data, len);
+    }
+
+    return QByteArray();
+}
+
+/* Same semantics as BSONDocument::int64Value */
+static inline int64_t bson_value_to_integer(uint8_t type, const char *value, int64_t defaultValue = 0)
+{
+    if (type == TYPE_INT64) {
+        return bson_value_to_int64(value);
+    } else if (type == TYPE_INT32) {
+        return bson_value_to_int32(value);
+    }
+
+    return defaultValue;
+}
+
+/* Decodes an attributes document, whose values must be strings or binaries, in a single pass */
+static inline bool bson_decode_byte_array_hash(const char *value, QHash<QByteArray, QByteArray> *hash)
+{
+    return bson_walk_elements(value, read_uint32(value), [hash] (const char *key, uint32_t keyLen, uint8_t type, const char *value) {
+        hash->insert(QByteArray(key, keyLen), bson_value_to_byte_array(type, value));
+        return true;
+    });
+}
+
+/* Smallest encoded numeric array element: type, one digit key, terminator and a 64 bit value */
+#define BSON_NUMERIC_ARRAY_ELEMENT_SIZE (1 + 2 + 8)
+
+/* Same semantics as BSONDocument::doubleArrayValue: decodes an array of numbers in a single pass */
+static inline bool bson_decode_double_array(const char *value, QVector<double> *values)
+{
+    uint32_t len = read_uint32(value);
+    values->reserve(len / BSON_NUMERIC_ARRAY_ELEMENT_SIZE);
+
+    return bson_walk_elements(value, len, [values] (const char *, uint32_t, uint8_t type, const char *value) {
+        if (type == TYPE_DOUBLE) {
+            values->append(bson_value_to_double(value));
+        } else if (type == TYPE_INT64) {
+            values->append(bson_value_to_int64(value));
+        } else if (type == TYPE_INT32) {
+            values->append(bson_value_to_int32(value));
+        } else {
+            return false;
+        }
+
+        return true;
+    });
+}
+
+/* Same semantics as BSONDocument::int64ArrayValue: decodes an array of integers in a single pass */
+static inline bool bson_decode_int64_array(const char *value, QVector<int64_t> *values)
+{
+    uint32_t len = read_uint32(value);
+    values->reserve(len / BSON_NUMERIC_ARRAY_ELEMENT_SIZE);
+
+    return bson_walk_elements(value, len, [values] (const char *, uint32_t, uint8_t type, const char *value) {
+        if (type == TYPE_INT64) {
+            values->append(bson_value_to_int64(value));
+        } else if (type == TYPE_INT32) {
+            values->append(bson_value_to_int32(value));
+        } else {
+            return false;
+        }
+
+        return true;
+    });
+}
+
+} // Util
+} // Hyperspace
+
+#endif
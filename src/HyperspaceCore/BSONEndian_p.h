@@ -0,0 +1,76 @@
+#ifndef _HYPERSPACE_BSONENDIAN_P_H_
+#define _HYPERSPACE_BSONENDIAN_P_H_
+
+#include <stdint.h>
+#include <string.h>
+
+namespace Hyperspace
+{
+
+namespace Util
+{
+
+/*
+ * BSON is little-endian. The helpers below go through memcpy, which compilers turn into single
+ * (unaligned) loads and stores, and swap bytes only on big-endian hosts.
+ *
+ * The host is a template parameter so that tests can run the big-endian code path on any machine.
+ */
+struct BSONNativeHost
+{
+    static const bool bigEndian = __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__;
+
+    static inline uint32_t load32(const void *src) { uint32_t v; memcpy(&v, src, sizeof(v)); return v; }
+    static inline uint64_t load64(const void *src) { uint64_t v; memcpy(&v, src, sizeof(v)); return v; }
+    static inline void store32(void *dst, uint32_t v) { memcpy(dst, &v, sizeof(v)); }
+    static inline void store64(void *dst, uint64_t v) { memcpy(dst, &v, sizeof(v)); }
+};
+
+template <typename Host = BSONNativeHost>
+static inline uint32_t bson_load_le32(const void *src)
+{
+    uint32_t v = Host::load32(src);
+    return Host::bigEndian ? __builtin_bswap32(v) : v;
+}
+
+template <typename Host = BSONNativeHost>
+static inline uint64_t bson_load_le64(const void *src)
+{
+    uint64_t v = Host::load64(src);
+    return Host::bigEndian ? __builtin_bswap64(v) : v;
+}
+
+template <typename Host = BSONNativeHost>
+static inline void bson_store_le32(void *dst, uint32_t v)
+{
+    Host::store32(dst, Host::bigEndian ? __builtin_bswap32(v) : v);
+}
+
+template <typename Host = BSONNativeHost>
+static inline void bson_store_le64(void *dst, uint64_t v)
+{
+    Host::store64(dst, Host::bigEndian ? __builtin_bswap64(v) : v);
+}
+
+template <typename Host = BSONNativeHost>
+static inline double bson_load_le_double(const void *src)
+{
+    static_assert(sizeof(double) == sizeof(uint64_t), "doubles are expected to be 64 bit wide");
+    uint64_t bits = bson_load_le64<Host>(src);
+    double v;
+    memcpy(&v, &bits, sizeof(v));
+    return v;
+}
+
+template <typename Host = BSONNativeHost>
+static inline void bson_store_le_double(void *dst, double v)
+{
+    uint64_t bits;
+    memcpy(&bits, &v, sizeof(bits));
+    bson_store_le64<Host>(dst, bits);
+}
+
+} // Util
+} // Hyperspace
+
+#endif
@@ -1,12 +1,15 @@
 #include "BSONSerializer.h"
+#include "BSONEndian_p.h"
 
 #include <QByteArray>
+#include <QDebug>
 #include <stdint.h>
-#include <endian.h>
+#include <string.h>
 
 #define BSON_TYPE_DOUBLE    '\x01'
 #define BSON_TYPE_STRING    '\x02'
 #define BSON_TYPE_DOCUMENT  '\x03'
+#define BSON_TYPE_ARRAY     '\x04'
 #define BSON_TYPE_BINARY    '\x05'
 #define BSON_TYPE_BOOLEAN   '\x08'
 #define BSON_TYPE_DATETIME  '\x09'
@@ -15,39 +18,6 @@
 
 #define BSON_SUBTYPE_DEFAULT_BINARY '\0'
 
-#define INT32_TO_BYTES(value, buf) \
-    union data32 { \
-        int64_t sval; \
-        uint64_t uval; \
-        char valBuf[4]; \
-    }; \
-    data32 d32; \
-    d32.sval = (value); \
-    d32.uval = htole32(d32.uval); \
-    buf = d32.valBuf;
-
-#define INT64_TO_BYTES(value, buf) \
-    union data64 { \
-        int64_t sval; \
-        uint64_t uval; \
-        char valBuf[8]; \
-    }; \
-    data64 d64; \
-    d64.sval = (value); \
-    d64.uval = htole64(d64.uval); \
-    buf = d64.valBuf;
-
-#define DOUBLE_TO_BYTES(value, buf) \
-    union data64 { \
-        double dval; \
-        uint64_t uval; \
-        char valBuf[8]; \
-    }; \
-    data64 d64; \
-    d64.dval = (value); \
-    d64.uval = htole64(d64.uval); \
-    buf = d64.valBuf;
-
 namespace Hyperspace
 {
 
@@ -59,35 +29,108 @@ BSONSerializer::BSONSerializer()
 {
 }
 
+BSONSerializer::BSONSerializer(int sizeHint)
+{
+    m_doc.reserve(qMax(sizeHint, 4));
+    m_doc.append("\0\0\0\0", 4);
+}
+
 QByteArray BSONSerializer::document() const
 {
     return m_doc;
 }
 
+void BSONSerializer::reserve(int size)
+{
+    m_doc.reserve(size);
+}
+
+void BSONSerializer::reset()
+{
+    if (Q_UNLIKELY(!m_doc.isDetached())) {
+        // Someone still holds the previous document: leave it alone, but keep our capacity.
+        int capacity = m_doc.capacity();
+        m_doc = QByteArray();
+        m_doc.reserve(capacity);
+        m_doc.append("\0\0\0\0", 4);
+        m_openDocuments.clear();
+        return;
+    }
+
+    m_doc.resize(4);
+    memset(m_doc.data(), 0, 4);
+    m_openDocuments.clear();
+}
+
+int BSONSerializer::stringDocumentSize(const QHash<QByteArray, QByteArray> &strings)
+{
+    int size = emptyDocumentSize();
+    for (QHash<QByteArray, QByteArray>::const_iterator i = strings.constBegin(); i != strings.constEnd(); ++i) {
+        size += 1 + i.key().size() + 1 + 4 + i.value().size() + 1;
+    }
+
+    return size;
+}
+
+/* Number of bytes taken by the keys "0", "1", ... up to count - 1, terminators included */
+static int bson_array_keys_size(int count)
+{
+    int size = 0;
+    int digits = 1;
+    for (int64_t first = 0, next = 10; first < count; first = next, next *= 10, ++digits) {
+        size += (qMin<int64_t>(next, count) - first) * (digits + 1);
+    }
+
+    return size;
+}
+
+/* Increments the decimal number in key, which is keyLen digits long and NUL terminated */
+static inline void bson_increment_array_key(char *key, int *keyLen)
+{
+    for (int i = *keyLen - 1; i >= 0; --i) {
+        if (key[i] != '9') {
+            ++key[i];
+            return;
+        }
+        key[i] = '0';
+    }
+
+    // All nines: 99 becomes 100
+    key[0] = '1';
+    key[*keyLen] = '0';
+    ++*keyLen;
+    key[*keyLen] = '\0';
+}
+
+int BSONSerializer::arrayElementSize(const char *name, int count, int valueSize)
+{
+    return elementSize(name, emptyDocumentSize() + count * (1 + valueSize) + bson_array_keys_size(count));
+}
+
 void BSONSerializer::appendEndOfDocument()
 {
-    m_doc.append('\0');
+    Q_ASSERT(m_openDocuments.isEmpty());
 
-    char *sizeBuf;
-    INT32_TO_BYTES(m_doc.count(), sizeBuf)
+    m_doc.append('\0');
 
-    m_doc.replace(0, 4, QByteArray(sizeBuf, sizeof(int32_t)));
+    // Patch the length prefix in place
+    bson_store_le32(m_doc.data(), m_doc.count());
 }
 
 void BSONSerializer::appendDoubleValue(const char *name, double value)
 {
-    char *valBuf;
-    DOUBLE_TO_BYTES(value, valBuf)
+    char valBuf[sizeof(double)];
+    bson_store_le_double(valBuf, value);
 
     m_doc.append(BSON_TYPE_DOUBLE);
     m_doc.append(name, strlen(name) + 1);
-    m_doc.append(valBuf, 8);
+    m_doc.append(valBuf, sizeof(double));
 }
 
 void BSONSerializer::appendInt32Value(const char *name, int32_t value)
 {
-    char *valBuf;
-    INT32_TO_BYTES(value, valBuf)
+    char valBuf[sizeof(int32_t)];
+    bson_store_le32(valBuf, value);
 
     m_doc.append(BSON_TYPE_INT32);
     m_doc.append(name, strlen(name) + 1);
@@ -96,8 +139,8 @@ void BSONSerializer::appendInt32Value(const char *name, int32_t value)
 
 void BSONSerializer::appendInt64Value(const char *name, int64_t value)
 {
-    char *valBuf;
-    INT64_TO_BYTES(value, valBuf)
+    char valBuf[sizeof(int64_t)];
+    bson_store_le64(valBuf, value);
 
     m_doc.append(BSON_TYPE_INT64);
     m_doc.append(name, strlen(name) + 1);
@@ -106,8 +149,8 @@ void BSONSerializer::appendInt64Value(const char *name, int64_t value)
 
 void BSONSerializer::appendBinaryValue(const char *name, const QByteArray &value)
 {
-    char *lenBuf;
-    INT32_TO_BYTES(value.count(), lenBuf)
+    char lenBuf[sizeof(int32_t)];
+    bson_store_le32(lenBuf, value.count());
 
     m_doc.append(BSON_TYPE_BINARY);
     m_doc.append(name, strlen(name) + 1);
@@ -118,13 +161,13 @@ void BSONSerializer::appendBinaryValue(const char *name, const QByteArray &value
 
 void BSONSerializer::appendASCIIString(const char *name, const QByteArray &string)
 {
-    char *lenBuf;
-    INT32_TO_BYTES(string.count() + 1, lenBuf)
+    char lenBuf[sizeof(int32_t)];
+    bson_store_le32(lenBuf, string.count() + 1);
 
     m_doc.append(BSON_TYPE_STRING);
     m_doc.append(name, strlen(name) + 1);
     m_doc.append(lenBuf, sizeof(int32_t));
-    m_doc.append(string.constData());
+    m_doc.append(string.constData(), string.count());
     m_doc.append('\0');
 }
 
@@ -135,9 +178,14 @@ void BSONSerializer::appendString(const char *name, const QString &string)
 
 void BSONSerializer::appendDateTime(const char *name, const QDateTime &dateTime)
 {
-    int64_t millis = dateTime.toUTC().toMSecsSinceEpoch();
-    char *valBuf;
-    INT64_TO_BYTES(millis, valBuf)
+    // The epoch offset does not depend on the time spec: no need to convert to UTC first
+    appendDateTimeMSecs(name, dateTime.toMSecsSinceEpoch());
+}
+
+void BSONSerializer::appendDateTimeMSecs(const char *name, int64_t msecsSinceEpoch)
+{
+    char valBuf[sizeof(int64_t)];
+    bson_store_le64(valBuf, msecsSinceEpoch);
 
     m_doc.append(BSON_TYPE_DATETIME);
     m_doc.append(name, strlen(name) + 1);
@@ -151,6 +199,57 @@ void BSONSerializer::appendBooleanValue(const char *name, bool value)
     m_doc.append(value ? '\1' : '\0');
 }
 
+void BSONSerializer::appendDoubleArray(const char *name, const double *values, int count)
+{
+    static_assert(sizeof(double) == sizeof(uint64_t), "doubles are expected to be 64 bit wide");
+    appendNumericArray(name, BSON_TYPE_DOUBLE, values, count);
+}
+
+void BSONSerializer::appendInt64Array(const char *name, const int64_t *values, int count)
+{
+    appendNumericArray(name, BSON_TYPE_INT64, values, count);
+}
+
+void BSONSerializer::appendNumericArray(const char *name, char type, const void *values, int count)
+{
+    count = qMax(count, 0);
+
+    const int nameSize = strlen(name) + 1;
+    const int arraySize = emptyDocumentSize() + count * (1 + sizeof(uint64_t)) + bson_array_keys_size(count);
+    const int start = m_doc.count();
+
+    // Grow once, then write every element in place
+    m_doc.resize(start + 1 + nameSize + arraySize);
+    char *out = m_doc.data() + start;
+
+    *out++ = BSON_TYPE_ARRAY;
+    memcpy(out, name, nameSize);
+    out += nameSize;
+
+    bson_store_le32(out, arraySize);
+    out += sizeof(int32_t);
+
+    const char *in = static_cast<const char *>(values);
+    char key[12] = "0";
+    int keyLen = 1;
+    for (int i = 0; i < count; ++i) {
+        *out++ = type;
+        memcpy(out, key, keyLen + 1);
+        out += keyLen + 1;
+
+        // The values may be doubles: copy their bits, rather than reading them through a uint64_t
+        uint64_t bits;
+        memcpy(&bits, in, sizeof(bits));
+        bson_store_le64(out, bits);
+        in += sizeof(uint64_t);
+        out += sizeof(uint64_t);
+
+        bson_increment_array_key(key, &keyLen);
+    }
+
+    *out = '\0';
+}
+
 void BSONSerializer::beginSubdocument(const char *name)
 {
     m_doc.append(BSON_TYPE_DOCUMENT);
@@ -163,6 +262,51 @@ void BSONSerializer::appendDocument(const char *name, const QByteArray &document
     m_doc.append(document);
 }
 
+void BSONSerializer::openDocument(char type, const char *name)
+{
+    m_doc.append(type);
+    m_doc.append(name, strlen(name) + 1);
+
+    // The length prefix gets patched by closeDocument
+    m_openDocuments.append(m_doc.count());
+    m_doc.append("\0\0\0\0", 4);
+}
+
+void BSONSerializer::beginDocument(const char *name)
+{
+    openDocument(BSON_TYPE_DOCUMENT, name);
+}
+
+void BSONSerializer::beginArray(const char *name)
+{
+    openDocument(BSON_TYPE_ARRAY, name);
+}
+
+void BSONSerializer::endDocument()
+{
+    closeDocument();
+}
+
+void BSONSerializer::endArray()
+{
+    closeDocument();
+}
+
+void BSONSerializer::closeDocument()
+{
+    if (Q_UNLIKELY(m_openDocuments.isEmpty())) {
+        qWarning() << "BSONSerializer: endDocument or endArray called without a matching beginDocument or beginArray";
+        return;
+    }
+
+    int start = m_openDocuments.last();
+    m_openDocuments.removeLast();
+
+    m_doc.append('\0');
+
+    bson_store_le32(m_doc.data() + start, m_doc.count() - start);
+}
+
 }
 
 }
@@ -3,6 +3,11 @@
 
 #include <QtCore/QByteArray>
 #include <QtCore/QDateTime>
+#include <QtCore/QHash>
+#include <QtCore/QVarLengthArray>
+#include <QtCore/QVector>
+
+#include <string.h>
 
 namespace Hyperspace
 {
@@ -14,9 +19,25 @@ class BSONSerializer
 {
     public:
         BSONSerializer();
+        /**
+         * @brief Constructs a serializer whose buffer can hold @p sizeHint bytes without growing
+         *
+         * Use the *ElementSize helpers to compute the exact size of the document upfront.
+         */
+        explicit BSONSerializer(int sizeHint);
 
         QByteArray document() const; 
 
+        /// Makes sure the document can grow up to @p size bytes without reallocating.
+        void reserve(int size);
+        /**
+         * @brief Empties the serializer, so that it can be used for a new document
+         *
+         * The buffer's capacity is kept. If a copy of the previous document is still referenced,
+         * the serializer has to allocate a new buffer (of the same capacity) instead.
+         */
+        void reset();
+
         void appendEndOfDocument();
 
         void appendDoubleValue(const char *name, double value);
@@ -27,11 +48,82 @@ class BSONSerializer
         void appendDocument(const char *name, const QByteArray &document);
         void appendString(const char *name, const QString &string);
         void appendDateTime(const char *name, const QDateTime &dateTime);
+        /// Like appendDateTime, for a datetime given as milliseconds since the epoch.
+        void appendDateTimeMSecs(const char *name, int64_t msecsSinceEpoch);
         void appendBooleanValue(const char *name, bool value);
 
+        /// Appends @p count doubles as an array named @p name, in a single write.
+        void appendDoubleArray(const char *name, const double *values, int count);
+        inline void appendDoubleArray(const char *name, const QVector<double> &values) { appendDoubleArray(name, values.constData(), values.count()); }
+        /// Appends @p count 64 bit integers as an array named @p name, in a single write.
+        void appendInt64Array(const char *name, const int64_t *values, int count);
+        inline void appendInt64Array(const char *name, const QVector<int64_t> &values) { appendInt64Array(name, values.constData(), values.count()); }
+
+        /**
+         * @brief Opens an embedded document named @p name
+         *
+         * Every element appended from now on, until the matching endDocument(), goes into the embedded
+         * document, which is written straight into this serializer's buffer. Documents can be nested.
+         */
+        void beginDocument(const char *name);
+        /// Closes the innermost document opened with beginDocument, and writes its length.
+        void endDocument();
+
+        /**
+         * @brief Opens an embedded array named @p name
+         *
+         * Works like beginDocument: elements appended until the matching endArray() go into the array.
+         * BSON arrays are documents keyed by the decimal index of each element, starting from "0":
+         * keys are up to the caller.
+         */
+        void beginArray(const char *name);
+        /// Closes the innermost array opened with beginArray, and writes its length.
+        void endArray();
+
+        /**
+         * @brief Opens an embedded document for the lifetime of the guard
+         *
+         * @code
+         * {
+         *     BSONSerializer::DocumentGuard attributes(serializer, "a");
+         *     serializer.appendASCIIString("key", "value");
+         * }
+         * @endcode
+         */
+        class DocumentGuard
+        {
+            public:
+                inline DocumentGuard(BSONSerializer &serializer, const char *name) : m_serializer(serializer) { m_serializer.beginDocument(name); }
+                inline ~DocumentGuard() { m_serializer.endDocument(); }
+
+            private:
+                Q_DISABLE_COPY(DocumentGuard)
+                BSONSerializer &m_serializer;
+        };
+
+        /// Size of an empty document: length prefix and terminator.
+        static inline int emptyDocumentSize() { return 4 + 1; }
+        /// Size of an element named @p name whose value takes @p valueSize bytes.
+        static inline int elementSize(const char *name, int valueSize) { return 1 + strlen(name) + 1 + valueSize; }
+        static inline int int32ElementSize(const char *name) { return elementSize(name, sizeof(int32_t)); }
+        static inline int int64ElementSize(const char *name) { return elementSize(name, sizeof(int64_t)); }
+        static inline int stringElementSize(const char *name, int length) { return elementSize(name, 4 + length + 1); }
+        static inline int binaryElementSize(const char *name, int length) { return elementSize(name, 4 + 1 + length); }
+        /// Size of a document made of the string elements in @p strings.
+        static int stringDocumentSize(const QHash<QByteArray, QByteArray> &strings);
+        /// Size of an array element named @p name holding @p count values of @p valueSize bytes each.
+        static int arrayElementSize(const char *name, int count, int valueSize);
+        static inline int doubleArrayElementSize(const char *name, int count) { return arrayElementSize(name, count, sizeof(double)); }
+        static inline int int64ArrayElementSize(const char *name, int count) { return arrayElementSize(name, count, sizeof(int64_t)); }
+
     private:
         void beginSubdocument(const char *name);
+        void openDocument(char type, const char *name);
+        void closeDocument();
+        /// @p values holds @p count values, 64 bit wide each.
+        void appendNumericArray(const char *name, char type, const void *values, int count);
         QByteArray m_doc;
+        QVarLengthArray<int, 4> m_openDocuments;
 };
 
 }
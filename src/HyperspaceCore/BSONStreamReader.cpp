@@ -1,65 +1,206 @@
 #include "BSONStreamReader.h"
 
-#include "BSONDocument.h"
+#include "BSONDocument_p.h"
+
+#include <QtCore/QDebug>
+
+#include <string.h>
+
+// Length prefix and terminator
+#define MINIMUM_DOCUMENT_SIZE 5
+#define DEFAULT_MAXIMUM_DOCUMENT_SIZE (64 * 1024 * 1024)
 
 using namespace Hyperspace::Util;
 
 BSONStreamReader::BSONStreamReader()
-:    m_neededSize(0)
+    : m_readOffset(0)
+    , m_bytesBuffered(0)
+    , m_peakBytesBuffered(0)
+    , m_neededSize(0)
+    , m_maximumDocumentSize(DEFAULT_MAXIMUM_DOCUMENT_SIZE)
+    , m_skipRemaining(0)
+    , m_rejectedDocuments(0)
+    , m_lastError(Error::NoError)
+    , m_desynchronized(false)
 {
 }
 
 void BSONStreamReader::enqueueData(QByteArray data)
 {
-    if (!m_dataBacklog.isEmpty()) {
-        data.prepend(m_dataBacklog);
-        m_dataBacklog.clear();
+    if (data.isEmpty() || Q_UNLIKELY(m_desynchronized)) {
+        return;
     }
 
-    while (!data.isEmpty()) {
-        // we were waiting a new message
-        if (!m_neededSize) {
-        //TODO: handle minimum BSON document size
-            if (data.count() >= 4) {
-                BSONDocument tmpDoc(data);
-                m_neededSize = tmpDoc.size();
-
-            // message is really small, just enqueue it
-            } else {
-                m_dataBacklog.append(data);
-                return;
-            }
+    // Drop what is left of a rejected document without buffering it
+    int skip = 0;
+    if (Q_UNLIKELY(m_skipRemaining)) {
+        if (data.count() <= m_skipRemaining) {
+            m_skipRemaining -= data.count();
+            return;
         }
+        skip = m_skipRemaining;
+        m_skipRemaining = 0;
+    }
 
+    m_chunks.append(data);
+    m_bytesBuffered += data.count() - skip;
+    m_peakBytesBuffered = qMax(m_peakBytesBuffered, m_bytesBuffered);
+    // Nothing else is buffered while skipping, so this chunk is the current one
+    m_readOffset += skip;
 
-        // we are at the begining and the document has the right size
-        // or it is bigger
-        if (m_neededSize <= data.size()) {
-            bool biggerChunk = (m_neededSize < data.size());
-            QByteArray documentData = biggerChunk ? data.left(m_neededSize) : data;
-
-            m_documents.append(documentData);
+    if (!m_neededSize) {
+        peekDocumentSize();
+    }
+}
 
-            if (biggerChunk) {
-                data.remove(0, m_neededSize);
-                m_neededSize = 0;
-            } else {
-                m_neededSize = 0;
-                return;
+void BSONStreamReader::peekDocumentSize()
+{
+    while (!m_neededSize && m_bytesBuffered >= 4) {
+        // The length prefix might be split across chunks
+        char sizeBuf[4];
+        int copied = 0;
+        int offset = m_readOffset;
+        for (const QByteArray &chunk : m_chunks) {
+            int n = qMin(4 - copied, chunk.count() - offset);
+            memcpy(sizeBuf + copied, chunk.constData() + offset, n);
+            copied += n;
+            offset = 0;
+            if (copied == 4) {
+                break;
             }
-        } else {
-            m_dataBacklog.append(data);
+        }
+
+        int32_t size = (int32_t) read_uint32(sizeBuf);
+
+        if (Q_UNLIKELY(size < MINIMUM_DOCUMENT_SIZE)) {
+            qWarning() << "BSON stream: invalid document size" << size << ", the stream cannot be framed anymore";
+            ++m_rejectedDocuments;
+            m_lastError = Error::InvalidDocumentSize;
+            m_desynchronized = true;
+            m_chunks.clear();
+            m_readOffset = 0;
+            m_bytesBuffered = 0;
             return;
         }
+
+        if (Q_UNLIKELY(size > m_maximumDocumentSize)) {
+            qWarning() << "BSON stream: skipping document of" << size << "bytes, maximum is" << m_maximumDocumentSize;
+            ++m_rejectedDocuments;
+            m_lastError = Error::DocumentTooLarge;
+            m_skipRemaining = size - advance(qMin((qint64) size, (qint64) m_bytesBuffered));
+            continue;
+        }
+
+        m_neededSize = size;
     }
 }
 
 bool BSONStreamReader::canReadDocument() const
 {
-    return !m_documents.isEmpty();
+    return m_neededSize > 0 && m_neededSize <= m_bytesBuffered;
+}
+
+int BSONStreamReader::bytesBuffered() const
+{
+    return m_bytesBuffered;
+}
+
+int BSONStreamReader::maximumDocumentSize() const
+{
+    return m_maximumDocumentSize;
+}
+
+void BSONStreamReader::setMaximumDocumentSize(int size)
+{
+    m_maximumDocumentSize = qMax(size, MINIMUM_DOCUMENT_SIZE);
+}
+
+BSONStreamReader::Error BSONStreamReader::lastError() const
+{
+    return m_lastError;
+}
+
+bool BSONStreamReader::isDesynchronized() const
+{
+    return m_desynchronized;
+}
+
+int BSONStreamReader::rejectedDocuments() const
+{
+    return m_rejectedDocuments;
+}
+
+int BSONStreamReader::peakBytesBuffered() const
+{
+    return m_peakBytesBuffered;
+}
+
+void BSONStreamReader::reset()
+{
+    m_chunks.clear();
+    m_readOffset = 0;
+    m_bytesBuffered = 0;
+    m_neededSize = 0;
+    m_skipRemaining = 0;
+    m_lastError = Error::NoError;
+    m_desynchronized = false;
+}
+
+int BSONStreamReader::advance(int size)
+{
+    m_readOffset += size;
+    m_bytesBuffered -= size;
+    while (!m_chunks.isEmpty() && m_readOffset >= m_chunks.first().count()) {
+        m_readOffset -= m_chunks.first().count();
+        m_chunks.removeFirst();
+    }
+
+    return size;
+}
+
+void BSONStreamReader::consume(int size)
+{
+    advance(size);
+
+    m_neededSize = 0;
+    peekDocumentSize();
+}
+
+BSONView BSONStreamReader::dequeueDocumentView()
+{
+    if (Q_UNLIKELY(!canReadDocument())) {
+        return BSONView();
+    }
+
+    const int size = m_neededSize;
+    const QByteArray &first = m_chunks.first();
+
+    // Fast path: the whole document is in the current chunk
+    if (m_readOffset + size <= first.count()) {
+        BSONView view(first, first.constData() + m_readOffset, size);
+        consume(size);
+        return view;
+    }
+
+    // Otherwise gather it from the chunks it spans
+    QByteArray document(size, Qt::Uninitialized);
+    int copied = 0;
+    int offset = m_readOffset;
+    for (const QByteArray &chunk : m_chunks) {
+        int n = qMin(size - copied, chunk.count() - offset);
+        memcpy(document.data() + copied, chunk.constData() + offset, n);
+        copied += n;
+        offset = 0;
+        if (copied == size) {
+            break;
+        }
+    }
+
+    consume(size);
+    return BSONView(document, document.constData(), size);
 }
 
 QByteArray BSONStreamReader::dequeueDocumentData()
 {
-    return m_documents.takeFirst();
+    return dequeueDocumentView().toByteArray();
 }
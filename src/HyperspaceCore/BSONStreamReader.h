@@ -4,24 +4,76 @@
 #include <QtCore/QByteArray>
 #include <QtCore/QList>
 
+#include <HyperspaceCore/BSONDocument>
+
 namespace Hyperspace
 {
 
 namespace Util
 {
 
+/**
+ * @brief Splits a stream of bytes into BSON documents
+ *
+ * Incoming chunks are kept as they are, and a single read cursor moves across them. A document is
+ * copied only when it spans more than one chunk: otherwise dequeueDocumentView() hands it out as a
+ * slice of the chunk it arrived in.
+ *
+ * The length prefix of each document is checked before anything gets buffered: documents bigger than
+ * maximumDocumentSize() are skipped as their bytes arrive, while a negative length or one smaller than
+ * the smallest possible document means the stream cannot be framed anymore. In that case the reader discards all
+ * further data until reset() is called.
+ */
 class BSONStreamReader
 {
     public:
+        enum class Error {
+            NoError = 0,
+            InvalidDocumentSize,
+            DocumentTooLarge
+        };
+
         BSONStreamReader();
         void enqueueData(QByteArray newData);
         bool canReadDocument() const;
         QByteArray dequeueDocumentData();
+        /// Like dequeueDocumentData, but does not copy documents which arrived within a single chunk.
+        BSONView dequeueDocumentView();
+
+        /// @returns The number of bytes received and not yet dequeued.
+        int bytesBuffered() const;
+        /// @returns The most bytes ever buffered at once, waiting for their documents to complete.
+        int peakBytesBuffered() const;
+
+        /// Documents bigger than this size get skipped. Defaults to 64 MiB.
+        int maximumDocumentSize() const;
+        void setMaximumDocumentSize(int size);
+
+        /// @returns The last error hit while framing the stream.
+        Error lastError() const;
+        /// @returns Whether the stream lost its framing. No further document will be read until reset() is called.
+        bool isDesynchronized() const;
+        /// @returns The number of documents rejected so far.
+        int rejectedDocuments() const;
+
+        /// Drops all buffered data and clears the error state. Counters are kept.
+        void reset();
 
     private:
-        QByteArrayList m_documents;
-        QByteArray m_dataBacklog;
+        void peekDocumentSize();
+        int advance(int size);
+        void consume(int size);
+
+        QByteArrayList m_chunks;
+        int m_readOffset;
+        int m_bytesBuffered;
+        int m_peakBytesBuffered;
         int m_neededSize;
+        int m_maximumDocumentSize;
+        qint64 m_skipRemaining;
+        int m_rejectedDocuments;
+        Error m_lastError;
+        bool m_desynchronized;
 };
 
 } // Util
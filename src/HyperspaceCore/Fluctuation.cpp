@@ -1,7 +1,8 @@
 #include "Fluctuation.h"
 
-#include "BSONDocument.h"
+#include "BSONDocument_p.h"
 #include "BSONSerializer.h"
+#include "SharedPayload_p.h"
 
 #include <QtCore/QDebug>
 #include <QSharedData>
@@ -13,13 +14,15 @@ class FluctuationData : public QSharedData
 public:
     FluctuationData() { }
     FluctuationData(const FluctuationData &other)
-        : QSharedData(other), interface(other.interface), target(other.target), payload(other.payload), attributes(other.attributes) { }
+        : QSharedData(other), interface(other.interface), target(other.target), payload(other.payload), attributes(other.attributes), sharedPayload(other.sharedPayload) { }
     ~FluctuationData() { }
 
     QByteArray interface;
     QByteArray target;
     QByteArray payload;
     QHash<QByteArray, QByteArray> attributes;
+    // Keeps the mapping payload refers to, if it came in shared memory
+    QSharedPointer<SharedPayload> sharedPayload;
 };
 
 Fluctuation::Fluctuation()
@@ -50,17 +53,33 @@ Fluctuation& Fluctuation::operator=(const Fluctuation& rhs)
 
 bool Fluctuation::operator==(const Fluctuation& other) const
 {
-    return (d->target == other.target()) && (d->payload == other.payload()) && (d->interface == other.interface()) && (d->attributes == other.attributes());
+    return (d->target == other.target()) && (d->payload == other.payloadView()) && (d->interface == other.interface()) && (d->attributes == other.attributes());
 }
 
 QByteArray Fluctuation::payload() const
+{
+    if (Q_UNLIKELY(!d->sharedPayload.isNull())) {
+        // The mapping goes away with the last copy of this Fluctuation
+        return QByteArray(d->payload.constData(), d->payload.size());
+    }
+
+    return d->payload;
+}
+
+QByteArray Fluctuation::payloadView() const
 {
     return d->payload;
 }
 
 void Fluctuation::setPayload(const QByteArray& p)
 {
-    d->payload = p;
+    if (Q_UNLIKELY(!d->sharedPayload.isNull() && d->sharedPayload->contains(p.constData()))) {
+        // p is a view on the mapping which is about to be released
+        d->payload = QByteArray(p.constData(), p.size());
+    } else {
+        d->payload = p;
+    }
+    d->sharedPayload.clear();
 }
 
 QByteArray Fluctuation::interface() const
@@ -110,19 +129,44 @@ QByteArray Fluctuation::takeAttribute(const QByteArray& attribute)
 
 QByteArray Fluctuation::serialize() const
 {
-    Util::BSONSerializer s;
+    return serialize(0, nullptr);
+}
+
+QByteArray Fluctuation::serialize(int sharedPayloadThreshold, int *payloadFd) const
+{
+    int fd = -1;
+    if (payloadFd) {
+        if (sharedPayloadThreshold > 0 && d->payload.size() >= sharedPayloadThreshold) {
+            // Falls back to an inline payload if the memfd can't be made
+            fd = SharedPayload::createFd(d->payload);
+        }
+        *payloadFd = fd;
+    }
+
+    int attributesSize = d->attributes.isEmpty() ? 0 : Util::BSONSerializer::stringDocumentSize(d->attributes);
+    int size = Util::BSONSerializer::emptyDocumentSize() +
+               Util::BSONSerializer::int32ElementSize("y") +
+               Util::BSONSerializer::stringElementSize("i", d->interface.size()) +
+               Util::BSONSerializer::stringElementSize("t", d->target.size()) +
+               (fd == -1 ? Util::BSONSerializer::binaryElementSize("p", d->payload.size()) :
+                             Util::BSONSerializer::int64ElementSize(SHARED_PAYLOAD_KEY)) +
+               (attributesSize ? Util::BSONSerializer::elementSize("a", attributesSize) : 0);
+
+    Util::BSONSerializer s(size);
     s.appendInt32Value("y", (int32_t) Protocol::MessageType::Fluctuation);
     s.appendASCIIString("i", d->interface);
     s.appendASCIIString("t", d->target);
-    s.appendBinaryValue("p", d->payload);
+    if (fd == -1) {
+        s.appendBinaryValue("p", d->payload);
+    } else {
+        s.appendInt64Value(SHARED_PAYLOAD_KEY, d->payload.size());
+    }
 
     if (!d->attributes.isEmpty()) {
-        Util::BSONSerializer sa;
+        Util::BSONSerializer::DocumentGuard attributes(s, "a");
         for (ByteArrayHash::const_iterator i = d->attributes.constBegin(); i != d->attributes.constEnd(); ++i) {
-            sa.appendASCIIString(i.key(), i.value());
+            s.appendASCIIString(i.key(), i.value());
         }
-        sa.appendEndOfDocument();
-        s.appendDocument("a", sa.document());
     }
 
     s.appendEndOfDocument();
@@ -132,28 +176,72 @@ QByteArray Fluctuation::serialize() const
 
 Fluctuation Fluctuation::fromBinary(const QByteArray &data)
 {
-    Util::BSONDocument doc(data);
-    if (Q_UNLIKELY(!doc.isValid())) {
+    return fromBinary(data, -1);
+}
+
+Fluctuation Fluctuation::fromBinary(const QByteArray &data, int fd)
+{
+    Fluctuation f;
+    int32_t messageType = (int32_t) Protocol::MessageType::Invalid;
+    bool attributesValid = true;
+    qint64 sharedPayloadSize = -1;
+
+    // Single pass over the document: every field of a Fluctuation has a one character key.
+    bool valid = Util::bson_walk_elements(data.constData(), data.size(),
+                                          [&f, &messageType, &attributesValid, &sharedPayloadSize] (const char *key, uint32_t keyLen, uint8_t type, const char *value) {
+        if (keyLen != 1) {
+            return true;
+        }
+
+        switch (key[0]) {
+            case 'y':
+                if (type == TYPE_INT32) {
+                    messageType = Util::bson_value_to_int32(value);
+                }
+                break;
+            case 'i':
+                f.d->interface = Util::bson_value_to_byte_array(type, value);
+                break;
+            case 't':
+                f.d->target = Util::bson_value_to_byte_array(type, value);
+                break;
+            case 'p':
+                f.d->payload = Util::bson_value_to_byte_array(type, value);
+                break;
+            case 'P': // SHARED_PAYLOAD_KEY
+                sharedPayloadSize = Util::bson_value_to_integer(type, value, 0);
+                break;
+            case 'a':
+                attributesValid = (type == TYPE_DOCUMENT) && Util::bson_decode_byte_array_hash(value, &f.d->attributes);
+                return attributesValid;
+            default:
+                break;
+        }
+
+        return true;
+    });
+
+    if (Q_UNLIKELY(!attributesValid)) {
+        qDebug() << "Fluctuation attributes are not valid\n";
+        return Fluctuation();
+    }
+    if (Q_UNLIKELY(!valid)) {
         qWarning() << "Fluctuation BSON document is not valid!";
         return Fluctuation();
     }
-    if (Q_UNLIKELY(doc.int32Value("y") != (int32_t) Protocol::MessageType::Fluctuation)) {
+    if (Q_UNLIKELY(messageType != (int32_t) Protocol::MessageType::Fluctuation)) {
         qWarning() << "Received message is not a Fluctuation";
         return Fluctuation();
     }
 
-    Fluctuation f;
-    f.setInterface(doc.byteArrayValue("i"));
-    f.setTarget(doc.byteArrayValue("t"));
-    f.setPayload(doc.byteArrayValue("p"));
-
-    if (doc.contains("a")) {
-        Util::BSONDocument attributesDoc = doc.subdocument("a");
-        if (!attributesDoc.isValid()) {
-            qDebug() << "Fluctuation attributes are not valid\n";
+    if (Q_UNLIKELY(sharedPayloadSize >= 0)) {
+        QSharedPointer<SharedPayload> shared = SharedPayload::map(fd, sharedPayloadSize);
+        if (Q_UNLIKELY(shared.isNull())) {
+            qWarning() << "Fluctuation shared payload can't be mapped";
             return Fluctuation();
         }
-        f.setAttributes(attributesDoc.byteArrayValuesHash());
+        f.d->payload = shared->payload();
+        f.d->sharedPayload = shared;
     }
 
     return f;
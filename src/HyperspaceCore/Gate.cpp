@@ -5,6 +5,7 @@
 #include "AbstractWaveTarget_p.h"
 #include "BSONDocument.h"
 #include "BSONStreamReader.h"
+#include "SharedPayload_p.h"
 #include "Socket.h"
 #include "Waveguide.h"
 
@@ -12,13 +13,20 @@
 #include <HemeraCore/Literals>
 
 #include <QtCore/QDebug>
+#include <QtCore/QElapsedTimer>
 #include <QtCore/QLoggingCategory>
+#include <QtCore/QQueue>
 #include <QtCore/QTimer>
 
 #include <functional>
 
+#include <unistd.h>
+
 Q_LOGGING_CATEGORY(hyperspaceGateDC, "hyperspace.gate", DEBUG_MESSAGES_DEFAULT_LEVEL)
 
+// Waves still waiting for their rebound are forgotten, oldest first, past this many: some targets never answer
+#define MAXIMUM_PENDING_WAVES 65536
+
 namespace Hyperspace {
 
 class Gate::Private
@@ -31,12 +39,39 @@ class Gate::Private
         QList <QByteArray> interfaces;
         QHash <QByteArray, AbstractWaveTarget *> registeredTargets;
 
-        Socket *socket;
+        Socket *socket = nullptr;
         Util::BSONStreamReader bsonStream;
+        int rejectedDocuments = 0;
+
+        // Payloads of at least this many bytes are sent in a memfd. 0 means never.
+        int sharedPayloadThreshold = 0;
+        // Received fds, waiting for the waves announcing a shared payload
+        SharedPayloadFds payloadFds;
+
+        // Outgoing messages are held for up to this many microseconds, or until this many bytes are queued. 0 means never.
+        int writeLatencyBudget = 0;
+        qint64 writeBatchSize = 64 * 1024;
+
+        // Statistics
+        quint64 wavesReceived = 0;
+        quint64 reboundsSent = 0;
+        quint64 fluctuationsSent = 0;
+        quint64 undecodableWaves = 0;
+        LatencyHistogram reboundLatency;
+        // When each wave still waiting for its rebound arrived, in microseconds
+        QHash<quint64, qint64> waveArrivals;
+        // The same arrivals, oldest first. Those whose rebound was sent already get skipped once at the front.
+        QQueue< QPair<quint64, qint64> > arrivalOrder;
+        QElapsedTimer clock;
+        QTimer *statisticsTimer = nullptr;
 
         static Gate *defaultGate;
 
         void sendInterfaces();
+        void dispatchWave(const QByteArray &data, int payloadFd);
+        void recordArrival(quint64 waveId);
+        void recordRebound(quint64 waveId);
+        bool isWaitingForRebound(const QPair<quint64, qint64> &arrival) const;
 };
 
 Gate *Gate::Private::defaultGate;
@@ -45,7 +80,10 @@ void Gate::sendRebound(const Rebound &rebound)
 {
     qCDebug(hyperspaceGateDC) << "Sending rebound" << rebound.id() << (quint16)rebound.response();
 
-    d->socket->write(rebound.serialize());
+    int payloadFd;
+    QByteArray data = rebound.serialize(d->sharedPayloadThreshold, &payloadFd);
+    d->socket->write(data, payloadFd, Socket::TakeFd);
+    d->recordRebound(rebound.id());
 }
 
 void Gate::sendFluctuation(const QByteArray &interface, const QByteArray &targetPath, const Fluctuation &f)
@@ -55,7 +93,10 @@ void Gate::sendFluctuation(const QByteArray &interface, const QByteArray &target
     fluctuation.setInterface(interface);
     fluctuation.setTarget(targetPath);
 
-    d->socket->write(fluctuation.serialize());
+    int payloadFd;
+    QByteArray data = fluctuation.serialize(d->sharedPayloadThreshold, &payloadFd);
+    d->socket->write(data, payloadFd, Socket::TakeFd);
+    ++d->fluctuationsSent;
 }
 
 void Gate::sendWaveguide(const QByteArray &interface, const Waveguide &w)
@@ -92,6 +133,20 @@ void Gate::initImpl()
     }
 #endif
 
+    // Opt-in: keep the connection going on its own thread, however long wave targets take
+    if (Q_UNLIKELY(qgetenv("HYPERSPACE_GATE_IO_THREAD").toInt() == 1)) {
+        d->socket->setIOThreadEnabled(true);
+    }
+    // Opt-in: one datagram per message, if Hyperdrive takes it. Falls back to a stream otherwise.
+    if (Q_UNLIKELY(qgetenv("HYPERSPACE_GATE_SEQPACKET").toInt() == 1)) {
+        d->socket->setTransport(Socket::SeqPacketTransport);
+    }
+    // Opt-in: do the connection's I/O through io_uring, where available
+    if (Q_UNLIKELY(qgetenv("HYPERSPACE_GATE_IO_URING").toInt() == 1)) {
+        d->socket->setIOUringEnabled(true);
+    }
+    d->socket->setWriteBatching(d->writeLatencyBudget, d->writeBatchSize);
+
     // Handle the function pointer overload...
 //     void (QLocalSocket::*errorSignal)(QLocalSocket::LocalSocketError) = &QLocalSocket::error;
 //     connect(d->socket, errorSignal, [this] (QLocalSocket::LocalSocketError socketError) {
@@ -104,14 +159,37 @@ void Gate::initImpl()
 //     });
 
 
-    QObject::connect(d->socket, &Socket::readyRead, this, [this] (QByteArray data, int fd) {
+    QObject::connect(d->socket, &Socket::readyRead, this, [this] (const QByteArray &data, int fd) {
+        if (d->socket->transport() == Socket::SeqPacketTransport) {
+            // Exactly one wave, along with its own fd: nothing to reframe
+            d->dispatchWave(data, fd);
+            return;
+        }
+
+        // Only shared payloads come with an fd, and the wave announcing it starts within this read
+        d->payloadFds.received(data.size(), fd);
         d->bsonStream.enqueueData(data);
+        if (Q_UNLIKELY(d->bsonStream.rejectedDocuments() != d->rejectedDocuments)) {
+            d->rejectedDocuments = d->bsonStream.rejectedDocuments();
+            if (d->bsonStream.isDesynchronized()) {
+                // Whatever comes next cannot be framed: the reader discards it, so at least it won't pile up.
+                qCWarning(hyperspaceGateDC) << "The stream from Hyperdrive is corrupted, all further waves will be discarded";
+            } else {
+                qCWarning(hyperspaceGateDC) << "Rejected" << d->rejectedDocuments << "oversized waves so far";
+            }
+        }
         while (d->bsonStream.canReadDocument()) {
-            Wave wave = Wave::fromBinary(d->bsonStream.dequeueDocumentData());
+            qint64 documentStart = d->payloadFds.position() - d->bsonStream.bytesBuffered();
+            // The view keeps the buffer alive while the Wave gets decoded: no need to copy it
+            Util::BSONView document = d->bsonStream.dequeueDocumentView();
+            int payloadFd = d->payloadFds.take(document.constData(), document.size(), documentStart);
 
-            qCDebug(hyperspaceGateDC) << "Got a wave with id" << wave.id();
-            waveFunction(wave);
+            d->dispatchWave(document.toRawByteArray(), payloadFd);
         }
+
+        // Nothing can be framed anymore once desynchronized
+        d->payloadFds.drop(d->bsonStream.isDesynchronized() ? d->payloadFds.position() :
+                                                              d->payloadFds.position() - d->bsonStream.bytesBuffered());
     });
 
     // Monitor socket
@@ -137,10 +215,81 @@ void Gate::Private::sendInterfaces()
     }
 }
 
+void Gate::Private::dispatchWave(const QByteArray &data, int payloadFd)
+{
+    Wave wave = Wave::fromBinary(data, payloadFd);
+    if (Q_UNLIKELY(payloadFd != -1)) {
+        // The payload is mapped, if it could be: the fd is not needed anymore
+        ::close(payloadFd);
+    }
+
+    if (Q_UNLIKELY(wave.id() == 0)) {
+        // Not a wave anyone could answer: don't hand it out
+        ++undecodableWaves;
+        qCWarning(hyperspaceGateDC) << "Discarded a wave which could not be decoded";
+        return;
+    }
+
+    qCDebug(hyperspaceGateDC) << "Got a wave with id" << wave.id();
+
+    ++wavesReceived;
+    recordArrival(wave.id());
+
+    q->waveFunction(wave);
+}
+
+bool Gate::Private::isWaitingForRebound(const QPair<quint64, qint64> &arrival) const
+{
+    QHash<quint64, qint64>::const_iterator i = waveArrivals.constFind(arrival.first);
+    return i != waveArrivals.constEnd() && i.value() == arrival.second;
+}
+
+void Gate::Private::recordArrival(quint64 waveId)
+{
+    // Make room by expiring the oldest arrival
+    while (arrivalOrder.size() >= MAXIMUM_PENDING_WAVES) {
+        QPair<quint64, qint64> oldest = arrivalOrder.dequeue();
+        if (isWaitingForRebound(oldest)) {
+            waveArrivals.remove(oldest.first);
+        }
+    }
+
+    qint64 now = clock.nsecsElapsed() / 1000;
+    waveArrivals.insert(waveId, now);
+    arrivalOrder.enqueue(qMakePair(waveId, now));
+}
+
+void Gate::Private::recordRebound(quint64 waveId)
+{
+    ++reboundsSent;
+
+    QHash<quint64, qint64>::iterator arrival = waveArrivals.find(waveId);
+    if (arrival != waveArrivals.end()) {
+        reboundLatency.record(clock.nsecsElapsed() / 1000 - arrival.value());
+        waveArrivals.erase(arrival);
+    }
+
+    // Rebounds mostly come in order: this keeps the queue about as long as the pending waves
+    while (!arrivalOrder.isEmpty() && !isWaitingForRebound(arrivalOrder.head())) {
+        arrivalOrder.dequeue();
+    }
+}
+
 Gate::Gate(QObject *parent)
     : AsyncInitObject(parent)
     , d(new Private(this))
 {
+    d->clock.start();
+
+    if (Q_UNLIKELY(qEnvironmentVariableIsSet("HYPERSPACE_GATE_SHARED_PAYLOAD_THRESHOLD"))) {
+        d->sharedPayloadThreshold = qgetenv("HYPERSPACE_GATE_SHARED_PAYLOAD_THRESHOLD").toInt();
+    }
+    if (Q_UNLIKELY(qEnvironmentVariableIsSet("HYPERSPACE_GATE_WRITE_LATENCY_BUDGET"))) {
+        d->writeLatencyBudget = qgetenv("HYPERSPACE_GATE_WRITE_LATENCY_BUDGET").toInt();
+    }
+    if (Q_UNLIKELY(qEnvironmentVariableIsSet("HYPERSPACE_GATE_WRITE_BATCH_SIZE"))) {
+        d->writeBatchSize = qgetenv("HYPERSPACE_GATE_WRITE_BATCH_SIZE").toLongLong();
+    }
 }
 
 Gate::~Gate()
@@ -157,6 +306,88 @@ QList<QByteArray> Gate::interfaces() const
     return d->interfaces;
 }
 
+int Gate::sharedPayloadThreshold() const
+{
+    return d->sharedPayloadThreshold;
+}
+
+void Gate::setSharedPayloadThreshold(int bytes)
+{
+    d->sharedPayloadThreshold = bytes;
+}
+
+int Gate::writeLatencyBudget() const
+{
+    return d->writeLatencyBudget;
+}
+
+qint64 Gate::writeBatchSize() const
+{
+    return d->writeBatchSize;
+}
+
+void Gate::setWriteBatching(int microseconds, qint64 bytes)
+{
+    d->writeLatencyBudget = microseconds;
+    d->writeBatchSize = bytes;
+
+    // The socket comes up with init()
+    if (d->socket) {
+        d->socket->setWriteBatching(microseconds, bytes);
+    }
+}
+
+Gate::Statistics Gate::statistics() const
+{
+    Statistics statistics;
+    if (d->socket) {
+        statistics.socket = d->socket->statistics();
+    }
+    statistics.wavesReceived = d->wavesReceived;
+    statistics.reboundsSent = d->reboundsSent;
+    statistics.fluctuationsSent = d->fluctuationsSent;
+    statistics.rejectedWaves = d->bsonStream.rejectedDocuments();
+    statistics.undecodableWaves = d->undecodableWaves;
+    statistics.reassemblyBacklog = d->bsonStream.bytesBuffered();
+    statistics.reassemblyBacklogPeak = qMax(d->bsonStream.peakBytesBuffered(), statistics.socket.reassemblyBacklogPeak);
+    statistics.reboundLatency = d->reboundLatency;
+    return statistics;
+}
+
+void Gate::resetReboundLatency()
+{
+    d->reboundLatency.reset();
+}
+
+int Gate::statisticsInterval() const
+{
+    return d->statisticsTimer ? d->statisticsTimer->interval() : 0;
+}
+
+void Gate::setStatisticsInterval(int msecs)
+{
+    if (msecs <= 0) {
+        delete d->statisticsTimer;
+        d->statisticsTimer = nullptr;
+        return;
+    }
+
+    if (!d->statisticsTimer) {
+        d->statisticsTimer = new QTimer(this);
+        connect(d->statisticsTimer, &QTimer::timeout, this, [this] {
+            Q_EMIT statisticsUpdated(statistics());
+        });
+    }
+    d->statisticsTimer->start(msecs);
+}
+
+void Gate::flush()
+{
+    if (d->socket) {
+        d->socket->flush();
+    }
+}
+
 void Gate::assignWaveTarget(AbstractWaveTarget *target)
 {
     if (target->d_func()->gate != this) {
@@ -8,6 +8,8 @@
 #include <HemeraCore/AsyncInitObject>
 
 #include <HyperspaceCore/AbstractWaveTarget>
+#include <HyperspaceCore/LatencyHistogram>
+#include <HyperspaceCore/Socket>
 
 #include <HyperspaceCore/Waveguide>
 
@@ -39,13 +41,68 @@ class Gate : public Hemera::AsyncInitObject
     Q_DISABLE_COPY(Gate)
 
 public:
+    /// What the Gate and its connection to Hyperdrive did since the Gate was created.
+    struct Statistics {
+        Socket::Statistics socket;
+        quint64 wavesReceived = 0;
+        quint64 reboundsSent = 0;
+        quint64 fluctuationsSent = 0;
+        /// Waves which were too big, or which came after the stream lost its framing.
+        int rejectedWaves = 0;
+        /// Waves which arrived whole but could not be decoded. They are neither dispatched nor answered.
+        quint64 undecodableWaves = 0;
+        /// Bytes buffered right now, waiting for their waves to complete.
+        int reassemblyBacklog = 0;
+        int reassemblyBacklogPeak = 0;
+        /// Microseconds from the arrival of a wave to its rebound being queued, until resetReboundLatency().
+        LatencyHistogram reboundLatency;
+    };
+
     virtual ~Gate();
 
     /// @returns The interfaces this Gate exposes
     QList<QByteArray> interfaces() const;
 
+    int sharedPayloadThreshold() const;
+    /**
+     * @brief Sends payloads of at least @p bytes in shared memory, rather than through the socket
+     *
+     * Meant for large payloads, such as camera frames or firmware images: they are copied once into a sealed memfd,
+     * which goes along with the message and which Hyperdrive maps, instead of being copied through the socket.
+     * Hyperdrive has to support it. The default is 0, which disables it, unless the
+     * HYPERSPACE_GATE_SHARED_PAYLOAD_THRESHOLD environment variable says otherwise.
+     *
+     * Waves with a payload in shared memory are always accepted: see Wave::payloadView().
+     */
+    void setSharedPayloadThreshold(int bytes);
+
+    int writeLatencyBudget() const;
+    qint64 writeBatchSize() const;
+    /**
+     * @brief Holds outgoing messages for up to @p microseconds, or until @p bytes are queued
+     *
+     * Gates producing lots of fluctuations, such as telemetry producers, trade a bounded latency for far fewer
+     * writes: see Socket::setWriteBatching(). Call flush() after latency-critical rebounds. The default is 0, which
+     * sends right away, unless the HYPERSPACE_GATE_WRITE_LATENCY_BUDGET and HYPERSPACE_GATE_WRITE_BATCH_SIZE
+     * environment variables say otherwise.
+     */
+    void setWriteBatching(int microseconds, qint64 bytes = 64 * 1024);
+    /// Sends whatever write batching is holding right away.
+    void flush();
+
+    Statistics statistics() const;
+    /// Starts over recording wave to rebound latencies, for instance after each statisticsUpdated.
+    void resetReboundLatency();
+    int statisticsInterval() const;
+    /// Emits statisticsUpdated every @p msecs milliseconds. The default is 0, which disables it.
+    void setStatisticsInterval(int msecs);
+
     static Gate *defaultGate();
 
+Q_SIGNALS:
+    /// Emitted periodically, when a statistics interval has been set.
+    void statisticsUpdated(const Hyperspace::Gate::Statistics &statistics);
+
 protected:
     explicit Gate(QObject *parent = nullptr);
 
@@ -97,4 +154,6 @@ private:
 
 }
 
+Q_DECLARE_METATYPE(Hyperspace::Gate::Statistics)
+
 #endif // HYPERSPACE_GATE_H
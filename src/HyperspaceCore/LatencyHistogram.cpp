@@ -0,0 +1,141 @@
+#include "LatencyHistogram.h"
+
+#include <QtCore/QSharedData>
+#include <QtCore/QVector>
+
+#include <limits>
+
+// Values below SUB_BUCKET_COUNT get a bucket each. Above, every power of two is split into SUB_BUCKET_HALF
+// buckets: a bucket is never wider than 1/64 of the values it holds.
+#define SUB_BUCKET_BITS 7
+#define SUB_BUCKET_COUNT (1 << SUB_BUCKET_BITS)
+#define SUB_BUCKET_HALF (SUB_BUCKET_COUNT / 2)
+#define BUCKET_COUNT (SUB_BUCKET_COUNT + (64 - SUB_BUCKET_BITS) * SUB_BUCKET_HALF)
+
+namespace Hyperspace {
+
+static inline int bucketIndex(quint64 value)
+{
+    if (value < SUB_BUCKET_COUNT) {
+        return value;
+    }
+
+    // Keep the SUB_BUCKET_BITS most significant bits
+    int shift = 63 - __builtin_clzll(value) - (SUB_BUCKET_BITS - 1);
+    return SUB_BUCKET_COUNT + (shift - 1) * SUB_BUCKET_HALF + int((value >> shift) - SUB_BUCKET_HALF);
+}
+
+// The highest value which falls in a bucket
+static inline quint64 bucketValue(int index)
+{
+    if (index < SUB_BUCKET_COUNT) {
+        return index;
+    }
+
+    int shift = (index - SUB_BUCKET_COUNT) / SUB_BUCKET_HALF + 1;
+    quint64 subBucket = (index - SUB_BUCKET_COUNT) % SUB_BUCKET_HALF + SUB_BUCKET_HALF;
+    return ((subBucket + 1) << shift) - 1;
+}
+
+class LatencyHistogramData : public QSharedData
+{
+public:
+    LatencyHistogramData() : count(0), minimum(std::numeric_limits<quint64>::max()), maximum(0), sum(0) { }
+    LatencyHistogramData(const LatencyHistogramData &other)
+        : QSharedData(other), buckets(other.buckets), count(other.count), minimum(other.minimum), maximum(other.maximum), sum(other.sum) { }
+    ~LatencyHistogramData() { }
+
+    // Allocated with the first value
+    QVector<quint64> buckets;
+    quint64 count;
+    quint64 minimum;
+    quint64 maximum;
+    long double sum;
+};
+
+LatencyHistogram::LatencyHistogram()
+    : d(new LatencyHistogramData)
+{
+}
+
+LatencyHistogram::LatencyHistogram(const LatencyHistogram &other)
+    : d(other.d)
+{
+}
+
+LatencyHistogram::~LatencyHistogram()
+{
+}
+
+LatencyHistogram &LatencyHistogram::operator=(const LatencyHistogram &rhs)
+{
+    if (this == &rhs) {
+        // Protect against self-assignment
+        return *this;
+    }
+
+    d = rhs.d;
+    return *this;
+}
+
+void LatencyHistogram::record(quint64 value)
+{
+    if (Q_UNLIKELY(d->buckets.isEmpty())) {
+        d->buckets.fill(0, BUCKET_COUNT);
+    }
+
+    ++d->buckets[bucketIndex(value)];
+    ++d->count;
+    d->minimum = qMin(d->minimum, value);
+    d->maximum = qMax(d->maximum, value);
+    d->sum += value;
+}
+
+void LatencyHistogram::reset()
+{
+    d = new LatencyHistogramData;
+}
+
+quint64 LatencyHistogram::count() const
+{
+    return d->count;
+}
+
+quint64 LatencyHistogram::minimum() const
+{
+    return d->count > 0 ? d->minimum : 0;
+}
+
+quint64 LatencyHistogram::maximum() const
+{
+    return d->maximum;
+}
+
+double LatencyHistogram::mean() const
+{
+    return d->count > 0 ? double(d->sum / d->count) : 0;
+}
+
+quint64 LatencyHistogram::valueAtPercentile(double percentile) const
+{
+    if (d->count == 0) {
+        return 0;
+    }
+
+    // The rank of the value we're after, from 1 to count
+    quint64 rank = quint64(qBound(0.0, percentile, 100.0) / 100.0 * d->count + 0.5);
+    rank = qBound<quint64>(1, rank, d->count);
+
+    quint64 seen = 0;
+    for (int i = 0; i < BUCKET_COUNT; ++i) {
+        seen += d->buckets.at(i);
+        if (seen >= rank) {
+            // The bucket's bound might go past what was actually recorded
+            return qBound(d->minimum, bucketValue(i), d->maximum);
+        }
+    }
+
+    return d->maximum;
+}
+
+}
@@ -0,0 +1,49 @@
+#ifndef HYPERSPACE_LATENCYHISTOGRAM_H
+#define HYPERSPACE_LATENCYHISTOGRAM_H
+
+#include <QtCore/QSharedDataPointer>
+
+#include <HyperspaceCore/Global>
+
+namespace Hyperspace {
+
+class LatencyHistogramData;
+
+/**
+ * @brief A histogram of latencies, in the spirit of HdrHistogram
+ *
+ * Values are counted in buckets whose width grows with their magnitude, so that any value from 1 to 2^64 - 1 is
+ * recorded in constant time and memory, with a relative error below 1/64. Percentiles come out with that same
+ * precision, however skewed the distribution is.
+ */
+class HYPERSPACE_QT5_EXPORT LatencyHistogram {
+public:
+    LatencyHistogram();
+    LatencyHistogram(const LatencyHistogram &other);
+    ~LatencyHistogram();
+
+    LatencyHistogram &operator=(const LatencyHistogram &rhs);
+
+    /// Records a single value, usually in microseconds.
+    void record(quint64 value);
+    /// Forgets every recorded value.
+    void reset();
+
+    /// @returns The number of recorded values.
+    quint64 count() const;
+    quint64 minimum() const;
+    quint64 maximum() const;
+    double mean() const;
+    /**
+     * @returns The value below which @p percentile percent of the recorded values fall, such as 50 for
+     *          the median or 99.9, or 0 if nothing has been recorded yet.
+     */
+    quint64 valueAtPercentile(double percentile) const;
+
+private:
+    QSharedDataPointer<LatencyHistogramData> d;
+};
+
+}
+
+#endif // HYPERSPACE_LATENCYHISTOGRAM_H
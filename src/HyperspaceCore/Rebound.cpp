@@ -1,7 +1,8 @@
 #include "Rebound.h"
 
-#include "BSONDocument.h"
+#include "BSONDocument_p.h"
 #include "BSONSerializer.h"
+#include "SharedPayload_p.h"
 
 #include <QtCore/QSharedData>
 
@@ -14,13 +15,15 @@ public:
     ReboundData(quint64 id, ResponseCode response, const ByteArrayHash &attributes, const QByteArray &payload)
         : id(id), responseCode(response), attributes(attributes), payload(payload) { }
     ReboundData(const ReboundData &other)
-        : QSharedData(other), id(other.id), responseCode(other.responseCode), attributes(other.attributes), payload(other.payload) { }
+        : QSharedData(other), id(other.id), responseCode(other.responseCode), attributes(other.attributes), payload(other.payload), sharedPayload(other.sharedPayload) { }
     ~ReboundData() { }
 
     quint64 id;
     ResponseCode responseCode;
     ByteArrayHash attributes;
     QByteArray payload;
+    // Keeps the mapping payload refers to, if it came in shared memory
+    QSharedPointer<SharedPayload> sharedPayload;
 };
 
 Rebound::Rebound(const Wave& wave, ResponseCode code)
@@ -93,13 +96,29 @@ void Rebound::setId(quint64 id)
 }
 
 QByteArray Rebound::payload() const
+{
+    if (Q_UNLIKELY(!d->sharedPayload.isNull())) {
+        // The mapping goes away with the last copy of this Rebound
+        return QByteArray(d->payload.constData(), d->payload.size());
+    }
+
+    return d->payload;
+}
+
+QByteArray Rebound::payloadView() const
 {
     return d->payload;
 }
 
 void Rebound::setPayload(const QByteArray& p)
 {
-    d->payload = p;
+    if (Q_UNLIKELY(!d->sharedPayload.isNull() && d->sharedPayload->contains(p.constData()))) {
+        // p is a view on the mapping which is about to be released
+        d->payload = QByteArray(p.constData(), p.size());
+    } else {
+        d->payload = p;
+    }
+    d->sharedPayload.clear();
 }
 
 ResponseCode Rebound::response() const
@@ -114,19 +133,44 @@ void Rebound::setResponse(ResponseCode r)
 
 QByteArray Rebound::serialize() const
 {
-    Util::BSONSerializer s;
+    return serialize(0, nullptr);
+}
+
+QByteArray Rebound::serialize(int sharedPayloadThreshold, int *payloadFd) const
+{
+    int fd = -1;
+    if (payloadFd) {
+        if (sharedPayloadThreshold > 0 && d->payload.size() >= sharedPayloadThreshold) {
+            // Falls back to an inline payload if the memfd can't be made
+            fd = SharedPayload::createFd(d->payload);
+        }
+        *payloadFd = fd;
+    }
+
+    int attributesSize = d->attributes.isEmpty() ? 0 : Util::BSONSerializer::stringDocumentSize(d->attributes);
+    int size = Util::BSONSerializer::emptyDocumentSize() +
+               Util::BSONSerializer::int32ElementSize("y") +
+               Util::BSONSerializer::int64ElementSize("u") +
+               Util::BSONSerializer::int32ElementSize("r") +
+               (attributesSize ? Util::BSONSerializer::elementSize("a", attributesSize) : 0) +
+               (fd == -1 ? Util::BSONSerializer::binaryElementSize("p", d->payload.size()) :
+                             Util::BSONSerializer::int64ElementSize(SHARED_PAYLOAD_KEY));
+
+    Util::BSONSerializer s(size);
     s.appendInt32Value("y", (int32_t) Protocol::MessageType::Rebound);
     s.appendInt64Value("u", (int64_t) d->id);
     s.appendInt32Value("r", (int32_t) d->responseCode);
     if (!d->attributes.isEmpty()) {
-        Util::BSONSerializer sa;
+        Util::BSONSerializer::DocumentGuard attributes(s, "a");
         for (ByteArrayHash::const_iterator i = d->attributes.constBegin(); i != d->attributes.constEnd(); ++i) {
-            sa.appendASCIIString(i.key(), i.value());
+            s.appendASCIIString(i.key(), i.value());
         }
-        sa.appendEndOfDocument();
-        s.appendDocument("a", sa.document());
     }
-    s.appendBinaryValue("p", d->payload);
+    if (fd == -1) {
+        s.appendBinaryValue("p", d->payload);
+    } else {
+        s.appendInt64Value(SHARED_PAYLOAD_KEY, d->payload.size());
+    }
     s.appendEndOfDocument();
 
     return s.document();
@@ -134,27 +178,75 @@ QByteArray Rebound::serialize() const
 
 Rebound Rebound::fromBinary(const QByteArray &data)
 {
-    Util::BSONDocument doc(data);
-    if (Q_UNLIKELY(!doc.isValid())) {
+    return fromBinary(data, -1);
+}
+
+Rebound Rebound::fromBinary(const QByteArray &data, int fd)
+{
+    Rebound r(0);
+    int32_t messageType = (int32_t) Protocol::MessageType::Invalid;
+    bool attributesValid = true;
+    qint64 sharedPayloadSize = -1;
+
+    // Single pass over the document: every field of a Rebound has a one character key.
+    bool valid = Util::bson_walk_elements(data.constData(), data.size(),
+                                          [&r, &messageType, &attributesValid, &sharedPayloadSize] (const char *key, uint32_t keyLen, uint8_t type, const char *value) {
+        if (keyLen != 1) {
+            return true;
+        }
+
+        switch (key[0]) {
+            case 'y':
+                if (type == TYPE_INT32) {
+                    messageType = Util::bson_value_to_int32(value);
+                }
+                break;
+            case 'u':
+                r.d->id = Util::bson_value_to_integer(type, value);
+                break;
+            case 'r':
+                if (type == TYPE_INT32) {
+                    r.d->responseCode = (Hyperspace::ResponseCode) Util::bson_value_to_int32(value);
+                }
+                break;
+            case 'p':
+                r.d->payload = Util::bson_value_to_byte_array(type, value);
+                break;
+            case 'P': // SHARED_PAYLOAD_KEY
+                sharedPayloadSize = Util::bson_value_to_integer(type, value, 0);
+                break;
+            case 'a':
+                attributesValid = (type == TYPE_DOCUMENT) && Util::bson_decode_byte_array_hash(value, &r.d->attributes);
+                return attributesValid;
+            default:
+                break;
+        }
+
+        return true;
+    });
+
+    if (Q_UNLIKELY(!attributesValid)) {
+        qDebug() << "Rebound attributes are not valid\n";
+        return Rebound(0);
+    }
+    if (Q_UNLIKELY(!valid)) {
         qWarning() << "Rebound BSON document is not valid!";
         return Rebound(0);
     }
-    if (Q_UNLIKELY(doc.int32Value("y") != (int32_t) Protocol::MessageType::Rebound)) {
+    if (Q_UNLIKELY(messageType != (int32_t) Protocol::MessageType::Rebound)) {
         qWarning() << "Received message is not a Rebound";
         return Rebound(0);
     }
 
-    Rebound r((quint64) doc.int64Value("u"));
-    r.setResponse((Hyperspace::ResponseCode) doc.int32Value("r"));
-    if (doc.contains("a")) {
-        Util::BSONDocument attributesDoc = doc.subdocument("a");
-        if (!attributesDoc.isValid()) {
-            qDebug() << "Rebound attributes are not valid\n";
+    if (Q_UNLIKELY(sharedPayloadSize >= 0)) {
+        QSharedPointer<SharedPayload> shared = SharedPayload::map(fd, sharedPayloadSize);
+        if (Q_UNLIKELY(shared.isNull())) {
+            qWarning() << "Rebound shared payload can't be mapped";
             return Rebound(0);
         }
-        r.setAttributes(attributesDoc.byteArrayValuesHash());
+        r.d->payload = shared->payload();
+        r.d->sharedPayload = shared;
     }
-    r.setPayload(doc.byteArrayValue("p"));
 
     return r;
 }
@@ -52,12 +52,37 @@ public:
     void addAttribute(const QByteArray &attribute, const QByteArray &value);
     bool removeAttribute(const QByteArray &attribute);
 
-    /// The Rebound's payload, if any.
+    /**
+     * @brief The Rebound's payload, if any.
+     *
+     * A payload received in shared memory gets copied out of the mapping: see payloadView() to read it in place.
+     */
     QByteArray payload() const;
+    /**
+     * @brief The Rebound's payload, read in place if it was received in shared memory
+     *
+     * The returned QByteArray may refer to the mapping, which lives only as long as this Rebound (or a copy of it)
+     * is around. Don't keep it, nor hand it to another message: use payload() for that.
+     */
+    QByteArray payloadView() const;
     void setPayload(const QByteArray &p);
 
     QByteArray serialize() const;
+    /**
+     * @brief Serializes the Rebound, moving a payload of at least @p sharedPayloadThreshold bytes to shared memory
+     *
+     * When the payload gets moved, @p payloadFd is set to a sealed memfd holding it, which has to be sent along
+     * with the message and closed afterwards. Otherwise it is set to -1, and this is the same as serialize().
+     */
+    QByteArray serialize(int sharedPayloadThreshold, int *payloadFd) const;
     static Rebound fromBinary(const QByteArray &data);
+    /**
+     * @brief Decodes a message which was received along with @p fd
+     *
+     * If the payload was moved to shared memory, it gets mapped from @p fd instead of being copied: see payloadView().
+     * The fd is left to the caller, who can close it right away.
+     */
+    static Rebound fromBinary(const QByteArray &data, int fd);
 
 private:
     QSharedDataPointer<ReboundData> d;
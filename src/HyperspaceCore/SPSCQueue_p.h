@@ -0,0 +1,93 @@
+#ifndef _HYPERSPACE_SPSCQUEUE_P_H_
+#define _HYPERSPACE_SPSCQUEUE_P_H_
+
+#include <QtCore/QAtomicInt>
+#include <QtCore/QAtomicPointer>
+
+namespace Hyperspace
+{
+
+/*
+ * Unbounded, lock-free queue with a single producer thread and a single consumer thread.
+ *
+ * Items live in blocks of BlockSize slots, linked in a list: the producer fills the tail block and
+ * publishes each item by bumping the block's committed count, the consumer follows with its own
+ * index and frees a block once it has moved past it. Nothing is shared but the committed counts
+ * and the links, so push and pop never wait on each other, and only allocate once per block.
+ */
+template <typename T, int BlockSize = 64>
+class SPSCQueue
+{
+    public:
+        SPSCQueue() : m_head(new Block), m_headIndex(0), m_tail(m_head), m_tailIndex(0) {}
+        ~SPSCQueue()
+        {
+            while (m_head) {
+                Block *next = m_head->next.loadAcquire();
+                delete m_head;
+                m_head = next;
+            }
+        }
+
+        /* Producer side */
+        void push(const T &item)
+        {
+            if (m_tailIndex == BlockSize) {
+                Block *block = new Block;
+                m_tail->next.storeRelease(block);
+                m_tail = block;
+                m_tailIndex = 0;
+            }
+
+            m_tail->items[m_tailIndex] = item;
+            m_tail->committed.storeRelease(++m_tailIndex);
+        }
+
+        /* Consumer side: returns false if there's nothing to pop */
+        bool pop(T *item)
+        {
+            if (m_headIndex == BlockSize) {
+                Block *next = m_head->next.loadAcquire();
+                if (!next) {
+                    return false;
+                }
+
+                // The producer moved on to the next block before linking it: this one is ours alone
+                delete m_head;
+                m_head = next;
+                m_headIndex = 0;
+            }
+
+            if (m_headIndex >= m_head->committed.loadAcquire()) {
+                return false;
+            }
+
+            // Leave an empty slot behind, so that the queue doesn't keep the item's data alive
+            T &slot = m_head->items[m_headIndex++];
+            *item = slot;
+            slot = T();
+            return true;
+        }
+
+    private:
+        Q_DISABLE_COPY(SPSCQueue)
+
+        struct Block {
+            T items[BlockSize];
+            QAtomicInt committed;
+            QAtomicPointer<Block> next;
+        };
+
+        // Consumer
+        Block *m_head;
+        int m_headIndex;
+        // Keep the two ends on different cache lines
+        char m_padding[64];
+        // Producer
+        Block *m_tail;
+        int m_tailIndex;
+};
+
+}
+
+#endif
@@ -0,0 +1,157 @@
+#include "SharedPayload_p.h"
+
+#include "BSONDocument_p.h"
+
+#include <QtCore/QDebug>
+
+#include <limits>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Older libcs don't know about memfds yet
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 0x0001U
+#define MFD_ALLOW_SEALING 0x0002U
+#endif
+#ifndef F_ADD_SEALS
+#define F_ADD_SEALS 1033
+#define F_GET_SEALS 1034
+#define F_SEAL_SEAL 0x0001
+#define F_SEAL_SHRINK 0x0002
+#define F_SEAL_GROW 0x0004
+#define F_SEAL_WRITE 0x0008
+#endif
+
+// What the receiver needs to trust the mapping: nobody can write to it or truncate it anymore
+#define SHARED_PAYLOAD_REQUIRED_SEALS (F_SEAL_SHRINK | F_SEAL_WRITE)
+
+namespace Hyperspace
+{
+
+SharedPayload::~SharedPayload()
+{
+    ::munmap(const_cast<char *>(m_data), m_size);
+}
+
+int SharedPayload::createFd(const QByteArray &payload)
+{
+#ifdef __NR_memfd_create
+    int fd = ::syscall(__NR_memfd_create, "hyperspace-payload", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+#else
+    int fd = -1;
+    errno = ENOSYS;
+#endif
+    if (fd < 0) {
+        qWarning() << "Could not create a memfd for a shared payload:" << errno;
+        return -1;
+    }
+
+    const char *data = payload.constData();
+    ssize_t remaining = payload.size();
+    while (remaining > 0) {
+        ssize_t written = ::write(fd, data, remaining);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            qWarning() << "Could not write a shared payload:" << errno;
+            ::close(fd);
+            return -1;
+        }
+        data += written;
+        remaining -= written;
+    }
+
+    if (::fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) < 0) {
+        qWarning() << "Could not seal a shared payload:" << errno;
+        ::close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+QSharedPointer<SharedPayload> SharedPayload::map(int fd, qint64 size)
+{
+    if (Q_UNLIKELY(fd < 0 || size <= 0 || size > std::numeric_limits<int>::max())) {
+        qWarning() << "Invalid shared payload of" << size << "bytes";
+        return QSharedPointer<SharedPayload>();
+    }
+
+    // An unsealed memfd could shrink under our feet, and fault whoever reads the payload
+    int seals = ::fcntl(fd, F_GET_SEALS);
+    if (Q_UNLIKELY(seals < 0 || (seals & SHARED_PAYLOAD_REQUIRED_SEALS) != SHARED_PAYLOAD_REQUIRED_SEALS)) {
+        qWarning() << "Refusing a shared payload which is not sealed";
+        return QSharedPointer<SharedPayload>();
+    }
+
+    struct stat info;
+    // Sealed memfds hold exactly their payload: any other size means the fd does not belong to this message
+    if (Q_UNLIKELY(::fstat(fd, &info) < 0 || info.st_size != size)) {
+        qWarning() << "Shared payload does not have the announced size";
+        return QSharedPointer<SharedPayload>();
+    }
+
+    void *data = ::mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (Q_UNLIKELY(data == MAP_FAILED)) {
+        qWarning() << "Could not map a shared payload:" << errno;
+        return QSharedPointer<SharedPayload>();
+    }
+
+    return QSharedPointer<SharedPayload>(new SharedPayload(static_cast<const char *>(data), size));
+}
+
+bool SharedPayload::isAnnounced(const char *message, int size)
+{
+    bool announced = false;
+    Util::bson_walk_elements(message, size, [&announced] (const char *key, uint32_t keyLen, uint8_t, const char *) {
+        announced = keyLen == 1 && key[0] == SHARED_PAYLOAD_KEY[0];
+        return !announced;
+    });
+
+    return announced;
+}
+
+SharedPayloadFds::~SharedPayloadFds()
+{
+    for (const PendingFd &pending : m_fds) {
+        ::close(pending.fd);
+    }
+}
+
+void SharedPayloadFds::received(int size, int fd)
+{
+    if (Q_UNLIKELY(fd != -1)) {
+        m_fds.enqueue({ fd, m_position, m_position + size });
+    }
+    m_position += size;
+}
+
+int SharedPayloadFds::take(const char *message, int size, qint64 position)
+{
+    if (Q_LIKELY(m_fds.isEmpty())) {
+        return -1;
+    }
+
+    drop(position);
+    if (!m_fds.isEmpty() && m_fds.head().start <= position && SharedPayload::isAnnounced(message, size)) {
+        return m_fds.dequeue().fd;
+    }
+
+    return -1;
+}
+
+void SharedPayloadFds::drop(qint64 position)
+{
+    while (!m_fds.isEmpty() && m_fds.head().end <= position) {
+        qWarning() << "Dropping an fd which came with no message announcing a shared payload";
+        ::close(m_fds.dequeue().fd);
+    }
+}
+
+}
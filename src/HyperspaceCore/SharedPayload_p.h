@@ -0,0 +1,81 @@
+#ifndef _HYPERSPACE_SHAREDPAYLOAD_P_H_
+#define _HYPERSPACE_SHAREDPAYLOAD_P_H_
+
+#include <QtCore/QByteArray>
+#include <QtCore/QQueue>
+#include <QtCore/QSharedPointer>
+
+// The message key holding the size of a payload which travels in a memfd, instead of in "p"
+#define SHARED_PAYLOAD_KEY "P"
+
+namespace Hyperspace
+{
+
+/*
+ * Large payloads skip the socket: the sender copies them once into a sealed memfd, which goes along
+ * with the message through SCM_RIGHTS, and the receiver maps it read-only. The seals guarantee the
+ * sender can neither change nor truncate the memory once it has been sent.
+ */
+class SharedPayload
+{
+    public:
+        ~SharedPayload();
+
+        /* Returns a sealed memfd holding payload, or -1 if it couldn't be created. */
+        static int createFd(const QByteArray &payload);
+        /* Maps size bytes of a memfd received along with a message. fd can be closed afterwards. */
+        static QSharedPointer<SharedPayload> map(int fd, qint64 size);
+        /* Whether a serialized message announces a payload in a memfd, which then came along with it. */
+        static bool isAnnounced(const char *message, int size);
+
+        /* A view on the mapping: it is valid as long as this SharedPayload lives. */
+        inline QByteArray payload() const { return QByteArray::fromRawData(m_data, m_size); }
+        /* Whether data points into the mapping, such as a view handed out by payload(). */
+        inline bool contains(const char *data) const { return data >= m_data && data < m_data + m_size; }
+
+    private:
+        SharedPayload(const char *data, int size) : m_data(data), m_size(size) {}
+        Q_DISABLE_COPY(SharedPayload)
+
+        const char *m_data;
+        int m_size;
+};
+
+/*
+ * Pairs the fds received on a stream with the messages announcing a shared payload. An fd travels with
+ * the first byte of its message, but the read which carries it may begin with earlier messages: the fd
+ * belongs to the first announcing message which starts within that read. Positions count the bytes read
+ * from the stream so far. Fds which no message can claim anymore are closed.
+ */
+class SharedPayloadFds
+{
+    public:
+        SharedPayloadFds() : m_position(0) {}
+        ~SharedPayloadFds();
+
+        /* Accounts for a read of size bytes, which came along with fd, or -1. */
+        void received(int size, int fd);
+        /* Returns the fd of message, which starts at position in the stream, or -1 if it has none. */
+        int take(const char *message, int size, qint64 position);
+        /* Closes the fds which no message starting at position or later can claim. */
+        void drop(qint64 position);
+
+        /* How many bytes were read so far. */
+        inline qint64 position() const { return m_position; }
+
+    private:
+        Q_DISABLE_COPY(SharedPayloadFds)
+
+        struct PendingFd {
+            int fd;
+            qint64 start;
+            qint64 end;
+        };
+
+        QQueue<PendingFd> m_fds;
+        qint64 m_position;
+};
+
+}
+
+#endif
@@ -1,40 +1,88 @@
 #include "Socket.h"
+#include "BSONStreamReader.h"
+#include "SPSCQueue_p.h"
+#include "SharedPayload_p.h"
 #include <Literals>
 
+#include <errno.h>
 #include <fcntl.h>
-#include <sys/ioctl.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
 #include <sys/un.h>
 #include <unistd.h>
 
 #include <QtCore/QDebug>
 #include <QtCore/QLoggingCategory>
+#include <QtCore/QMutex>
 #include <QtCore/QSocketNotifier>
+#include <QtCore/QThread>
+#include <QtCore/QTimer>
+#include <QtCore/QWaitCondition>
 
-#define BUFFER_SIZE 8192
+#include <deque>
+
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+// The receive buffer adapts to the size of incoming bursts, between these bounds
+#define READ_BUFFER_MINIMUM_SIZE 8192
+#define READ_BUFFER_MAXIMUM_SIZE (1024 * 1024)
+// Reads using less than a quarter of the buffer this many times in a row halve it
+#define READ_BUFFER_SHRINK_THRESHOLD 64
+// Datagrams handed out per read notification at most, so that a chatty peer can't starve the event loop
+#define READ_MAX_DATAGRAMS 64
+
+// Queued messages are coalesced into a single sendmsg, up to this many buffers (well below IOV_MAX)...
+#define WRITE_MAX_IOVECS 128
+// ...and this many bytes.
+#define WRITE_MAX_BATCH_SIZE (512 * 1024)
+
+#define DEFAULT_HIGH_WATER_MARK (1024 * 1024)
+// When batching writes, held messages go out once this many bytes are queued
+#define DEFAULT_WRITE_BATCH_SIZE (64 * 1024)
+
+#ifdef HAVE_LIBURING
+#define URING_QUEUE_DEPTH 32
+// The multishot receive picks its buffers from a ring of this many (a power of two)...
+#define URING_BUFFER_COUNT 64
+// ...this big. Each one starts with an io_uring_recvmsg_out and room for an fd.
+#define URING_BUFFER_SIZE 16384
+#define URING_BUFFER_GROUP 0
+// Linked sends in flight at most, each one a batch as big as a vectored write
+#define URING_MAX_SENDS 8
+
+// What completions are about
+#define URING_RECEIVE 1
+#define URING_SEND 2
+#define URING_WRITABLE 3
+#define URING_CANCEL 4
+#endif
 
 Q_LOGGING_CATEGORY(hyperspaceSocketDC, "hyperspace.socket", DEBUG_MESSAGES_DEFAULT_LEVEL)
 
+// Sends iovcnt buffers with a single sendmsg. If fd is not -1, it travels along with the first byte.
 inline ssize_t
-sock_fd_write(int sock, void *buf, ssize_t buflen, int fd)
+sock_fd_writev(int sock, struct iovec *iov, int iovcnt, int fd)
 {
     ssize_t     size;
     struct msghdr   msg;
-    struct iovec    iov;
     union {
         struct cmsghdr  cmsghdr;
         char        control[CMSG_SPACE(sizeof (int))];
     } cmsgu;
     struct cmsghdr  *cmsg;
 
-    iov.iov_base = buf;
-    iov.iov_len = buflen;
-
     msg.msg_name = NULL;
     msg.msg_namelen = 0;
-    msg.msg_iov = &iov;
-    msg.msg_iovlen = 1;
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iovcnt;
+    msg.msg_flags = 0;
 
     if (fd != -1) {
         msg.msg_control = cmsgu.control;
@@ -112,200 +160,1573 @@ sock_fd_read(int sock, void *buf, ssize_t bufsize, int *fd)
 
 namespace Hyperspace {
 
+// Statistics counters are updated by whichever thread does the I/O, and read from any: relaxed ordering is enough
+static inline void increment(QAtomicInteger<quint64> &counter, quint64 amount = 1)
+{
+    counter.fetchAndAddRelaxed(amount);
+}
+
+// A message waiting to be written. Its fd goes out with its first byte.
+struct QueuedMessage
+{
+    QueuedMessage() : fd(-1), ownsFd(false) {}
+    QueuedMessage(const QByteArray &data, int fd, bool ownsFd) : data(data), fd(fd), ownsFd(ownsFd) {}
+
+    // Once the fd has been sent, or the message dropped
+    inline void releaseFd() { if (ownsFd && fd != -1) { ::close(fd); } fd = -1; }
+
+    QByteArray data;
+    int fd;
+    bool ownsFd;
+};
+
 class Socket::Private
 {
 public:
-    Private(Socket *q) : q(q), socketFd(-1), lastFd(-1), socketReadyToWrite(true) {}
+    Private(Socket *q) : q(q), socketFd(-1), transport(Socket::StreamTransport), notifier(nullptr), writeNotifier(nullptr), queuedBytes(0), headOffset(0)
+                       , highWaterMark(DEFAULT_HIGH_WATER_MARK), aboveHighWaterMark(false), writeBufferLimit(0)
+                       , overflowPolicy(Socket::RefuseWrites), readBufferSize(READ_BUFFER_MINIMUM_SIZE), smallReads(0)
+                       , socketReadyToWrite(true), ioThreadEnabled(false), ioThread(nullptr), epollFd(-1)
+                       , ioWakeupFd(-1), ownerWakeupFd(-1), ownerWakeupNotifier(nullptr)
+                       , ioWritable(false), disconnectedEmitted(false) {}
 
     Socket *q;
 
     QString serverPath;
 
     int socketFd;
+    Socket::Transport transport;
     QSocketNotifier *notifier;
     QSocketNotifier *writeNotifier;
 
-    QList< QPair< QByteArray, int > > messageQueue;
+    // Owned by the I/O thread, when there is one
+    std::deque< QueuedMessage > messageQueue;
+    // Bytes in the queue which are still to be written
+    QAtomicInteger<qint64> queuedBytes;
+    // Bytes of the first queued message which have already been written
+    int headOffset;
+
+    qint64 highWaterMark;
+    bool aboveHighWaterMark;
+    qint64 writeBufferLimit;
+    Socket::OverflowPolicy overflowPolicy;
+
+    // Handed out with readyRead, and reused once whoever got it lets it go
+    QByteArray readBuffer;
+    int readBufferSize;
+    int smallReads;
 
-    QByteArray internalBuffer;
-    int lastFd;
     bool socketReadyToWrite;
 
+    // I/O thread mode. The I/O thread owns the socket and the write queue, and talks to the owner thread
+    // through two SPSC queues. Each side wakes the other up through an eventfd, once per batch.
+    bool ioThreadEnabled;
+    QThread *ioThread;
+    int epollFd;
+    int ioWakeupFd;
+    int ownerWakeupFd;
+    QSocketNotifier *ownerWakeupNotifier;
+    SPSCQueue< QueuedMessage > outgoing;
+    SPSCQueue< QPair< QByteArray, int > > incoming;
+    QAtomicInt ioWakeupPending;
+    QAtomicInt ownerWakeupPending;
+    QAtomicInt stopping;
+    QAtomicInt ioConnected;
+    QAtomicInt ioDisconnected;
+    QAtomicInteger<qint64> flushedBytes;
+    // BlockWrites waits on this when the I/O thread has the queue
+    QMutex roomMutex;
+    QWaitCondition roomCondition;
+    // I/O thread only
+    Util::BSONStreamReader ioReader;
+    SharedPayloadFds ioPayloadFds;
+    bool ioWritable;
+    // Owner thread only
+    bool disconnectedEmitted;
+
+    // Write batching. Messages are held until the latency budget expires, or writeBatchSize bytes are queued:
+    // whatever producers write in the meantime goes out in a single vectored write.
+    int writeLatencyBudget = 0;
+    qint64 writeBatchSize = DEFAULT_WRITE_BATCH_SIZE;
+    int batchTimerFd = -1;
+    QSocketNotifier *batchTimerNotifier = nullptr;
+    bool batchTimerArmed = false;
+
+    // Statistics. Whatever the I/O thread might update is atomic, the rest belongs to the owner thread.
+    QAtomicInteger<quint64> bytesRead;
+    QAtomicInteger<quint64> messagesWritten;
+    QAtomicInteger<quint64> bytesWritten;
+    QAtomicInteger<quint64> syscalls;
+    QAtomicInteger<quint64> partialWrites;
+    QAtomicInteger<quint64> wouldBlock;
+    QAtomicInt reassemblyBacklogPeak;
+    quint64 messagesRead = 0;
+    qint64 writeQueuePeak = 0;
+    QTimer *statisticsTimer = nullptr;
+
+    bool ioUringEnabled = false;
+#ifdef HAVE_LIBURING
+    // io_uring backend. The ring does all of the socket's I/O: a multishot receive stays armed, queued messages
+    // go out as chains of linked sends, and the event loop only watches the ring's eventfd.
+    struct UringSend {
+        struct msghdr msg;
+        struct iovec iov[WRITE_MAX_IOVECS];
+        ssize_t size;
+        union {
+            struct cmsghdr  cmsghdr;
+            char        control[CMSG_SPACE(sizeof (int))];
+        } cmsgu;
+    };
+
+    struct io_uring *ring = nullptr;
+    struct io_uring_buf_ring *bufferRing = nullptr;
+    char *uringBuffers = nullptr;
+    int uringEventFd = -1;
+    QSocketNotifier *uringNotifier = nullptr;
+    // The multishot receive's template: no address, room for an fd
+    struct msghdr uringReceiveHeader;
+    // They have to live until their completion: the kernel reads them while sending
+    UringSend *uringSends = nullptr;
+    int uringSendsInFlight = 0;
+    int uringSendsCompleted = 0;
+    bool uringReceiveArmed = false;
+    bool uringWritablePending = false;
+    // Bytes received in the batch being built in readBuffer
+    int uringReceived = 0;
+
+    bool startIOUring(bool connecting);
+    void stopIOUring();
+    bool uringArmReceive();
+    void uringArmWritable();
+    void uringSubmitSends();
+    void uringProcessCompletions();
+    void uringAppendReceived(const char *data, int size);
+    void uringEmitReceived(int fd);
+#endif
+
+    bool connectToServer(int type, int *error);
+    int readIntoBuffer(int *fd, bool *closed);
+    int readDatagram(int *fd, bool *closed);
+    void readAvailable();
+    void adaptReadBuffer(int received);
+    qint64 flushQueue();
+    qint64 flushDatagrams();
+    void dequeueWritten(qint64 written);
+    void setUpNotifiers();
+    void checkHighWaterMark();
+    bool waitForRoom(qint64 size);
+    void holdWrite();
+    void startWrite();
+
+    bool startIOThread();
+    void stopIOThread();
+    void runIOThread();
+    void ioReadAvailable(bool hangup);
+    void ioFlush();
+    void wakeIOThread();
+    void wakeOwner();
+    void processIncoming();
+
     // Q_PRIVATE_SLOT
     void writeQueue();
 };
 
-void Socket::Private::writeQueue()
+class SocketIOThread : public QThread
 {
-    qCDebug(hyperspaceSocketDC) << Q_FUNC_INFO;
+public:
+    SocketIOThread(Socket::Private *socket) : m_socket(socket) {}
 
-    if (Q_UNLIKELY(!q->isReady())) {
-        // We are ready!
-        q->setReady();
+protected:
+    virtual void run() override final { m_socket->runIOThread(); }
+
+private:
+    Socket::Private *m_socket;
+};
+
+int Socket::Private::readIntoBuffer(int *fd, bool *closed)
+{
+    // Reuse the previous buffer, unless someone is still holding onto it
+    if (!readBuffer.isDetached() || readBuffer.capacity() > 2 * readBufferSize) {
+        readBuffer = QByteArray();
     }
+    // Without a reserved capacity, QByteArray frees the buffer on resize(0) and reallocates it when shrinking
+    // to less than half of it
+    readBuffer.reserve(readBufferSize);
+    readBuffer.resize(readBufferSize);
+
+    int received = 0;
+    *fd = -1;
+    *closed = false;
 
-    // Do we have data to be written?
-    QByteArray toBeWritten;
-    int fdToBeWritten = -1;
-    if (!internalBuffer.isEmpty()) {
-        toBeWritten = internalBuffer;
-        fdToBeWritten = lastFd;
+    // Read until the socket runs dry
+    while (true) {
+        if (received == readBuffer.size()) {
+            if (readBuffer.size() >= READ_BUFFER_MAXIMUM_SIZE) {
+                // Hand out what we have: we'll be notified again for the rest
+                break;
+            }
+            readBuffer.resize(qMin(readBuffer.size() * 2, READ_BUFFER_MAXIMUM_SIZE));
+        }
 
-        internalBuffer.clear();
-        lastFd = -1;
-    } else if (!messageQueue.isEmpty()) {
-        toBeWritten = messageQueue.first().first;
-        fdToBeWritten = messageQueue.first().second;
+        ssize_t dataRead = sock_fd_read(socketFd, readBuffer.data() + received, readBuffer.size() - received, fd);
+        increment(syscalls);
 
-        messageQueue.removeAt(0);
-    } else {
-        // Nothing to do. Disable the notifier (and empty the cache, to be sure)
-        writeNotifier->setEnabled(false);
-        internalBuffer.clear();
-        lastFd = -1;
-        return;
+        if (dataRead > 0) {
+            received += dataRead;
+            if (*fd != -1) {
+                // Only one fd per batch: the next one gets read with the next notification
+                break;
+            }
+        } else if (dataRead == 0) {
+            *closed = true;
+            break;
+        } else {
+            int error = 0 - dataRead;
+            if (error == EINTR) {
+                continue;
+            } else if (error == EAGAIN || error == EWOULDBLOCK) {
+                increment(wouldBlock);
+            } else {
+                // Handle errors
+                qCWarning(hyperspaceSocketDC) << "Dataread failed with " << error;
+            }
+            break;
+        }
+    }
+
+    increment(bytesRead, received);
+    adaptReadBuffer(received);
+
+    // The capacity is reserved: shrinking keeps the memory for the next read
+    readBuffer.resize(received);
+    return received;
+}
+
+int Socket::Private::readDatagram(int *fd, bool *closed)
+{
+    *fd = -1;
+    *closed = false;
+
+    // Peek at the size first: a datagram which doesn't fit the buffer would be truncated
+    ssize_t size;
+    do {
+        size = ::recv(socketFd, nullptr, 0, MSG_PEEK | MSG_TRUNC);
+        increment(syscalls);
+    } while (size < 0 && errno == EINTR);
+
+    if (size <= 0) {
+        if (size == 0) {
+            // No empty message is ever sent: this is the end of the connection
+            *closed = true;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            increment(wouldBlock);
+        } else {
+            qCWarning(hyperspaceSocketDC) << "Dataread failed with " << errno;
+        }
+        return 0;
     }
 
-    // go
-    int written = sock_fd_write(socketFd, toBeWritten.data(), toBeWritten.size(), fdToBeWritten);
+    // Reuse the previous buffer, unless someone is still holding onto it or it's way too big
+    if (!readBuffer.isDetached() || readBuffer.capacity() > 2 * qMax<int>(size, READ_BUFFER_MINIMUM_SIZE)) {
+        readBuffer = QByteArray();
+    }
+    readBuffer.reserve(size);
+    readBuffer.resize(size);
+
+    ssize_t dataRead = sock_fd_read(socketFd, readBuffer.data(), size, fd);
+    increment(syscalls);
+    if (Q_UNLIKELY(dataRead != size)) {
+        qCWarning(hyperspaceSocketDC) << "Dataread failed with " << (dataRead < 0 ? 0 - dataRead : 0);
+        if (*fd != -1) {
+            ::close(*fd);
+            *fd = -1;
+        }
+        return 0;
+    }
 
-    if (Q_UNLIKELY(written < 0)) {
-        int error = 0 - written;
-        qCWarning(hyperspaceSocketDC) << "Writing to socket failed with error: " << error;
-        qCDebug(hyperspaceSocketDC) << "Dropping buffered payload!";
+    increment(bytesRead, size);
+    return size;
+}
 
-        // If a write error occurred, let's just drop the payload.
-    } else if (written < toBeWritten.size()) {
-        internalBuffer = toBeWritten.right(toBeWritten.size() - written);
-        lastFd = fdToBeWritten;
+void Socket::Private::readAvailable()
+{
+    int fd;
+    bool closed;
+    if (transport == Socket::SeqPacketTransport) {
+        // Every datagram is a message on its own: hand them out one by one, each with its fd
+        for (int i = 0; i < READ_MAX_DATAGRAMS && readDatagram(&fd, &closed) > 0; ++i) {
+            ++messagesRead;
+            Q_EMIT q->readyRead(readBuffer, fd);
+        }
+    } else if (readIntoBuffer(&fd, &closed) > 0) {
+        ++messagesRead;
+        Q_EMIT q->readyRead(readBuffer, fd);
     }
 
-    // Enable the notifier
-    writeNotifier->setEnabled(true);
+    if (closed) {
+        qCInfo(hyperspaceSocketDC) << "Connection closed";
+        notifier->setEnabled(false);
+        Q_EMIT q->disconnected();
+    }
 }
 
-Socket::Socket(const QString& serverPath, QObject* parent)
-    : AsyncInitObject(parent)
-    , d(new Private(this))
+void Socket::Private::adaptReadBuffer(int received)
 {
-    d->serverPath = serverPath;
+    if (received > readBufferSize) {
+        // The buffer had to grow: start from there next time
+        readBufferSize = readBuffer.size();
+        smallReads = 0;
+    } else if (received < readBufferSize / 4 && readBufferSize > READ_BUFFER_MINIMUM_SIZE) {
+        if (++smallReads >= READ_BUFFER_SHRINK_THRESHOLD) {
+            readBufferSize = qMax(readBufferSize / 2, READ_BUFFER_MINIMUM_SIZE);
+            smallReads = 0;
+        }
+    } else {
+        smallReads = 0;
+    }
 }
 
-Socket::Socket(int fd, QObject* parent)
-    : AsyncInitObject(parent)
-    , d(new Private(this))
+void Socket::Private::checkHighWaterMark()
 {
-    d->socketFd = fd;
+    if (highWaterMark > 0 && !aboveHighWaterMark && queuedBytes.load() >= highWaterMark) {
+        // Signalled once, until the queue drains
+        aboveHighWaterMark = true;
+        Q_EMIT q->highWaterMarkReached();
+    }
 }
 
-Socket::~Socket()
+bool Socket::Private::waitForRoom(qint64 size)
 {
-    if (d->socketFd > 0) {
-        ::close(d->socketFd);
+    if (ioThread) {
+        // Held messages have to go out to make room
+        wakeIOThread();
+
+        // The I/O thread wakes us up whenever it writes something
+        QMutexLocker locker(&roomMutex);
+        while (queuedBytes.load() > 0 && queuedBytes.load() + size > writeBufferLimit) {
+            if (ioDisconnected.loadAcquire()) {
+                return false;
+            }
+            roomCondition.wait(&roomMutex);
+        }
+
+        return true;
     }
 
-    delete d;
+#ifdef HAVE_LIBURING
+    if (ring) {
+        // Completions are what make room
+        startWrite();
+        while (ring && queuedBytes.load() > 0 && queuedBytes.load() + size > writeBufferLimit) {
+            struct io_uring_cqe *cqe;
+            if (io_uring_wait_cqe(ring, &cqe) < 0) {
+                return false;
+            }
+            uringProcessCompletions();
+        }
+
+        return ring != nullptr;
+    }
+#endif
+
+    while (queuedBytes.load() > 0 && queuedBytes.load() + size > writeBufferLimit) {
+        struct pollfd pfd;
+        pfd.fd = socketFd;
+        pfd.events = POLLOUT;
+        pfd.revents = 0;
+
+        if (::poll(&pfd, 1, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+
+        if (Q_UNLIKELY(pfd.revents & (POLLERR | POLLHUP | POLLNVAL))) {
+            return false;
+        }
+
+        writeQueue();
+    }
+
+    return true;
 }
 
-void Socket::initImpl()
+bool Socket::Private::startIOThread()
 {
-    int len, flags;
-    bool socketExists = d->socketFd > 0;
-    struct sockaddr_un remote;
+    epollFd = ::epoll_create1(EPOLL_CLOEXEC);
+    ioWakeupFd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    ownerWakeupFd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (epollFd < 0 || ioWakeupFd < 0 || ownerWakeupFd < 0) {
+        return false;
+    }
 
-    if (!socketExists) {
-        if ((d->socketFd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
-            setInitError(QLatin1String(Hemera::Literals::Errors::badRequest()), QString::fromLatin1(strerror(errno)));
-            return;
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.fd = ioWakeupFd;
+    if (::epoll_ctl(epollFd, EPOLL_CTL_ADD, ioWakeupFd, &event) < 0) {
+        return false;
+    }
+
+    // Writability tells us when the connection is up
+    event.events = EPOLLIN | EPOLLOUT;
+    event.data.fd = socketFd;
+    ioWritable = true;
+    if (::epoll_ctl(epollFd, EPOLL_CTL_ADD, socketFd, &event) < 0) {
+        return false;
+    }
+
+    ownerWakeupNotifier = new QSocketNotifier(ownerWakeupFd, QSocketNotifier::Read, q);
+    QObject::connect(ownerWakeupNotifier, &QSocketNotifier::activated, q, [this] {
+        processIncoming();
+    });
+
+    ioThread = new SocketIOThread(this);
+    ioThread->start();
+    return true;
+}
+
+void Socket::Private::stopIOThread()
+{
+    if (ioThread) {
+        stopping.storeRelease(1);
+        wakeIOThread();
+        ioThread->wait();
+        delete ioThread;
+        ioThread = nullptr;
+
+        // Whatever the owner never got still holds its fd
+        QPair< QByteArray, int > message;
+        while (incoming.pop(&message)) {
+            if (message.second != -1) {
+                ::close(message.second);
+            }
         }
     }
 
-    flags = fcntl(d->socketFd,F_GETFL,0);
-    fcntl(d->socketFd, F_SETFL, flags | O_NONBLOCK);
+    delete ownerWakeupNotifier;
+    ownerWakeupNotifier = nullptr;
+
+    if (epollFd >= 0) {
+        ::close(epollFd);
+    }
+    if (ioWakeupFd >= 0) {
+        ::close(ioWakeupFd);
+    }
+    if (ownerWakeupFd >= 0) {
+        ::close(ownerWakeupFd);
+    }
+}
+
+void Socket::Private::runIOThread()
+{
+    struct epoll_event events[2];
+
+    while (!stopping.loadAcquire()) {
+        int count = ::epoll_wait(epollFd, events, 2, -1);
+        if (count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            qCWarning(hyperspaceSocketDC) << "epoll_wait failed with error: " << errno;
+            break;
+        }
+
+        bool flush = false;
+        for (int i = 0; i < count; ++i) {
+            if (events[i].data.fd == ioWakeupFd) {
+                uint64_t value;
+                while (::read(ioWakeupFd, &value, sizeof(value)) > 0) {}
+                ioWakeupPending.storeRelease(0);
 
-    if (!socketExists) {
-        remote.sun_family = AF_UNIX;
-        // We need size() +1, as \0 is not counted in size.
-        strncpy(remote.sun_path, d->serverPath.toLatin1().constData(), d->serverPath.size() + 1);
-        qCInfo(hyperspaceSocketDC) << "Connecting to " << remote.sun_path;
-        len = strlen(remote.sun_path) + sizeof(remote.sun_family);
-        if (::connect(d->socketFd, (struct sockaddr *)&remote, len) == -1) {
-            if (errno == EINPROGRESS) {
-                // We assume it's alright to be here, the notifier will do its job.
+                // Take over whatever the owner queued
+                QueuedMessage message;
+                while (outgoing.pop(&message)) {
+                    messageQueue.push_back(message);
+                }
+                flush = true;
             } else {
-                setInitError(QLatin1String(Hemera::Literals::Errors::badRequest()), QString::fromLatin1(strerror(errno)));
-                return;
+                if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                    ioReadAvailable(events[i].events & (EPOLLHUP | EPOLLERR));
+                }
+                if (events[i].events & EPOLLOUT) {
+                    if (!ioConnected.loadAcquire()) {
+                        ioConnected.storeRelease(1);
+                        wakeOwner();
+                    }
+                    flush = true;
+                }
             }
         }
+
+        if (flush && !ioDisconnected.loadAcquire()) {
+            ioFlush();
+        }
     }
+}
 
-    // Raise our read notifier
-    d->notifier = new QSocketNotifier(d->socketFd, QSocketNotifier::Read, this);
-    connect(d->notifier, &QSocketNotifier::activated, this, [this] {
-        // Read data
-        int fd = -1;
-        QByteArray buf;
-        ssize_t dataRead;
-        while (true) {
-            buf.resize(buf.size() + BUFFER_SIZE);
-            // It might be that fd has been set on a previous call, if we're really unlucky.
-            if (fd > 0) {
-                dataRead = sock_fd_read(d->socketFd, buf.data() + (buf.size() - BUFFER_SIZE), BUFFER_SIZE, NULL);
+void Socket::Private::ioReadAvailable(bool hangup)
+{
+    if (ioDisconnected.loadAcquire()) {
+        return;
+    }
+
+    int fd;
+    bool closed;
+    if (transport == Socket::SeqPacketTransport) {
+        // No framing to do: the buffer goes to the owner thread as it is, and the next read gets a new one
+        while (readDatagram(&fd, &closed) > 0) {
+            incoming.push(qMakePair(readBuffer, fd));
+        }
+    } else {
+        do {
+            if (readIntoBuffer(&fd, &closed) == 0) {
+                break;
+            }
+
+            // The read might begin with the tail of earlier documents: the fd goes with the one announcing it
+            ioPayloadFds.received(readBuffer.size(), fd);
+
+            // Frame documents here, so that the owner thread only gets complete messages
+            ioReader.enqueueData(readBuffer);
+            reassemblyBacklogPeak.store(ioReader.peakBytesBuffered());
+            while (ioReader.canReadDocument()) {
+                qint64 documentStart = ioPayloadFds.position() - ioReader.bytesBuffered();
+                Util::BSONView document = ioReader.dequeueDocumentView();
+                int documentFd = ioPayloadFds.take(document.constData(), document.size(), documentStart);
+                incoming.push(qMakePair(document.toByteArray(), documentFd));
+            }
+
+            if (Q_UNLIKELY(ioReader.isDesynchronized())) {
+                qCWarning(hyperspaceSocketDC) << "The incoming stream is corrupted, all further data will be discarded";
+                ioPayloadFds.drop(ioPayloadFds.position());
             } else {
-                dataRead = sock_fd_read(d->socketFd, buf.data() + (buf.size() - BUFFER_SIZE), BUFFER_SIZE, &fd);
+                ioPayloadFds.drop(ioPayloadFds.position() - ioReader.bytesBuffered());
             }
+            // On hangup, get everything that's left before giving up on the socket
+        } while (hangup && !closed);
+    }
 
-            // Resize the ba again
-            buf.resize(buf.size() - BUFFER_SIZE + dataRead);
+    if (closed || hangup) {
+        // Stop polling the socket, and let the owner know
+        ::epoll_ctl(epollFd, EPOLL_CTL_DEL, socketFd, nullptr);
+        ioDisconnected.storeRelease(1);
 
-            if (dataRead == 0) {
-                if (buf.size() - BUFFER_SIZE >= 0) {
-                    Q_EMIT readyRead(buf, fd);
-                }
+        QMutexLocker locker(&roomMutex);
+        roomCondition.wakeAll();
+    }
 
-                qCInfo(hyperspaceSocketDC) << "Connection closed";
-                d->notifier->setEnabled(false);
-                Q_EMIT disconnected();
-                return;
-            } else if (dataRead < 0) {
-                // Handle errors
-                int error = 0 - dataRead;
-                qCWarning(hyperspaceSocketDC) << "Dataread failed with " << error;
-                qCDebug(hyperspaceSocketDC) << "Dropping buffered payload!";
+    wakeOwner();
+}
+
+void Socket::Private::ioFlush()
+{
+    if (!messageQueue.empty()) {
+        qint64 flushed = flushQueue();
+        if (flushed > 0) {
+            flushedBytes.fetchAndAddOrdered(flushed);
+            wakeOwner();
+
+            QMutexLocker locker(&roomMutex);
+            roomCondition.wakeAll();
+        }
+    }
+
+    // Poll for writability only while there's something left to write
+    bool writable = !messageQueue.empty();
+    if (writable != ioWritable) {
+        struct epoll_event event;
+        event.events = EPOLLIN | (writable ? EPOLLOUT : 0);
+        event.data.fd = socketFd;
+        ::epoll_ctl(epollFd, EPOLL_CTL_MOD, socketFd, &event);
+        ioWritable = writable;
+    }
+}
+
+void Socket::Private::wakeIOThread()
+{
+    // One wakeup per batch: whatever gets queued until the I/O thread clears the flag goes along
+    if (ioWakeupPending.testAndSetOrdered(0, 1)) {
+        uint64_t value = 1;
+        ssize_t written = ::write(ioWakeupFd, &value, sizeof(value));
+        Q_UNUSED(written);
+    }
+}
+
+void Socket::Private::wakeOwner()
+{
+    if (ownerWakeupPending.testAndSetOrdered(0, 1)) {
+        uint64_t value = 1;
+        ssize_t written = ::write(ownerWakeupFd, &value, sizeof(value));
+        Q_UNUSED(written);
+    }
+}
+
+void Socket::Private::processIncoming()
+{
+    uint64_t value;
+    while (::read(ownerWakeupFd, &value, sizeof(value)) > 0) {}
+    ownerWakeupPending.storeRelease(0);
+
+    if (Q_UNLIKELY(!q->isReady()) && ioConnected.loadAcquire()) {
+        q->setReady();
+    }
+
+    QPair< QByteArray, int > message;
+    while (incoming.pop(&message)) {
+        ++messagesRead;
+        Q_EMIT q->readyRead(message.first, message.second);
+    }
+
+    qint64 flushed = flushedBytes.fetchAndStoreOrdered(0);
+    if (flushed > 0) {
+        Q_EMIT q->bytesWritten(flushed);
+        if (queuedBytes.load() == 0) {
+            aboveHighWaterMark = false;
+            Q_EMIT q->drained();
+        }
+    }
+
+    if (ioDisconnected.loadAcquire() && !disconnectedEmitted) {
+        disconnectedEmitted = true;
+        qCInfo(hyperspaceSocketDC) << "Connection closed";
+        Q_EMIT q->disconnected();
+    }
+}
+
+qint64 Socket::Private::flushQueue()
+{
+    if (transport == Socket::SeqPacketTransport) {
+        return flushDatagrams();
+    }
+
+    struct iovec iov[WRITE_MAX_IOVECS];
+    qint64 flushed = 0;
+
+    // Keep writing until either the queue or the socket's buffer runs out
+    while (!messageQueue.empty()) {
+        // Gather as many messages as possible. A message carrying an fd has to start a batch: the fd is
+        // sent along with the first byte of the sendmsg, and the receiver gets it with the matching read.
+        int fdToBeWritten = headOffset == 0 ? messageQueue.front().fd : -1;
+        int iovcnt = 0;
+        ssize_t batchSize = 0;
+        for (std::deque< QueuedMessage >::const_iterator i = messageQueue.cbegin(); i != messageQueue.cend(); ++i) {
+            if (iovcnt > 0 && (i->fd != -1 || iovcnt == WRITE_MAX_IOVECS || batchSize >= WRITE_MAX_BATCH_SIZE)) {
                 break;
             }
 
-            // We move forward in the cycle only if we still have things to get from the socket.
-            int count;
-            ioctl(d->socketFd, FIONREAD, &count);
-            if (count == 0) {
+            int offset = iovcnt == 0 ? headOffset : 0;
+            iov[iovcnt].iov_base = const_cast<char *>(i->data.constData()) + offset;
+            iov[iovcnt].iov_len = i->data.size() - offset;
+            batchSize += iov[iovcnt].iov_len;
+            ++iovcnt;
+        }
+
+        // go
+        ssize_t written = sock_fd_writev(socketFd, iov, iovcnt, fdToBeWritten);
+        increment(syscalls);
+
+        if (Q_UNLIKELY(written < 0)) {
+            int error = 0 - written;
+            if (error == EAGAIN || error == EWOULDBLOCK) {
+                // Wait for the socket to drain
+                increment(wouldBlock);
                 break;
             }
+
+            qCWarning(hyperspaceSocketDC) << "Writing to socket failed with error: " << error;
+            qCDebug(hyperspaceSocketDC) << "Dropping buffered payload!";
+
+            // If a write error occurred, let's just drop the payload, and try again with the next one later.
+            queuedBytes.fetchAndAddOrdered(-(messageQueue.front().data.size() - headOffset));
+            messageQueue.front().releaseFd();
+            messageQueue.pop_front();
+            headOffset = 0;
+            break;
         }
 
-        // Handle our buffer
-        Q_EMIT readyRead(buf, fd);
-    });
+        bool shortWrite = written < batchSize;
+        flushed += written;
+        dequeueWritten(written);
 
-    // Raise our write notifier
-    d->writeNotifier = new QSocketNotifier(d->socketFd, QSocketNotifier::Write, this);
-    connect(d->writeNotifier, SIGNAL(activated(int)), this, SLOT(writeQueue()));
+        if (shortWrite) {
+            // The socket's buffer is full
+            increment(partialWrites);
+            break;
+        }
+    }
 
-    if (socketExists) {
-        // We're already ready
-        setReady();
+    return flushed;
+}
+
+qint64 Socket::Private::flushDatagrams()
+{
+    struct mmsghdr messages[WRITE_MAX_IOVECS];
+    struct iovec iov[WRITE_MAX_IOVECS];
+    union {
+        struct cmsghdr  cmsghdr;
+        char        control[CMSG_SPACE(sizeof (int))];
+    } cmsgu[WRITE_MAX_IOVECS];
+    qint64 flushed = 0;
+
+    // A datagram per message, each with its own fd, and as many datagrams as possible per sendmmsg.
+    // Datagrams are never split: each one either goes through as a whole, or stays queued.
+    while (!messageQueue.empty()) {
+        int count = 0;
+        for (std::deque< QueuedMessage >::const_iterator i = messageQueue.cbegin(); i != messageQueue.cend() && count < WRITE_MAX_IOVECS; ++i) {
+            iov[count].iov_base = const_cast<char *>(i->data.constData());
+            iov[count].iov_len = i->data.size();
+
+            struct msghdr &msg = messages[count].msg_hdr;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = &iov[count];
+            msg.msg_iovlen = 1;
+            if (i->fd != -1) {
+                msg.msg_control = cmsgu[count].control;
+                msg.msg_controllen = sizeof(cmsgu[count].control);
+
+                struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+                cmsg->cmsg_len = CMSG_LEN(sizeof (int));
+                cmsg->cmsg_level = SOL_SOCKET;
+                cmsg->cmsg_type = SCM_RIGHTS;
+                *((int *) CMSG_DATA(cmsg)) = i->fd;
+            }
+            ++count;
+        }
+
+        int sent = ::sendmmsg(socketFd, messages, count, 0);
+        increment(syscalls);
+
+        if (Q_UNLIKELY(sent < 0)) {
+            if (errno == EINTR) {
+                continue;
+            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                // Wait for the socket to drain
+                increment(wouldBlock);
+                break;
+            }
+
+            // Most likely EMSGSIZE: the message doesn't fit in the socket's buffer, and never will
+            qCWarning(hyperspaceSocketDC) << "Writing to socket failed with error: " << errno;
+            qCDebug(hyperspaceSocketDC) << "Dropping buffered payload!";
+
+            queuedBytes.fetchAndAddOrdered(-messageQueue.front().data.size());
+            messageQueue.front().releaseFd();
+            messageQueue.pop_front();
+            break;
+        }
+
+        for (int i = 0; i < sent; ++i) {
+            increment(bytesWritten, messageQueue.front().data.size());
+            increment(messagesWritten);
+            flushed += messageQueue.front().data.size();
+            queuedBytes.fetchAndAddOrdered(-messageQueue.front().data.size());
+            messageQueue.front().releaseFd();
+            messageQueue.pop_front();
+        }
+
+        if (sent < count) {
+            // The socket's buffer is full, or the next message failed: it gets reported with the next attempt
+            increment(partialWrites);
+            break;
+        }
+    }
+
+    return flushed;
+}
+
+void Socket::Private::dequeueWritten(qint64 written)
+{
+    queuedBytes.fetchAndAddOrdered(-written);
+    increment(bytesWritten, written);
+
+    // Pop whatever went through, and remember where the write stopped in a partially written message
+    while (!messageQueue.empty()) {
+        qint64 remaining = messageQueue.front().data.size() - headOffset;
+        if (written < remaining) {
+            if (written > 0) {
+                headOffset += written;
+                // The fd went with the first byte: don't send it again
+                messageQueue.front().releaseFd();
+            }
+            break;
+        }
+
+        written -= remaining;
+        headOffset = 0;
+        messageQueue.front().releaseFd();
+        messageQueue.pop_front();
+        increment(messagesWritten);
     }
 }
 
-int Socket::write(QByteArray data, int fd)
+void Socket::Private::writeQueue()
 {
-    d->messageQueue.append(qMakePair(data, fd));
+    qCDebug(hyperspaceSocketDC) << Q_FUNC_INFO;
+
+    if (Q_UNLIKELY(!q->isReady())) {
+        // We are ready!
+        q->setReady();
+    }
+
+    if (messageQueue.empty()) {
+        // Nothing to do. Disable the notifier
+        writeNotifier->setEnabled(false);
+        return;
+    }
 
-    // Force the queue only if the write notifier is not enabled.
-    if (!d->writeNotifier->isEnabled()) {
-        d->writeQueue();
+    qint64 flushed = flushQueue();
+
+    // Enable the notifier. Even if the queue is empty: whatever gets written until it fires goes out in a single batch.
+    // When batching writes, the latency budget does that instead.
+    writeNotifier->setEnabled(writeLatencyBudget == 0 || !messageQueue.empty());
+
+    if (flushed > 0) {
+        Q_EMIT q->bytesWritten(flushed);
+    }
+    if (messageQueue.empty() && (flushed > 0 || aboveHighWaterMark)) {
+        aboveHighWaterMark = false;
+        Q_EMIT q->drained();
+    }
+}
+
+void Socket::Private::holdWrite()
+{
+    if (batchTimerArmed) {
+        // Goes out with what is already being held
+        return;
     }
 
+    if (Q_UNLIKELY(batchTimerFd < 0)) {
+        batchTimerFd = ::timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (batchTimerFd < 0) {
+            qCWarning(hyperspaceSocketDC) << "Could not create the batching timer, writing right away:" << errno;
+            startWrite();
+            return;
+        }
+
+        batchTimerNotifier = new QSocketNotifier(batchTimerFd, QSocketNotifier::Read, q);
+        QObject::connect(batchTimerNotifier, &QSocketNotifier::activated, q, [this] {
+            uint64_t expirations;
+            while (::read(batchTimerFd, &expirations, sizeof(expirations)) > 0) {}
+            batchTimerArmed = false;
+            startWrite();
+        });
+    }
+
+    struct itimerspec deadline;
+    memset(&deadline, 0, sizeof(deadline));
+    deadline.it_value.tv_sec = writeLatencyBudget / 1000000;
+    deadline.it_value.tv_nsec = (writeLatencyBudget % 1000000) * 1000;
+    if (::timerfd_settime(batchTimerFd, 0, &deadline, nullptr) < 0) {
+        startWrite();
+        return;
+    }
+
+    batchTimerArmed = true;
+}
+
+void Socket::Private::startWrite()
+{
+    if (ioThread) {
+        wakeIOThread();
+#ifdef HAVE_LIBURING
+    } else if (ring) {
+        // While a chain is in flight, this goes with the next one
+        if (uringSendsInFlight == 0 && !uringWritablePending) {
+            uringSubmitSends();
+        }
+#endif
+    } else if (writeNotifier && !writeNotifier->isEnabled()) {
+        // Otherwise, it goes out as soon as the socket is writable
+        writeQueue();
+    }
+}
+
+void Socket::Private::setUpNotifiers()
+{
+    // Raise our read notifier
+    notifier = new QSocketNotifier(socketFd, QSocketNotifier::Read, q);
+    QObject::connect(notifier, &QSocketNotifier::activated, q, [this] {
+        readAvailable();
+    });
+
+    // Raise our write notifier
+    writeNotifier = new QSocketNotifier(socketFd, QSocketNotifier::Write, q);
+    QObject::connect(writeNotifier, SIGNAL(activated(int)), q, SLOT(writeQueue()));
+}
+
+#ifdef HAVE_LIBURING
+bool Socket::Private::startIOUring(bool connecting)
+{
+    ring = new struct io_uring;
+    if (io_uring_queue_init(URING_QUEUE_DEPTH, ring, 0) < 0) {
+        // No io_uring in this kernel, or it's been disabled
+        delete ring;
+        ring = nullptr;
+        return false;
+    }
+
+    int error;
+    bufferRing = io_uring_setup_buf_ring(ring, URING_BUFFER_COUNT, URING_BUFFER_GROUP, 0, &error);
+    uringEventFd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (!bufferRing || uringEventFd < 0 || io_uring_register_eventfd(ring, uringEventFd) < 0) {
+        stopIOUring();
+        return false;
+    }
+
+    uringBuffers = static_cast<char *>(::malloc(URING_BUFFER_COUNT * URING_BUFFER_SIZE));
+    for (int i = 0; i < URING_BUFFER_COUNT; ++i) {
+        io_uring_buf_ring_add(bufferRing, uringBuffers + i * URING_BUFFER_SIZE, URING_BUFFER_SIZE, i,
+                              io_uring_buf_ring_mask(URING_BUFFER_COUNT), i);
+    }
+    io_uring_buf_ring_advance(bufferRing, URING_BUFFER_COUNT);
+
+    uringSends = new UringSend[URING_MAX_SENDS];
+    memset(&uringReceiveHeader, 0, sizeof(uringReceiveHeader));
+    uringReceiveHeader.msg_controllen = CMSG_SPACE(sizeof (int));
+
+    if (!uringArmReceive()) {
+        stopIOUring();
+        return false;
+    }
+    if (connecting) {
+        // Writability tells us when the connection is up
+        uringArmWritable();
+    }
+    io_uring_submit(ring);
+    increment(syscalls);
+
+    // Kernels without multishot receives reject it right away
+    struct io_uring_cqe *cqe;
+    if (io_uring_peek_cqe(ring, &cqe) == 0 && io_uring_cqe_get_data64(cqe) == URING_RECEIVE &&
+        cqe->res < 0 && !(cqe->flags & IORING_CQE_F_MORE) && cqe->res != -ENOBUFS) {
+        io_uring_cqe_seen(ring, cqe);
+        uringReceiveArmed = false;
+        stopIOUring();
+        return false;
+    }
+
+    uringNotifier = new QSocketNotifier(uringEventFd, QSocketNotifier::Read, q);
+    QObject::connect(uringNotifier, &QSocketNotifier::activated, q, [this] {
+        uint64_t value;
+        while (::read(uringEventFd, &value, sizeof(value)) > 0) {}
+        uringProcessCompletions();
+    });
+
+    return true;
+}
+
+void Socket::Private::stopIOUring()
+{
+    if (uringNotifier) {
+        // We might be inside its activated() signal, when the connection closes
+        uringNotifier->setEnabled(false);
+        uringNotifier->deleteLater();
+        uringNotifier = nullptr;
+    }
+
+    if (ring) {
+        // Nothing may be in flight once the buffers are gone
+        if (uringReceiveArmed || uringWritablePending || uringSendsInFlight > 0) {
+            struct io_uring_sqe *sqe = io_uring_get_sqe(ring);
+            if (sqe) {
+                io_uring_prep_cancel64(sqe, 0, IORING_ASYNC_CANCEL_ANY);
+                io_uring_sqe_set_data64(sqe, URING_CANCEL);
+                io_uring_submit(ring);
+            }
+        }
+
+        struct __kernel_timespec timeout;
+        timeout.tv_sec = 1;
+        timeout.tv_nsec = 0;
+        while (uringReceiveArmed || uringWritablePending || uringSendsInFlight > 0) {
+            struct io_uring_cqe *cqe;
+            if (io_uring_wait_cqe_timeout(ring, &cqe, &timeout) < 0) {
+                qCWarning(hyperspaceSocketDC) << "io_uring operations did not complete in time";
+                break;
+            }
+
+            switch (io_uring_cqe_get_data64(cqe)) {
+                case URING_RECEIVE:
+                    uringReceiveArmed = cqe->flags & IORING_CQE_F_MORE;
+                    break;
+                case URING_SEND:
+                    --uringSendsInFlight;
+                    break;
+                case URING_WRITABLE:
+                    uringWritablePending = false;
+                    break;
+                default:
+                    break;
+            }
+            io_uring_cqe_seen(ring, cqe);
+        }
+
+        if (bufferRing) {
+            io_uring_free_buf_ring(ring, bufferRing, URING_BUFFER_COUNT, URING_BUFFER_GROUP);
+            bufferRing = nullptr;
+        }
+        io_uring_queue_exit(ring);
+        delete ring;
+        ring = nullptr;
+    }
+
+    ::free(uringBuffers);
+    uringBuffers = nullptr;
+    delete [] uringSends;
+    uringSends = nullptr;
+
+    if (uringEventFd >= 0) {
+        ::close(uringEventFd);
+        uringEventFd = -1;
+    }
+}
+
+bool Socket::Private::uringArmReceive()
+{
+    struct io_uring_sqe *sqe = io_uring_get_sqe(ring);
+    if (Q_UNLIKELY(!sqe)) {
+        return false;
+    }
+
+    io_uring_prep_recvmsg_multishot(sqe, socketFd, &uringReceiveHeader, 0);
+    sqe->flags |= IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    io_uring_sqe_set_data64(sqe, URING_RECEIVE);
+    uringReceiveArmed = true;
+    return true;
+}
+
+void Socket::Private::uringArmWritable()
+{
+    struct io_uring_sqe *sqe = io_uring_get_sqe(ring);
+    if (Q_UNLIKELY(!sqe)) {
+        return;
+    }
+
+    io_uring_prep_poll_add(sqe, socketFd, POLLOUT);
+    io_uring_sqe_set_data64(sqe, URING_WRITABLE);
+    uringWritablePending = true;
+}
+
+void Socket::Private::uringSubmitSends()
+{
+    // Same batches as a vectored write, but up to URING_MAX_SENDS of them at once. They're linked, so that
+    // they go out in order, and a short one cancels the rest: they get sent again once it completes.
+    std::deque< QueuedMessage >::const_iterator i = messageQueue.cbegin();
+    int offset = headOffset;
+    struct io_uring_sqe *last = nullptr;
+    int count = 0;
+    while (i != messageQueue.cend() && count < URING_MAX_SENDS) {
+        UringSend &send = uringSends[count];
+        int fd = offset == 0 ? i->fd : -1;
+        int iovcnt = 0;
+        send.size = 0;
+        for (; i != messageQueue.cend(); ++i) {
+            if (iovcnt > 0 && (i->fd != -1 || iovcnt == WRITE_MAX_IOVECS || send.size >= WRITE_MAX_BATCH_SIZE)) {
+                break;
+            }
+
+            send.iov[iovcnt].iov_base = const_cast<char *>(i->data.constData()) + offset;
+            send.iov[iovcnt].iov_len = i->data.size() - offset;
+            send.size += send.iov[iovcnt].iov_len;
+            offset = 0;
+            ++iovcnt;
+        }
+
+        memset(&send.msg, 0, sizeof(send.msg));
+        send.msg.msg_iov = send.iov;
+        send.msg.msg_iovlen = iovcnt;
+        if (fd != -1) {
+            send.msg.msg_control = send.cmsgu.control;
+            send.msg.msg_controllen = sizeof(send.cmsgu.control);
+
+            struct cmsghdr *cmsg = CMSG_FIRSTHDR(&send.msg);
+            cmsg->cmsg_len = CMSG_LEN(sizeof (int));
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_RIGHTS;
+            *((int *) CMSG_DATA(cmsg)) = fd;
+        }
+
+        struct io_uring_sqe *sqe = io_uring_get_sqe(ring);
+        if (Q_UNLIKELY(!sqe)) {
+            break;
+        }
+        io_uring_prep_sendmsg(sqe, socketFd, &send.msg, 0);
+        io_uring_sqe_set_data64(sqe, URING_SEND);
+        sqe->flags |= IOSQE_IO_LINK;
+        last = sqe;
+        ++count;
+    }
+
+    if (last) {
+        last->flags &= ~IOSQE_IO_LINK;
+    }
+
+    uringSendsInFlight = count;
+    uringSendsCompleted = 0;
+    io_uring_submit(ring);
+    increment(syscalls);
+}
+
+void Socket::Private::uringAppendReceived(const char *data, int size)
+{
+    if (uringReceived == 0) {
+        // Reuse the previous buffer, unless someone is still holding onto it
+        if (!readBuffer.isDetached() || readBuffer.capacity() > 2 * readBufferSize) {
+            readBuffer = QByteArray();
+        }
+        readBuffer.reserve(readBufferSize);
+        readBuffer.resize(readBufferSize);
+    } else if (uringReceived + size > READ_BUFFER_MAXIMUM_SIZE) {
+        // Hand out what we have, and start over
+        uringEmitReceived(-1);
+        uringAppendReceived(data, size);
+        return;
+    }
+
+    if (uringReceived + size > readBuffer.size()) {
+        readBuffer.resize(qMin(qMax(readBuffer.size() * 2, uringReceived + size), qMax(READ_BUFFER_MAXIMUM_SIZE, size)));
+    }
+
+    memcpy(readBuffer.data() + uringReceived, data, size);
+    uringReceived += size;
+}
+
+void Socket::Private::uringEmitReceived(int fd)
+{
+    int received = uringReceived;
+    uringReceived = 0;
+
+    adaptReadBuffer(received);
+    // The capacity is reserved: shrinking keeps the memory for the next completion
+    readBuffer.resize(received);
+    ++messagesRead;
+    Q_EMIT q->readyRead(readBuffer, fd);
+}
+
+void Socket::Private::uringProcessCompletions()
+{
+    qint64 flushed = 0;
+    bool closed = false;
+
+    // One at a time: handlers of readyRead may write, and submit more
+    struct io_uring_cqe *cqe;
+    while (ring && io_uring_peek_cqe(ring, &cqe) == 0) {
+        uint64_t type = io_uring_cqe_get_data64(cqe);
+        int result = cqe->res;
+        unsigned flags = cqe->flags;
+        io_uring_cqe_seen(ring, cqe);
+
+        if (type == URING_RECEIVE) {
+            if (result > 0 && (flags & IORING_CQE_F_BUFFER)) {
+                int bufferId = flags >> IORING_CQE_BUFFER_SHIFT;
+                char *buffer = uringBuffers + bufferId * URING_BUFFER_SIZE;
+
+                struct io_uring_recvmsg_out *out = io_uring_recvmsg_validate(buffer, result, &uringReceiveHeader);
+                if (Q_LIKELY(out)) {
+                    int fd = -1;
+                    struct cmsghdr *cmsg = io_uring_recvmsg_cmsg_firsthdr(out, &uringReceiveHeader);
+                    if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+                        fd = *((int *) CMSG_DATA(cmsg));
+                    }
+
+                    int size = io_uring_recvmsg_payload_length(out, result, &uringReceiveHeader);
+                    increment(bytesRead, size);
+                    if (size > 0) {
+                        uringAppendReceived(static_cast<const char *>(io_uring_recvmsg_payload(out, &uringReceiveHeader)), size);
+                    } else if (out->payloadlen == 0) {
+                        // End of the stream
+                        closed = true;
+                    }
+                    if (fd != -1) {
+                        // Only one fd per batch, as with reads
+                        uringEmitReceived(fd);
+                    }
+                }
+
+                // Give the buffer back to the kernel
+                io_uring_buf_ring_add(bufferRing, buffer, URING_BUFFER_SIZE, bufferId, io_uring_buf_ring_mask(URING_BUFFER_COUNT), 0);
+                io_uring_buf_ring_advance(bufferRing, 1);
+            } else if (result == 0) {
+                closed = true;
+            }
+
+            if (!(flags & IORING_CQE_F_MORE)) {
+                uringReceiveArmed = false;
+                if (result < 0 && result != -ENOBUFS) {
+                    qCWarning(hyperspaceSocketDC) << "Dataread failed with " << -result;
+                    closed = true;
+                } else if (!closed) {
+                    // Out of buffers: they've been given back by now
+                    uringArmReceive();
+                    io_uring_submit(ring);
+                    increment(syscalls);
+                }
+            }
+        } else if (type == URING_SEND) {
+            --uringSendsInFlight;
+            if (result > 0) {
+                if (uringSendsCompleted < URING_MAX_SENDS && result < uringSends[uringSendsCompleted].size) {
+                    increment(partialWrites);
+                }
+                flushed += result;
+                dequeueWritten(result);
+            } else if (result == -EAGAIN) {
+                // Wait for the socket to drain
+                increment(wouldBlock);
+                if (!uringWritablePending) {
+                    uringArmWritable();
+                    io_uring_submit(ring);
+                    increment(syscalls);
+                }
+            } else if (result < 0 && result != -ECANCELED && result != -EINTR) {
+                qCWarning(hyperspaceSocketDC) << "Writing to socket failed with error: " << -result;
+                qCDebug(hyperspaceSocketDC) << "Dropping buffered payload!";
+
+                // As with a failed write, drop the payload, and try again with the next one.
+                if (!messageQueue.empty()) {
+                    queuedBytes.fetchAndAddOrdered(-(messageQueue.front().data.size() - headOffset));
+                    messageQueue.front().releaseFd();
+                    messageQueue.pop_front();
+                    headOffset = 0;
+                }
+            }
+            ++uringSendsCompleted;
+        } else if (type == URING_WRITABLE) {
+            uringWritablePending = false;
+            if (Q_UNLIKELY(!q->isReady())) {
+                // We are ready!
+                q->setReady();
+            }
+        }
+    }
+
+    if (uringReceived > 0) {
+        uringEmitReceived(-1);
+    }
+
+    // Whatever got queued while the previous chain was in flight goes out in the next one
+    if (ring && uringSendsInFlight == 0 && !uringWritablePending && !messageQueue.empty()) {
+        uringSubmitSends();
+    }
+
+    if (flushed > 0) {
+        Q_EMIT q->bytesWritten(flushed);
+        if (messageQueue.empty()) {
+            aboveHighWaterMark = false;
+            Q_EMIT q->drained();
+        }
+    }
+
+    if (closed) {
+        qCInfo(hyperspaceSocketDC) << "Connection closed";
+        stopIOUring();
+        Q_EMIT q->disconnected();
+    }
+}
+#endif
+
+Socket::Socket(const QString& serverPath, QObject* parent)
+    : AsyncInitObject(parent)
+    , d(new Private(this))
+{
+    d->serverPath = serverPath;
+}
+
+Socket::Socket(int fd, QObject* parent)
+    : AsyncInitObject(parent)
+    , d(new Private(this))
+{
+    d->socketFd = fd;
+}
+
+Socket::~Socket()
+{
+    d->stopIOThread();
+#ifdef HAVE_LIBURING
+    d->stopIOUring();
+#endif
+
+    // Whatever couldn't be written still holds its fd
+    QueuedMessage message;
+    while (d->outgoing.pop(&message)) {
+        message.releaseFd();
+    }
+    for (QueuedMessage &queued : d->messageQueue) {
+        queued.releaseFd();
+    }
+
+    if (d->socketFd > 0) {
+        ::close(d->socketFd);
+    }
+    if (d->batchTimerFd >= 0) {
+        ::close(d->batchTimerFd);
+    }
+
+    delete d;
+}
+
+bool Socket::Private::connectToServer(int type, int *error)
+{
+    struct sockaddr_un remote;
+
+    if ((socketFd = socket(AF_UNIX, type, 0)) == -1) {
+        *error = errno;
+        return false;
+    }
+
+    int flags = fcntl(socketFd, F_GETFL, 0);
+    fcntl(socketFd, F_SETFL, flags | O_NONBLOCK);
+
+    remote.sun_family = AF_UNIX;
+    // We need size() +1, as \0 is not counted in size.
+    strncpy(remote.sun_path, serverPath.toLatin1().constData(), serverPath.size() + 1);
+    qCInfo(hyperspaceSocketDC) << "Connecting to " << remote.sun_path;
+    int len = strlen(remote.sun_path) + sizeof(remote.sun_family);
+    if (::connect(socketFd, (struct sockaddr *)&remote, len) == -1) {
+        if (errno == EINPROGRESS) {
+            // We assume it's alright to be here, the notifier will do its job.
+        } else {
+            *error = errno;
+            ::close(socketFd);
+            socketFd = -1;
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void Socket::initImpl()
+{
+    bool socketExists = d->socketFd > 0;
+
+    if (socketExists) {
+        int flags = fcntl(d->socketFd, F_GETFL, 0);
+        fcntl(d->socketFd, F_SETFL, flags | O_NONBLOCK);
+
+        // Whatever we were given decides the transport
+        int type;
+        socklen_t typeLength = sizeof(type);
+        if (::getsockopt(d->socketFd, SOL_SOCKET, SO_TYPE, &type, &typeLength) == 0) {
+            d->transport = type == SOCK_SEQPACKET ? SeqPacketTransport : StreamTransport;
+        }
+    } else {
+        int error = 0;
+        bool connected = d->connectToServer(d->transport == SeqPacketTransport ? SOCK_SEQPACKET : SOCK_STREAM, &error);
+        if (!connected && error == EPROTOTYPE && d->transport == SeqPacketTransport) {
+            qCInfo(hyperspaceSocketDC) << "The server doesn't take SOCK_SEQPACKET connections, falling back to a stream";
+            d->transport = StreamTransport;
+            connected = d->connectToServer(SOCK_STREAM, &error);
+        }
+
+        if (!connected) {
+            setInitError(QLatin1String(Hemera::Literals::Errors::badRequest()), QString::fromLatin1(strerror(error)));
+            return;
+        }
+    }
+
+    if (d->ioThreadEnabled) {
+        // The I/O thread has its own loop
+        d->ioUringEnabled = false;
+        if (!d->startIOThread()) {
+            setInitError(QLatin1String(Hemera::Literals::Errors::failedRequest()),
+                         QStringLiteral("Could not start the I/O thread: %1").arg(QString::fromLatin1(strerror(errno))));
+        }
+        // The I/O thread tells us when we're connected
+        return;
+    }
+
+    if (d->ioUringEnabled) {
+#ifdef HAVE_LIBURING
+        if (d->transport == StreamTransport && d->startIOUring(!socketExists)) {
+            if (socketExists) {
+                // We're already ready
+                setReady();
+            }
+            return;
+        }
+#endif
+        qCInfo(hyperspaceSocketDC) << "io_uring is not available for this socket, falling back to socket notifiers";
+        d->ioUringEnabled = false;
+    }
+
+    d->setUpNotifiers();
+
+    if (socketExists) {
+        // We're already ready
+        setReady();
+    }
+}
+
+Socket::Transport Socket::transport() const
+{
+    return d->transport;
+}
+
+void Socket::setTransport(Transport transport)
+{
+    if (Q_UNLIKELY(isReady() || d->notifier || d->ioThread)) {
+        qCWarning(hyperspaceSocketDC) << "The transport can only be selected before initializing the socket";
+        return;
+    }
+
+    d->transport = transport;
+}
+
+bool Socket::isIOUringEnabled() const
+{
+    return d->ioUringEnabled;
+}
+
+void Socket::setIOUringEnabled(bool enabled)
+{
+    if (Q_UNLIKELY(isReady() || d->notifier || d->ioThread)) {
+        qCWarning(hyperspaceSocketDC) << "io_uring can only be enabled before initializing the socket";
+        return;
+    }
+
+    d->ioUringEnabled = enabled;
+}
+
+bool Socket::isIOThreadEnabled() const
+{
+    return d->ioThreadEnabled;
+}
+
+void Socket::setIOThreadEnabled(bool enabled)
+{
+    if (Q_UNLIKELY(isReady() || d->notifier || d->ioThread)) {
+        qCWarning(hyperspaceSocketDC) << "The I/O thread can only be enabled before initializing the socket";
+        return;
+    }
+
+    d->ioThreadEnabled = enabled;
+}
+
+qint64 Socket::bytesToWrite() const
+{
+    return d->queuedBytes.load();
+}
+
+qint64 Socket::highWaterMark() const
+{
+    return d->highWaterMark;
+}
+
+void Socket::setHighWaterMark(qint64 bytes)
+{
+    d->highWaterMark = bytes;
+}
+
+qint64 Socket::writeBufferLimit() const
+{
+    return d->writeBufferLimit;
+}
+
+Socket::OverflowPolicy Socket::overflowPolicy() const
+{
+    return d->overflowPolicy;
+}
+
+void Socket::setWriteBufferLimit(qint64 bytes, OverflowPolicy policy)
+{
+    d->writeBufferLimit = bytes;
+    d->overflowPolicy = policy;
+}
+
+Socket::Statistics Socket::statistics() const
+{
+    Statistics statistics;
+    statistics.messagesRead = d->messagesRead;
+    statistics.bytesRead = d->bytesRead.load();
+    statistics.messagesWritten = d->messagesWritten.load();
+    statistics.bytesWritten = d->bytesWritten.load();
+    statistics.syscalls = d->syscalls.load();
+    statistics.partialWrites = d->partialWrites.load();
+    statistics.wouldBlock = d->wouldBlock.load();
+    statistics.writeQueuePeak = d->writeQueuePeak;
+    statistics.reassemblyBacklogPeak = d->reassemblyBacklogPeak.load();
+    return statistics;
+}
+
+int Socket::statisticsInterval() const
+{
+    return d->statisticsTimer ? d->statisticsTimer->interval() : 0;
+}
+
+void Socket::setStatisticsInterval(int msecs)
+{
+    if (msecs <= 0) {
+        delete d->statisticsTimer;
+        d->statisticsTimer = nullptr;
+        return;
+    }
+
+    if (!d->statisticsTimer) {
+        d->statisticsTimer = new QTimer(this);
+        connect(d->statisticsTimer, &QTimer::timeout, this, [this] {
+            Q_EMIT statisticsUpdated(statistics());
+        });
+    }
+    d->statisticsTimer->start(msecs);
+}
+
+int Socket::writeLatencyBudget() const
+{
+    return d->writeLatencyBudget;
+}
+
+qint64 Socket::writeBatchSize() const
+{
+    return d->writeBatchSize;
+}
+
+void Socket::setWriteBatching(int microseconds, qint64 bytes)
+{
+    d->writeLatencyBudget = qMax(microseconds, 0);
+    d->writeBatchSize = bytes;
+
+    if (d->writeLatencyBudget == 0) {
+        // Whatever is being held goes out now
+        flush();
+    }
+}
+
+void Socket::flush()
+{
+    d->startWrite();
+}
+
+int Socket::write(QByteArray data, int fd, FdOwnership ownership)
+{
+    qint64 queuedBytes = d->queuedBytes.load();
+    if (d->writeBufferLimit > 0 && queuedBytes > 0 && queuedBytes + data.size() > d->writeBufferLimit) {
+        if (d->overflowPolicy == RefuseWrites || !d->waitForRoom(data.size())) {
+            qCDebug(hyperspaceSocketDC) << "Write buffer is full, refusing" << data.size() << "bytes";
+            QueuedMessage(data, fd, ownership == TakeFd).releaseFd();
+            return -1;
+        }
+    }
+
+    d->writeQueuePeak = qMax(d->writeQueuePeak, d->queuedBytes.fetchAndAddOrdered(data.size()) + data.size());
+
+    if (d->ioThread) {
+        d->outgoing.push(QueuedMessage(data, fd, ownership == TakeFd));
+    } else {
+        d->messageQueue.push_back(QueuedMessage(data, fd, ownership == TakeFd));
+    }
+
+    if (d->writeLatencyBudget > 0 && d->queuedBytes.load() < d->writeBatchSize) {
+        d->holdWrite();
+    } else {
+        d->startWrite();
+    }
+
+    d->checkHighWaterMark();
+
     return data.size();
 }
 
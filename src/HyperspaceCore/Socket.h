@@ -13,24 +13,166 @@ class Socket : public Hemera::AsyncInitObject
     Q_PRIVATE_SLOT(d, void writeQueue())
 
 public:
+    /// What write() does when the write buffer limit would be exceeded.
+    enum OverflowPolicy {
+        /// write() returns -1 and drops the data.
+        RefuseWrites,
+        /// write() blocks until the queue drained enough for the data to fit. Meant for producer threads.
+        BlockWrites
+    };
+
+    /// Who closes the fd passed to write().
+    enum FdOwnership {
+        /// The caller: the fd has to stay open until the message has been written.
+        KeepFd,
+        /// The socket, as soon as the fd has been sent, or the message dropped.
+        TakeFd
+    };
+
+    /// How messages travel over the connection.
+    enum Transport {
+        /// A byte stream: messages have to be reframed, and an fd comes along with the read it was sent with.
+        StreamTransport,
+        /// One datagram per message (SOCK_SEQPACKET): readyRead gets exactly one message, along with its own fd.
+        SeqPacketTransport
+    };
+
+    /// What the transport did since the socket was created.
+    struct Statistics {
+        /// readyRead emissions: one per message with SeqPacketTransport or the I/O thread, one per read otherwise.
+        quint64 messagesRead = 0;
+        quint64 bytesRead = 0;
+        quint64 messagesWritten = 0;
+        quint64 bytesWritten = 0;
+        /// Reads, writes and io_uring submissions.
+        quint64 syscalls = 0;
+        /// Writes which couldn't take everything they were given, as the socket's buffer filled up.
+        quint64 partialWrites = 0;
+        /// Reads and writes which found the socket not ready (EAGAIN).
+        quint64 wouldBlock = 0;
+        /// The most bytes ever queued for writing at once.
+        qint64 writeQueuePeak = 0;
+        /// The most bytes the I/O thread ever buffered while reassembling documents.
+        int reassemblyBacklogPeak = 0;
+    };
+
     explicit Socket(const QString &serverPath, QObject* parent = nullptr);
     explicit Socket(int fd, QObject* parent = nullptr);
     virtual ~Socket();
 
+    Transport transport() const;
+    /**
+     * @brief Selects the transport to connect with. Must be called before init().
+     *
+     * If the server doesn't take SeqPacketTransport connections, the socket falls back to StreamTransport:
+     * transport() tells which one is in use once the socket is ready. A socket built from an fd uses the fd's
+     * type. Datagrams have to fit in the socket's send buffer: send larger payloads in shared memory.
+     */
+    void setTransport(Transport transport);
+
+    bool isIOUringEnabled() const;
+    /**
+     * @brief Moves the socket's I/O to io_uring
+     *
+     * A multishot receive stays armed into a ring of provided buffers, queued messages go out as chains of
+     * linked sends, and the event loop only watches the ring's eventfd: a few syscalls per batch instead of
+     * several per message. Only for StreamTransport without an I/O thread. Must be called before init().
+     *
+     * When built without liburing, or on kernels lacking io_uring or multishot receives, the socket falls back
+     * to socket notifiers: isIOUringEnabled() tells whether io_uring is in use once the socket is ready.
+     */
+    void setIOUringEnabled(bool enabled);
+
+    bool isIOThreadEnabled() const;
+    /**
+     * @brief Moves the socket's I/O to a dedicated thread
+     *
+     * The I/O thread owns the socket: it reads, splits the incoming stream into BSON documents and writes
+     * the queue, so that a busy owner thread doesn't stall the connection. readyRead is then emitted once
+     * per document, in the owner thread. Must be called before init().
+     */
+    void setIOThreadEnabled(bool enabled);
+
+    /// @returns The number of queued bytes which haven't been written to the socket yet.
+    qint64 bytesToWrite() const;
+
+    qint64 highWaterMark() const;
+    /**
+     * @brief Sets the amount of queued bytes which triggers highWaterMarkReached
+     *
+     * The default is 1 MiB. 0 disables the signal.
+     */
+    void setHighWaterMark(qint64 bytes);
+
+    qint64 writeBufferLimit() const;
+    OverflowPolicy overflowPolicy() const;
+    /**
+     * @brief Caps the amount of bytes which can be queued for writing
+     *
+     * Once queued data would exceed @p bytes, write() applies @p policy. A message is always accepted when
+     * the queue is empty, however big it is. The default is 0, which means no limit.
+     */
+    void setWriteBufferLimit(qint64 bytes, OverflowPolicy policy = RefuseWrites);
+
+    int writeLatencyBudget() const;
+    qint64 writeBatchSize() const;
+    /**
+     * @brief Holds written messages for up to @p microseconds, or until @p bytes are queued
+     *
+     * Meant for producers writing lots of small messages in a row, such as telemetry: rather than one write per
+     * message, whatever gets written within the latency budget goes out in a single vectored write. Use flush()
+     * for messages which can't wait. The default is 0 microseconds, which writes right away.
+     */
+    void setWriteBatching(int microseconds, qint64 bytes = 64 * 1024);
+
+    Statistics statistics() const;
+    int statisticsInterval() const;
+    /// Emits statisticsUpdated every @p msecs milliseconds. The default is 0, which disables it.
+    void setStatisticsInterval(int msecs);
+
 public Q_SLOTS:
-    int write(QByteArray data, int fd = -1);
+    /// Writes whatever is being held by write batching right away.
+    void flush();
+
+    /**
+     * @brief Queues @p data for writing, along with @p fd if it's not -1
+     *
+     * @p ownership tells whether the socket closes @p fd once it's done with it. It does so even when @p data is refused.
+     *
+     * @returns The size of @p data, or -1 if the write buffer limit refused it.
+     */
+    int write(QByteArray data, int fd = -1, FdOwnership ownership = KeepFd);
 
 protected:
     virtual void initImpl() override final;
 
 Q_SIGNALS:
+    /**
+     * @brief Emitted when data has been read, along with the fd which came with it, if any
+     *
+     * With StreamTransport, @p payload is whatever was read, and @p fd came along with some of it. With
+     * SeqPacketTransport, @p payload is exactly one message, and @p fd the one it was sent with.
+     */
     void readyRead(const QByteArray &payload, int fd);
     void disconnected();
 
+    /// Emitted once per write notification, with the number of bytes which reached the socket.
+    void bytesWritten(qint64 bytes);
+    /// Emitted when the queued bytes reach the high water mark. It is not emitted again until drained().
+    void highWaterMarkReached();
+    /// Emitted when every queued byte has been written.
+    void drained();
+    /// Emitted periodically, when a statistics interval has been set.
+    void statisticsUpdated(const Hyperspace::Socket::Statistics &statistics);
+
 private:
     class Private;
     Private * const d;
+
+    friend class SocketIOThread;
 };
 }
 
+Q_DECLARE_METATYPE(Hyperspace::Socket::Statistics)
+
 #endif // HYPERSPACE_SOCKET_H
@@ -1,7 +1,8 @@
 #include "Wave.h"
 
-#include "BSONDocument.h"
+#include "BSONDocument_p.h"
 #include "BSONSerializer.h"
+#include "SharedPayload_p.h"
 
 #include <QtCore/QDebug>
 #include <QtCore/QSharedData>
@@ -21,7 +22,7 @@ public:
     WaveData(quint64 id, const QByteArray &method, const QByteArray &target, const ByteArrayHash &attributes, const QByteArray &payload)
         : id(id), method(method), target(target), attributes(attributes), payload(payload) { }
     WaveData(const WaveData &other)
-        : QSharedData(other), id(other.id), method(other.method), interface(other.interface), target(other.target), attributes(other.attributes), payload(other.payload) { }
+        : QSharedData(other), id(other.id), method(other.method), interface(other.interface), target(other.target), attributes(other.attributes), payload(other.payload), sharedPayload(other.sharedPayload) { }
     ~WaveData() { }
 
     quint64 id;
@@ -30,6 +31,8 @@ public:
     QByteArray target;
     ByteArrayHash attributes;
     QByteArray payload;
+    // Keeps the mapping payload refers to, if it came in shared memory
+    QSharedPointer<SharedPayload> sharedPayload;
 };
 
 Wave::Wave()
@@ -121,13 +124,29 @@ void Wave::setMethod(const QByteArray& m)
 }
 
 QByteArray Wave::payload() const
+{
+    if (Q_UNLIKELY(!d->sharedPayload.isNull())) {
+        // The mapping goes away with the last copy of this Wave
+        return QByteArray(d->payload.constData(), d->payload.size());
+    }
+
+    return d->payload;
+}
+
+QByteArray Wave::payloadView() const
 {
     return d->payload;
 }
 
 void Wave::setPayload(const QByteArray& p)
 {
-    d->payload = p;
+    if (Q_UNLIKELY(!d->sharedPayload.isNull() && d->sharedPayload->contains(p.constData()))) {
+        // p is a view on the mapping which is about to be released
+        d->payload = QByteArray(p.constData(), p.size());
+    } else {
+        d->payload = p;
+    }
+    d->sharedPayload.clear();
 }
 
 QByteArray Wave::interface() const
@@ -152,52 +171,135 @@ void Wave::setTarget(const QByteArray& t)
 
 QByteArray Wave::serialize() const
 {
-    Util::BSONSerializer s;
+    return serialize(0, nullptr);
+}
+
+QByteArray Wave::serialize(int sharedPayloadThreshold, int *payloadFd) const
+{
+    int fd = -1;
+    if (payloadFd) {
+        if (sharedPayloadThreshold > 0 && d->payload.size() >= sharedPayloadThreshold) {
+            // Falls back to an inline payload if the memfd can't be made
+            fd = SharedPayload::createFd(d->payload);
+        }
+        *payloadFd = fd;
+    }
+
+    int attributesSize = d->attributes.isEmpty() ? 0 : Util::BSONSerializer::stringDocumentSize(d->attributes);
+    int size = Util::BSONSerializer::emptyDocumentSize() +
+               Util::BSONSerializer::int32ElementSize("y") +
+               Util::BSONSerializer::int64ElementSize("u") +
+               Util::BSONSerializer::stringElementSize("m", d->method.size()) +
+               Util::BSONSerializer::stringElementSize("i", d->interface.size()) +
+               Util::BSONSerializer::stringElementSize("t", d->target.size()) +
+               (attributesSize ? Util::BSONSerializer::elementSize("a", attributesSize) : 0) +
+               (fd == -1 ? Util::BSONSerializer::binaryElementSize("p", d->payload.size()) :
+                             Util::BSONSerializer::int64ElementSize(SHARED_PAYLOAD_KEY));
+
+    Util::BSONSerializer s(size);
     s.appendInt32Value("y", (int32_t) Protocol::MessageType::Wave);
     s.appendInt64Value("u", (int64_t) d->id);
     s.appendASCIIString("m", d->method);
     s.appendASCIIString("i", d->interface);
     s.appendASCIIString("t", d->target);
     if (!d->attributes.isEmpty()) {
-        Util::BSONSerializer sa;
+        Util::BSONSerializer::DocumentGuard attributes(s, "a");
         for (ByteArrayHash::const_iterator i = d->attributes.constBegin(); i != d->attributes.constEnd(); ++i) {
-            sa.appendASCIIString(i.key(), i.value());
+            s.appendASCIIString(i.key(), i.value());
         }
-        sa.appendEndOfDocument();
-        s.appendDocument("a", sa.document());
     }
-    s.appendBinaryValue("p", d->payload);
+    if (fd == -1) {
+        s.appendBinaryValue("p", d->payload);
+    } else {
+        s.appendInt64Value(SHARED_PAYLOAD_KEY, d->payload.size());
+    }
     s.appendEndOfDocument();
 
     return s.document();
 }
 
+// A message which can't be decoded gives a Wave with id 0, as with Rebound::fromBinary
+static inline Wave invalidWave()
+{
+    Wave invalid;
+    invalid.setId(0);
+    return invalid;
+}
+
 Wave Wave::fromBinary(const QByteArray &data)
 {
-    Util::BSONDocument doc(data);
-    if (Q_UNLIKELY(!doc.isValid())) {
+    return fromBinary(data, -1);
+}
+
+Wave Wave::fromBinary(const QByteArray &data, int fd)
+{
+    Wave w;
+    int32_t messageType = (int32_t) Protocol::MessageType::Invalid;
+    bool attributesValid = true;
+    qint64 sharedPayloadSize = -1;
+
+    // Single pass over the document: every field of a Wave has a one character key.
+    bool valid = Util::bson_walk_elements(data.constData(), data.size(),
+                                          [&w, &messageType, &attributesValid, &sharedPayloadSize] (const char *key, uint32_t keyLen, uint8_t type, const char *value) {
+        if (keyLen != 1) {
+            return true;
+        }
+
+        switch (key[0]) {
+            case 'y':
+                if (type == TYPE_INT32) {
+                    messageType = Util::bson_value_to_int32(value);
+                }
+                break;
+            case 'u':
+                w.d->id = Util::bson_value_to_integer(type, value);
+                break;
+            case 'm':
+                w.d->method = Util::bson_value_to_byte_array(type, value);
+                break;
+            case 'i':
+                w.d->interface = Util::bson_value_to_byte_array(type, value);
+                break;
+            case 't':
+                w.d->target = Util::bson_value_to_byte_array(type, value);
+                break;
+            case 'p':
+                w.d->payload = Util::bson_value_to_byte_array(type, value);
+                break;
+            case 'P': // SHARED_PAYLOAD_KEY
+                sharedPayloadSize = Util::bson_value_to_integer(type, value, 0);
+                break;
+            case 'a':
+                attributesValid = (type == TYPE_DOCUMENT) && Util::bson_decode_byte_array_hash(value, &w.d->attributes);
+                return attributesValid;
+            default:
+                break;
+        }
+
+        return true;
+    });
+
+    if (Q_UNLIKELY(!attributesValid)) {
+        qDebug() << "Wave attributes are not valid\n";
+        return invalidWave();
+    }
+    if (Q_UNLIKELY(!valid)) {
         qWarning() << "Wave BSON document is not valid!";
-        return Wave();
+        return invalidWave();
     }
-    if (Q_UNLIKELY(doc.int32Value("y") != (int32_t) Protocol::MessageType::Wave)) {
+    if (Q_UNLIKELY(messageType != (int32_t) Protocol::MessageType::Wave)) {
         qWarning() << "Received message is not a Wave";
-        return Wave();
-   }
+        return invalidWave();
+    }
 
-    Wave w;
-    w.setId(doc.int64Value("u"));
-    w.setMethod(doc.byteArrayValue("m"));
-    w.setInterface(doc.byteArrayValue("i"));
-    w.setTarget(doc.byteArrayValue("t"));
-    w.setPayload(doc.byteArrayValue("p"));
-
-    if (doc.contains("a")) {
-        Util::BSONDocument attributesDoc = doc.subdocument("a");
-        if (!attributesDoc.isValid()) {
-            qDebug() << "Wave attributes are not valid\n";
-            return Wave();
+    if (Q_UNLIKELY(sharedPayloadSize >= 0)) {
+        QSharedPointer<SharedPayload> shared = SharedPayload::map(fd, sharedPayloadSize);
+        if (Q_UNLIKELY(shared.isNull())) {
+            qWarning() << "Wave shared payload can't be mapped";
+            return invalidWave();
         }
-        w.setAttributes(attributesDoc.byteArrayValuesHash());
+        w.d->payload = shared->payload();
+        w.d->sharedPayload = shared;
     }
 
     return w;
@@ -57,12 +57,43 @@ public:
     bool removeAttribute(const QByteArray &attribute);
     QByteArray takeAttribute(const QByteArray &attribute);
 
-    /// The wave's payload.
+    /**
+     * @brief The wave's payload.
+     *
+     * A payload received in shared memory gets copied out of the mapping: see payloadView() to read it in place.
+     */
     QByteArray payload() const;
+    /**
+     * @brief The wave's payload, read in place if it was received in shared memory
+     *
+     * The returned QByteArray may refer to the mapping, which lives only as long as this Wave (or a copy of it)
+     * is around. Don't keep it, nor hand it to another message: use payload() for that.
+     */
+    QByteArray payloadView() const;
     void setPayload(const QByteArray &p);
 
     QByteArray serialize() const;
+    /**
+     * @brief Serializes the Wave, moving a payload of at least @p sharedPayloadThreshold bytes to shared memory
+     *
+     * When the payload gets moved, @p payloadFd is set to a sealed memfd holding it, which has to be sent along
+     * with the message and closed afterwards. Otherwise it is set to -1, and this is the same as serialize().
+     */
+    QByteArray serialize(int sharedPayloadThreshold, int *payloadFd) const;
+    /**
+     * @brief Decodes a message
+     *
+     * A message which isn't a valid Wave gives a Wave with id 0, as Rebound::fromBinary gives a Rebound with id 0.
+     */
     static Wave fromBinary(const QByteArray &data);
+    /**
+     * @brief Decodes a message which was received along with @p fd
+     *
+     * If the payload was moved to shared memory, it gets mapped from @p fd instead of being copied: see payloadView().
+     * The fd is left to the caller, who can close it right away. As with fromBinary(const QByteArray &), a message
+     * which can't be decoded, or whose payload can't be mapped, gives a Wave with id 0.
+     */
+    static Wave fromBinary(const QByteArray &data, int fd);
 
 private:
     Wave(quint64 id);
@@ -1,6 +1,6 @@
 #include "Waveguide.h"
 
-#include "BSONDocument.h"
+#include "BSONDocument_p.h"
 #include "BSONSerializer.h"
 
 #include <QtCore/QDebug>
@@ -62,7 +62,9 @@ void Waveguide::setInterface(const QByteArray& i)
 
 QByteArray Waveguide::serialize() const
 {
-    Util::BSONSerializer s;
+    Util::BSONSerializer s(Util::BSONSerializer::emptyDocumentSize() +
+                           Util::BSONSerializer::int32ElementSize("y") +
+                           Util::BSONSerializer::stringElementSize("i", d->interface.size()));
     s.appendInt32Value("y", (int32_t) Protocol::MessageType::Waveguide);
     s.appendASCIIString("i", d->interface);
     s.appendEndOfDocument();
@@ -72,19 +74,40 @@ QByteArray Waveguide::serialize() const
 
 Waveguide Waveguide::fromBinary(const QByteArray &data)
 {
-    Util::BSONDocument doc(data);
-    if (Q_UNLIKELY(!doc.isValid())) {
+    Waveguide w;
+    int32_t messageType = (int32_t) Protocol::MessageType::Invalid;
+
+    bool valid = Util::bson_walk_elements(data.constData(), data.size(),
+                                          [&w, &messageType] (const char *key, uint32_t keyLen, uint8_t type, const char *value) {
+        if (keyLen != 1) {
+            return true;
+        }
+
+        switch (key[0]) {
+            case 'y':
+                if (type == TYPE_INT32) {
+                    messageType = Util::bson_value_to_int32(value);
+                }
+                break;
+            case 'i':
+                w.d->interface = Util::bson_value_to_byte_array(type, value);
+                break;
+            default:
+                break;
+        }
+
+        return true;
+    });
+
+    if (Q_UNLIKELY(!valid)) {
         qWarning() << "Waveguide BSON document is not valid!";
         return Waveguide();
     }
-    if (Q_UNLIKELY(doc.int32Value("y") != (int32_t) Protocol::MessageType::Waveguide)) {
+    if (Q_UNLIKELY(messageType != (int32_t) Protocol::MessageType::Waveguide)) {
         qWarning() << "Received message is not a Waveguide";
         return Waveguide();
     }
 
-    Waveguide w;
-    w.setInterface(doc.byteArrayValue("i"));
-
     return w;
 }
 
@@ -196,6 +196,18 @@ bool ConsumerAbstractAdaptor::payloadToValue(const QByteArray &payload, QDateTim
     return true;
 }
 
+bool ConsumerAbstractAdaptor::payloadToDateTimeMSecs(const QByteArray &payload, qint64 *msecsSinceEpoch)
+{
+    Util::BSONDocument doc(payload);
+    if (Q_UNLIKELY(!doc.isValid() || !doc.contains("v"))) {
+        *msecsSinceEpoch = 0;
+        return false;
+    }
+
+    *msecsSinceEpoch = doc.dateTimeMSecsValue("v");
+    return true;
+}
+
 }
 
 }
@@ -46,6 +46,8 @@ class ConsumerAbstractAdaptor : public AbstractWaveTarget
         bool payloadToValue(const QByteArray &payload, double *value);
         bool payloadToValue(const QByteArray &payload, QString *value);
         bool payloadToValue(const QByteArray &payload, QDateTime *value);
+        /// Like payloadToValue for a QDateTime, but returns the milliseconds since the epoch without building a QDateTime.
+        bool payloadToDateTimeMSecs(const QByteArray &payload, qint64 *msecsSinceEpoch);
 
     private:
         class Private;
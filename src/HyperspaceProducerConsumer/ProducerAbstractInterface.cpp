@@ -20,6 +20,11 @@ class ProducerAbstractInterface::Private
 
         QHash<StatePair, int> transitions;
         QHash<int, int> acceptingStates;
+
+        // Reused for every sample, so that its buffer is allocated only once. The sample gets copied into the
+        // Fluctuation's own message, so the document is released once it's sent: only fluctuations held until the
+        // Gate is ready keep it, and make the next reset() start over with a new buffer.
+        Util::BSONSerializer serializer;
 };
 
 ProducerAbstractInterface::ProducerAbstractInterface(const QByteArray &interface, QObject *parent)
@@ -127,58 +132,66 @@ void ProducerAbstractInterface::sendRawDataOnEndpoint(const QByteArray &value, c
 
 void ProducerAbstractInterface::sendDataOnEndpoint(const QByteArray &value, const QByteArray &target, const QHash<QByteArray, QByteArray> &attributes)
 {
-    Util::BSONSerializer serializer;
-    serializer.appendBinaryValue("v", value);
-    serializer.appendEndOfDocument();
-    sendRawDataOnEndpoint(serializer.document(), target, attributes);
+    d->serializer.reset();
+    d->serializer.appendBinaryValue("v", value);
+    d->serializer.appendEndOfDocument();
+    sendRawDataOnEndpoint(d->serializer.document(), target, attributes);
 }
 
 void ProducerAbstractInterface::sendDataOnEndpoint(double value, const QByteArray &target, const QHash<QByteArray, QByteArray> &attributes)
 {
-    Util::BSONSerializer serializer;
-    serializer.appendDoubleValue("v", value);
-    serializer.appendEndOfDocument();
-    sendRawDataOnEndpoint(serializer.document(), target, attributes);
+    d->serializer.reset();
+    d->serializer.appendDoubleValue("v", value);
+    d->serializer.appendEndOfDocument();
+    sendRawDataOnEndpoint(d->serializer.document(), target, attributes);
 }
 
 void ProducerAbstractInterface::sendDataOnEndpoint(int value, const QByteArray &target, const QHash<QByteArray, QByteArray> &attributes)
 {
-    Util::BSONSerializer serializer;
-    serializer.appendInt32Value("v", value);
-    serializer.appendEndOfDocument();
-    sendRawDataOnEndpoint(serializer.document(), target, attributes);
+    d->serializer.reset();
+    d->serializer.appendInt32Value("v", value);
+    d->serializer.appendEndOfDocument();
+    sendRawDataOnEndpoint(d->serializer.document(), target, attributes);
 }
 
 void ProducerAbstractInterface::sendDataOnEndpoint(qint64 value, const QByteArray &target, const QHash<QByteArray, QByteArray> &attributes)
 {
-    Util::BSONSerializer serializer;
-    serializer.appendInt64Value("v", value);
-    serializer.appendEndOfDocument();
-    sendRawDataOnEndpoint(serializer.document(), target, attributes);
+    d->serializer.reset();
+    d->serializer.appendInt64Value("v", value);
+    d->serializer.appendEndOfDocument();
+    sendRawDataOnEndpoint(d->serializer.document(), target, attributes);
 }
 
 void ProducerAbstractInterface::sendDataOnEndpoint(bool value, const QByteArray &target, const QHash<QByteArray, QByteArray> &attributes)
 {
-    Util::BSONSerializer serializer;
-    serializer.appendBooleanValue("v", value);
-    serializer.appendEndOfDocument();
-    sendRawDataOnEndpoint(serializer.document(), target, attributes);
+    d->serializer.reset();
+    d->serializer.appendBooleanValue("v", value);
+    d->serializer.appendEndOfDocument();
+    sendRawDataOnEndpoint(d->serializer.document(), target, attributes);
 }
 
 void ProducerAbstractInterface::sendDataOnEndpoint(const QString &value, const QByteArray &target, const QHash<QByteArray, QByteArray> &attributes)
 {
-    Util::BSONSerializer serializer;
-    serializer.appendString("v", value);
-    serializer.appendEndOfDocument();
-    sendRawDataOnEndpoint(serializer.document(), target, attributes);
+    d->serializer.reset();
+    d->serializer.appendString("v", value);
+    d->serializer.appendEndOfDocument();
+    sendRawDataOnEndpoint(d->serializer.document(), target, attributes);
 }
 
 void ProducerAbstractInterface::sendDataOnEndpoint(const QDateTime &value, const QByteArray &target, const QHash<QByteArray, QByteArray> &attributes)
 {
-    Util::BSONSerializer serializer;
-    serializer.appendDateTime("v", value);
-    serializer.appendEndOfDocument();
-    sendRawDataOnEndpoint(serializer.document(), target, attributes);
+    d->serializer.reset();
+    d->serializer.appendDateTime("v", value);
+    d->serializer.appendEndOfDocument();
+    sendRawDataOnEndpoint(d->serializer.document(), target, attributes);
+}
+
+void ProducerAbstractInterface::sendDateTimeOnEndpoint(qint64 msecsSinceEpoch, const QByteArray &target, const QHash<QByteArray, QByteArray> &attributes)
+{
+    d->serializer.reset();
+    d->serializer.appendDateTimeMSecs("v", msecsSinceEpoch);
+    d->serializer.appendEndOfDocument();
+    sendRawDataOnEndpoint(d->serializer.document(), target, attributes);
 }
 
 bool ProducerAbstractInterface::payloadToValue(const QByteArray &payload, QByteArray *value)
@@ -265,5 +278,17 @@ bool ProducerAbstractInterface::payloadToValue(const QByteArray &payload, QDateT
     return true;
 }
 
+bool ProducerAbstractInterface::payloadToDateTimeMSecs(const QByteArray &payload, qint64 *msecsSinceEpoch)
+{
+    Util::BSONDocument doc(payload);
+    if (Q_UNLIKELY(!doc.isValid() || !doc.contains("v"))) {
+        *msecsSinceEpoch = 0;
+        return false;
+    }
+
+    *msecsSinceEpoch = doc.dateTimeMSecsValue("v");
+    return true;
+}
+
 }
 }
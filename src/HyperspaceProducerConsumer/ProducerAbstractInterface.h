@@ -59,6 +59,8 @@ class ProducerAbstractInterface : public AbstractWaveTarget
         void sendDataOnEndpoint(bool value, const QByteArray &target, const QHash<QByteArray, QByteArray> &attributes = QHash<QByteArray, QByteArray>());
         void sendDataOnEndpoint(const QString &value, const QByteArray &target, const QHash<QByteArray, QByteArray> &attributes = QHash<QByteArray, QByteArray>());
         void sendDataOnEndpoint(const QDateTime &value, const QByteArray &target, const QHash<QByteArray, QByteArray> &attributes = QHash<QByteArray, QByteArray>());
+        /// Sends a datetime given as milliseconds since the epoch, without going through QDateTime.
+        void sendDateTimeOnEndpoint(qint64 msecsSinceEpoch, const QByteArray &target, const QHash<QByteArray, QByteArray> &attributes = QHash<QByteArray, QByteArray>());
 
         bool payloadToValue(const QByteArray &payload, QByteArray *value);
         bool payloadToValue(const QByteArray &payload, int *value);
@@ -67,6 +69,8 @@ class ProducerAbstractInterface : public AbstractWaveTarget
         bool payloadToValue(const QByteArray &payload, double *value);
         bool payloadToValue(const QByteArray &payload, QString *value);
         bool payloadToValue(const QByteArray &payload, QDateTime *value);
+        /// Like payloadToValue for a QDateTime, but returns the milliseconds since the epoch without building a QDateTime.
+        bool payloadToDateTimeMSecs(const QByteArray &payload, qint64 *msecsSinceEpoch);
 
     private:
         class Private;
@@ -0,0 +1,336 @@
+#include <HemeraTest/Test>
+
+#include <QtCore/QLoggingCategory>
+#include <QtCore/QObject>
+
+#include <HyperspaceCore/AbstractWaveTarget>
+#include <HyperspaceCore/Gate>
+#include <HyperspaceCore/Rebound>
+#include <HyperspaceCore/Socket>
+#include <HyperspaceCore/Wave>
+#include <HyperspaceProducerConsumer/ProducerAbstractInterface>
+
+#include "lib/allocationcounter.h"
+#include "lib/fakehyperdrive.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using namespace Hyperspace;
+
+// Allocation budgets of the hot paths. These are upper bounds: lower them whenever a path gets cheaper,
+// never raise them without a good reason.
+
+// The serializer's buffer, sized upfront.
+static const int s_reboundSerializeAllocations = 1;
+// The WaveData, method, interface, target and payload.
+static const int s_waveDispatchAllocations = 5;
+// The attributes hash's data and buckets, then a node, a key and a value per attribute.
+static const int s_waveDispatchHashAllocations = 2;
+static const int s_waveDispatchAllocationsPerAttribute = 3;
+static const int s_burstSize = 16;
+
+// Writes are queued in chunks of several messages: at most one new chunk per burst.
+static const int s_socketWriteBurstAllocations = 1;
+// The Fluctuation, its detached copy in the Gate and the serialized Fluctuation, then the write queue.
+static const int s_sendDataOnEndpointAllocations = 3;
+// The producer's serializer keeps its buffer: the sample is copied into the Fluctuation, so nothing holds on to it.
+static const int s_producerSerializerAllocations = 0;
+
+class DispatchingGate : public Gate
+{
+public:
+    DispatchingGate(QObject *parent = nullptr) : Gate(parent) {}
+
+    // What the Gate does with every document it reads from Hyperdrive
+    void dispatch(const QByteArray &data) { waveFunction(Wave::fromBinary(data)); }
+};
+
+class CountingTarget : public AbstractWaveTarget
+{
+public:
+    CountingTarget(const QByteArray &interface, Gate *gate, QObject *parent = nullptr)
+        : AbstractWaveTarget(interface, gate, parent), waves(0) {}
+
+    int waves;
+
+protected:
+    virtual void waveFunction(const Wave &) override final { ++waves; }
+};
+
+class SendingProducer : public ProducerConsumer::ProducerAbstractInterface
+{
+public:
+    SendingProducer(QObject *parent) : ProducerAbstractInterface("com.ispirata.Hemera.Allocations.Producer", parent) {}
+
+    void send(int value) { sendDataOnEndpoint(value, "/value"); }
+    void send(const QByteArray &value) { sendDataOnEndpoint(value, "/value"); }
+
+protected:
+    virtual void populateTokensAndStates() override final {}
+    virtual DispatchResult dispatch(int, const QByteArray &, const QList<QByteArray> &) override final { return Success; }
+};
+
+class Allocations : public Hemera::Test::Test
+{
+    Q_OBJECT
+
+public:
+    Allocations(QObject *parent = 0)
+        : Test(parent)
+        , m_hyperdrive(nullptr)
+    { }
+
+private Q_SLOTS:
+    void initTestCase();
+    void init();
+
+    void testReboundSerialize_data();
+    void testReboundSerialize();
+    void testGateWaveDispatch_data();
+    void testGateWaveDispatch();
+    void testSocketWrite();
+    void testSendDataOnEndpoint();
+    void testProducerSerializerReuse();
+
+    void cleanup();
+    void cleanupTestCase();
+
+private:
+    void populateMessageSizes();
+    void startHyperdrive();
+
+    FakeHyperdrive *m_hyperdrive;
+};
+
+void Allocations::initTestCase()
+{
+    initTestCaseImpl();
+
+    // Debug output allocates: keep it out of the counts
+    QLoggingCategory::setFilterRules(QStringLiteral("hyperspace.*.debug=false"));
+
+    if (!AllocationCounter::isAvailable()) {
+        QSKIP("Allocations can't be counted on this platform");
+    }
+}
+
+void Allocations::init()
+{
+    initImpl();
+}
+
+void Allocations::populateMessageSizes()
+{
+    QTest::addColumn<QByteArray>("payload");
+    QTest::addColumn<ByteArrayHash>("attributes");
+
+    ByteArrayHash attributes;
+    attributes.insert("Content-Type", "application/bson");
+    attributes.insert("timestamp", "1476700000000");
+
+    QTest::newRow("16 B payload, no attributes") << QByteArray(16, 'x') << ByteArrayHash();
+    QTest::newRow("16 B payload, 2 attributes") << QByteArray(16, 'x') << attributes;
+    QTest::newRow("64 KiB payload, 2 attributes") << QByteArray(64 * 1024, 'x') << attributes;
+}
+
+void Allocations::startHyperdrive()
+{
+    if (!m_hyperdrive) {
+        // Gates connect to the fake Hyperdrive when running autotests
+        qputenv("RUNNING_AUTOTESTS", "1");
+        m_hyperdrive = new FakeHyperdrive(this);
+        m_hyperdrive->init();
+    }
+}
+
+void Allocations::testReboundSerialize_data()
+{
+    populateMessageSizes();
+}
+
+void Allocations::testReboundSerialize()
+{
+    QFETCH(QByteArray, payload);
+    QFETCH(ByteArrayHash, attributes);
+
+    Rebound rebound(42, ResponseCode::OK);
+    rebound.setAttributes(attributes);
+    rebound.setPayload(payload);
+
+    QByteArray data;
+    HYPERSPACE_ASSERT_MAX_ALLOCS(s_reboundSerializeAllocations) {
+        data = rebound.serialize();
+    }
+
+    QCOMPARE(Rebound::fromBinary(data).payload(), payload);
+}
+
+void Allocations::testGateWaveDispatch_data()
+{
+    populateMessageSizes();
+}
+
+void Allocations::testGateWaveDispatch()
+{
+    QFETCH(QByteArray, payload);
+    QFETCH(ByteArrayHash, attributes);
+
+#ifndef ENABLE_TEST_CODEPATHS
+    QSKIP("A Gate can only be brought up with test codepaths enabled");
+#endif
+    startHyperdrive();
+    QTRY_VERIFY_WITH_TIMEOUT(m_hyperdrive->isReady(), 5000);
+
+    DispatchingGate gate;
+    gate.init();
+    QTRY_VERIFY_WITH_TIMEOUT(gate.isReady(), 5000);
+
+    CountingTarget target("com.ispirata.Hemera.Allocations", &gate);
+    QVERIFY(target.isReady());
+
+    Wave wave;
+    wave.setId(42);
+    wave.setMethod("PUT");
+    wave.setInterface("com.ispirata.Hemera.Allocations");
+    wave.setTarget("/value");
+    wave.setAttributes(attributes);
+    wave.setPayload(payload);
+    const QByteArray data = wave.serialize();
+
+    const int attributesAllocations = attributes.isEmpty() ? 0 :
+                                      s_waveDispatchHashAllocations + attributes.count() * s_waveDispatchAllocationsPerAttribute;
+    HYPERSPACE_ASSERT_MAX_ALLOCS(s_waveDispatchAllocations + attributesAllocations) {
+        gate.dispatch(data);
+    }
+
+    QCOMPARE(target.waves, 1);
+}
+
+void Allocations::testSocketWrite()
+{
+    int fds[2];
+    QCOMPARE(::socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+    ::fcntl(fds[1], F_SETFL, ::fcntl(fds[1], F_GETFL) | O_NONBLOCK);
+
+    Socket socket(fds[0]);
+    socket.init();
+    QTRY_VERIFY_WITH_TIMEOUT(socket.isReady(), 5000);
+
+    const QByteArray message(64, 'x');
+    qint64 pending = 0;
+    auto drain = [&fds, &pending] {
+        char buffer[4096];
+        ssize_t count;
+        while ((count = ::read(fds[1], buffer, sizeof(buffer))) > 0) {
+            pending -= count;
+        }
+        return pending == 0;
+    };
+
+    // The first write of a burst arms the write notifier, which goes through the event dispatcher:
+    // leave it out, and let a first burst grow the queue to its working size.
+    for (int round = 0; round < 2; ++round) {
+        socket.write(message);
+        pending += message.size();
+
+        if (round == 0) {
+            for (int i = 0; i < s_burstSize; ++i) {
+                socket.write(message);
+            }
+        } else {
+            HYPERSPACE_ASSERT_MAX_ALLOCS(s_socketWriteBurstAllocations) {
+                for (int i = 0; i < s_burstSize; ++i) {
+                    socket.write(message);
+                }
+            }
+        }
+        pending += s_burstSize * message.size();
+
+        QTRY_VERIFY_WITH_TIMEOUT(drain(), 5000);
+    }
+
+    ::close(fds[1]);
+}
+
+void Allocations::testSendDataOnEndpoint()
+{
+#ifndef ENABLE_TEST_CODEPATHS
+    QSKIP("A Gate can only be brought up with test codepaths enabled");
+#endif
+    startHyperdrive();
+    QTRY_VERIFY_WITH_TIMEOUT(m_hyperdrive->isReady(), 5000);
+
+    // Goes through the default Gate
+    SendingProducer producer(this);
+    QTRY_VERIFY_WITH_TIMEOUT(producer.isReady(), 5000);
+
+    // Same as Socket::write: the first send of a burst arms the Gate's write notifier
+    for (int round = 0; round < 2; ++round) {
+        producer.send(round);
+
+        if (round == 0) {
+            for (int i = 0; i < s_burstSize; ++i) {
+                producer.send(i);
+            }
+        } else {
+            HYPERSPACE_ASSERT_MAX_ALLOCS(s_burstSize * s_sendDataOnEndpointAllocations + s_socketWriteBurstAllocations) {
+                for (int i = 0; i < s_burstSize; ++i) {
+                    producer.send(i);
+                }
+            }
+        }
+
+        // Let the Gate flush its queue
+        QTest::qWait(100);
+    }
+}
+
+void Allocations::testProducerSerializerReuse()
+{
+#ifndef ENABLE_TEST_CODEPATHS
+    QSKIP("A Gate can only be brought up with test codepaths enabled");
+#endif
+    startHyperdrive();
+    QTRY_VERIFY_WITH_TIMEOUT(m_hyperdrive->isReady(), 5000);
+
+    SendingProducer producer(this);
+    QTRY_VERIFY_WITH_TIMEOUT(producer.isReady(), 5000);
+
+    // Big enough that a serializer starting over would show up, small enough to stay inline
+    const QByteArray sample(4096, 's');
+    for (int round = 0; round < 2; ++round) {
+        producer.send(sample);
+
+        if (round == 0) {
+            // Grows the serializer to the sample's size
+            for (int i = 0; i < s_burstSize; ++i) {
+                producer.send(sample);
+            }
+        } else {
+            HYPERSPACE_ASSERT_MAX_ALLOCS(s_burstSize * (s_sendDataOnEndpointAllocations + s_producerSerializerAllocations) +
+                                         s_socketWriteBurstAllocations) {
+                for (int i = 0; i < s_burstSize; ++i) {
+                    producer.send(sample);
+                }
+            }
+        }
+
+        QTest::qWait(100);
+    }
+}
+
+void Allocations::cleanup()
+{
+    cleanupImpl();
+}
+
+void Allocations::cleanupTestCase()
+{
+    cleanupTestCaseImpl();
+}
+
+QTEST_MAIN(Allocations)
+#include "allocations.cpp.moc.hpp"
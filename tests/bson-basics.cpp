@@ -10,11 +10,85 @@
 #include <HyperspaceCore/BSONDocument>
 #include <HyperspaceCore/BSONSerializer>
 #include <HyperspaceCore/BSONStreamReader>
+#include <HyperspaceCore/Rebound>
+#include <HyperspaceCore/Wave>
 
 #include <hyperspaceconfig.h>
 
+#include "BSONEndian_p.h"
+
 using namespace Hyperspace;
 
+// Records every value it is handed as a short tagged string
+struct RecordingVisitor {
+    QByteArray *record;
+
+    void operator()(double value) { *record += "d" + QByteArray::number(value); }
+    void operator()(int32_t value) { *record += "i" + QByteArray::number(value); }
+    void operator()(int64_t value) { *record += "l" + QByteArray::number((qlonglong) value); }
+    void operator()(bool value) { *record += value ? "T" : "F"; }
+    void operator()(Util::BSONStringView value) { *record += "s" + QByteArray(value.data, value.size); }
+    void operator()(Util::BSONBinaryView value) { *record += "b" + QByteArray(value.data, value.size); }
+    void operator()(Util::BSONDateTime value) { *record += "t" + QByteArray::number((qlonglong) value.msecsSinceEpoch); }
+    void operator()(const Util::BSONElement &value) { *record += "o" + QByteArray::number(value.toDocument().int32Value("x")); }
+
+    template <typename T>
+    void operator()(const char *key, const T &value) { *record += key; (*this)(value); }
+};
+
+// Raw loads and stores in big-endian order, to run the byte swapping path of the codec on any host
+struct EmulatedBigEndianHost {
+    static const bool bigEndian = true;
+
+    static uint32_t load32(const void *src) { return load(src, 4); }
+    static uint64_t load64(const void *src) { return load(src, 8); }
+    static void store32(void *dst, uint32_t v) { store(dst, v, 4); }
+    static void store64(void *dst, uint64_t v) { store(dst, v, 8); }
+
+    static uint64_t load(const void *src, int size) {
+        uint64_t v = 0;
+        for (int i = 0; i < size; ++i) {
+            v = (v << 8) | ((const uint8_t *) src)[i];
+        }
+        return v;
+    }
+    static void store(void *dst, uint64_t v, int size) {
+        for (int i = size - 1; i >= 0; --i, v >>= 8) {
+            ((uint8_t *) dst)[i] = v & 0xff;
+        }
+    }
+};
+
+// Appends a raw element to a serialized document, fixing up its length
+static QByteArray appendElement(const QByteArray &document, const QByteArray &element)
+{
+    QByteArray result = document;
+    result.insert(result.size() - 1, element);
+    Util::bson_store_le32(result.data(), result.size());
+    return result;
+}
+
+template <typename Host>
+static void verifyLittleEndianCodec()
+{
+    const QByteArray le32("\x04\x03\x02\x01", 4);
+    const QByteArray le64("\x08\x07\x06\x05\x04\x03\x02\x01", 8);
+    // 1.5 is 0x3FF8000000000000
+    const QByteArray leDouble("\0\0\0\0\0\0\xf8\x3f", 8);
+
+    QCOMPARE(Util::bson_load_le32<Host>(le32.constData()), (uint32_t) 0x01020304);
+    QCOMPARE(Util::bson_load_le64<Host>(le64.constData()), (uint64_t) 0x0102030405060708);
+    QCOMPARE(Util::bson_load_le_double<Host>(leDouble.constData()), 1.5);
+
+    char buffer[8];
+    Util::bson_store_le32<Host>(buffer, 0x01020304);
+    QCOMPARE(QByteArray(buffer, 4), le32);
+    Util::bson_store_le64<Host>(buffer, 0x0102030405060708);
+    QCOMPARE(QByteArray(buffer, 8), le64);
+    Util::bson_store_le_double<Host>(buffer, 1.5);
+    QCOMPARE(QByteArray(buffer, 8), leDouble);
+}
+
 class BSONBasics : public Hemera::Test::Test
 {
     Q_OBJECT
@@ -29,6 +103,19 @@ private Q_SLOTS:
     void init();
 
     void testBSONDocument();
+    void testBSONDocumentIndex();
+    void testBSONIterator();
+    void testBSONViews();
+    void testNestedDocuments();
+    void testValidation();
+    void testMessageDecoding();
+    void testArrays();
+    void testVisitor();
+    void testDateTimes();
+    void testStrings();
+    void testEndianness();
+    void testStreamReader();
+    void testStreamReaderLimits();
     void testParseBSONFromPython();
     void testSerializeBSONToPython();
 
@@ -63,6 +150,456 @@ void BSONBasics::testBSONDocument()
     QCOMPARE(doc.byteArrayValue("p"), QByteArray("binary things"));
 }
 
+void BSONBasics::testBSONDocumentIndex()
+{
+    Util::BSONSerializer s;
+    s.appendInt32Value("y", 42);
+    s.appendInt64Value("yy", 43);
+    s.appendASCIIString("i", "the things");
+    s.appendBinaryValue("p", "binary things");
+    s.appendEndOfDocument();
+
+    Util::BSONDocument doc = s.document();
+    doc.index();
+    QCOMPARE(doc.int32Value("y"), (qint32)42);
+    QCOMPARE(doc.int64Value("yy"), (qint64)43);
+    QCOMPARE(doc.byteArrayValue("p"), QByteArray("binary things"));
+    QVERIFY(doc.contains("i"));
+    QVERIFY(!doc.contains("iii"));
+    QVERIFY(!doc.contains(""));
+
+    // A truncated document must only expose the fields which fit in it
+    QByteArray truncated = s.document();
+    truncated.chop(10);
+    Util::BSONDocument truncatedDoc(truncated);
+    QCOMPARE(truncatedDoc.int32Value("y"), (qint32)42);
+    QVERIFY(!truncatedDoc.contains("p"));
+}
+
+void BSONBasics::testBSONIterator()
+{
+    Util::BSONSerializer s;
+    s.appendInt32Value("y", 42);
+    s.appendASCIIString("i", "the things");
+    {
+        Util::BSONSerializer::DocumentGuard a(s, "a");
+        s.appendASCIIString("k", "v");
+    }
+    s.appendBinaryValue("p", "binary things");
+    s.appendEndOfDocument();
+
+    Util::BSONDocument doc = s.document();
+    Util::BSONDocument::const_iterator it = doc.begin();
+    QVERIFY(it != doc.end());
+    QVERIFY(it->key() == QByteArray("y"));
+    QCOMPARE(it->type(), Util::BSONType::Int32);
+    QCOMPARE(it->toInt32(), (qint32)42);
+    ++it;
+    QCOMPARE(it->type(), Util::BSONType::String);
+    QVERIFY(it->byteArrayView() == QByteArray("the things"));
+    ++it;
+    QCOMPARE(it->type(), Util::BSONType::Document);
+    QCOMPARE(it->toDocument().byteArrayValue("k"), QByteArray("v"));
+    ++it;
+    QCOMPARE(it->type(), Util::BSONType::Binary);
+    QCOMPARE(it->toByteArray(), QByteArray("binary things"));
+    ++it;
+    QVERIFY(it == doc.end());
+
+    int count = 0;
+    for (const Util::BSONElement &element : doc) {
+        QVERIFY(!element.isNull());
+        ++count;
+    }
+    QCOMPARE(count, 4);
+
+    QHash<QByteArray, QByteArray> values = doc.byteArrayValuesHash();
+    QCOMPARE(values.size(), 4);
+    QCOMPARE(values.value("i"), QByteArray("the things"));
+    QVERIFY(values.value("y").isEmpty());
+
+    // Iteration stops before the first element which does not fit
+    QByteArray truncated = s.document();
+    truncated.chop(10);
+    Util::BSONDocument truncatedDoc(truncated);
+    QCOMPARE(std::distance(truncatedDoc.begin(), truncatedDoc.end()), (std::ptrdiff_t)3);
+    QVERIFY(Util::BSONDocument(QByteArray()).begin() == Util::BSONDocument(QByteArray()).end());
+}
+
+void BSONBasics::testBSONViews()
+{
+    Util::BSONSerializer sa;
+    sa.appendASCIIString("k", "v");
+    sa.appendEndOfDocument();
+
+    Util::BSONSerializer s;
+    s.appendDocument("a", sa.document());
+    s.appendBinaryValue("p", "binary things");
+    s.appendEndOfDocument();
+
+    Util::BSONDocument doc = s.document();
+    Util::BSONDocument attributes = doc.subdocument("a");
+    QVERIFY(attributes.isValid());
+    QCOMPARE(attributes.byteArrayValue("k"), QByteArray("v"));
+    QCOMPARE(attributes.toByteArray(), sa.document());
+
+    Util::BSONView payload = doc.byteArrayView("p");
+    QVERIFY(!payload.isNull());
+    QVERIFY(payload == QByteArray("binary things"));
+    QCOMPARE(payload.toByteArray(), QByteArray("binary things"));
+    QCOMPARE(payload.toRawByteArray(), QByteArray("binary things"));
+    QVERIFY(doc.byteArrayView("missing").isNull());
+}
+
+void BSONBasics::testNestedDocuments()
+{
+    // Build the same document with intermediate serializers and with the nested builder
+    Util::BSONSerializer inner;
+    inner.appendInt32Value("x", 1);
+    inner.appendEndOfDocument();
+    Util::BSONSerializer middle;
+    middle.appendASCIIString("k", "v");
+    middle.appendDocument("b", inner.document());
+    middle.appendEndOfDocument();
+    Util::BSONSerializer expected;
+    expected.appendInt32Value("y", 42);
+    expected.appendDocument("a", middle.document());
+    expected.appendBinaryValue("p", "binary things");
+    expected.appendEndOfDocument();
+
+    Util::BSONSerializer s;
+    s.appendInt32Value("y", 42);
+    {
+        Util::BSONSerializer::DocumentGuard a(s, "a");
+        s.appendASCIIString("k", "v");
+        s.beginDocument("b");
+        s.appendInt32Value("x", 1);
+        s.endDocument();
+    }
+    s.appendBinaryValue("p", "binary things");
+    s.appendEndOfDocument();
+
+    QCOMPARE(s.document(), expected.document());
+
+    Util::BSONDocument doc = s.document();
+    QVERIFY(doc.isValid());
+    QCOMPARE(doc.subdocument("a").subdocument("b").int32Value("x"), (qint32)1);
+
+    // A reset serializer starts from scratch
+    s.reset();
+    s.appendInt32Value("x", 1);
+    s.appendEndOfDocument();
+    QCOMPARE(s.document(), inner.document());
+}
+
+void BSONBasics::testValidation()
+{
+    Util::BSONSerializer s;
+    s.appendInt32Value("y", 42);
+    {
+        Util::BSONSerializer::DocumentGuard a(s, "a");
+        s.appendASCIIString("k", "v");
+        Util::BSONSerializer::DocumentGuard b(s, "b");
+        s.appendInt32Value("x", 1);
+    }
+    s.appendEndOfDocument();
+
+    const QByteArray valid = s.document();
+    Util::BSONDocument doc(valid);
+    QVERIFY(doc.isValid());
+    QVERIFY(doc.isValid());
+    QVERIFY(doc.subdocument("a").subdocument("b").isValid());
+    QVERIFY(!Util::BSONDocument(QByteArray()).isValid());
+
+    // Unterminated string within an embedded document
+    QByteArray corrupted = valid;
+    corrupted[corrupted.indexOf('v') + 1] = 'w';
+    QVERIFY(!Util::BSONDocument(corrupted).isValid());
+
+    // String with a zero length
+    corrupted = valid;
+    corrupted[corrupted.indexOf('v') - 4] = 0;
+    QVERIFY(!Util::BSONDocument(corrupted).isValid());
+
+    // Unterminated innermost document: "a" is the last element, so "b" ends three bytes before the end
+    corrupted = valid;
+    corrupted[corrupted.size() - 3] = 1;
+    QVERIFY(!Util::BSONDocument(corrupted).isValid());
+    QVERIFY(!Util::BSONDocument(corrupted).subdocument("a").isValid());
+
+    // Too deeply nested
+    Util::BSONSerializer deep;
+    for (int i = 0; i < 200; ++i) {
+        deep.beginDocument("d");
+    }
+    for (int i = 0; i < 200; ++i) {
+        deep.endDocument();
+    }
+    deep.appendEndOfDocument();
+    QVERIFY(!Util::BSONDocument(deep.document()).isValid());
+}
+
+void BSONBasics::testMessageDecoding()
+{
+    Wave wave;
+    wave.setId(42);
+    wave.setMethod("PUT");
+    wave.setInterface("io.hemera.Interface");
+    wave.setTarget("/target");
+    wave.setPayload("payload");
+
+    const QByteArray valid = wave.serialize();
+    Wave decoded = Wave::fromBinary(valid);
+    QCOMPARE(decoded.id(), wave.id());
+    QCOMPARE(decoded.method(), wave.method());
+    QCOMPARE(decoded.payload(), wave.payload());
+
+    // A string with a zero length has no room for its terminator: the whole Wave is rejected
+    QByteArray corrupted = valid;
+    corrupted[corrupted.indexOf("PUT") - 4] = 0;
+    decoded = Wave::fromBinary(corrupted);
+    QVERIFY(decoded.id() != wave.id());
+    QVERIFY(decoded.method().isEmpty());
+    // ...and can be told apart from a decoded one by its id
+    QCOMPARE(decoded.id(), Q_UINT64_C(0));
+    QCOMPARE(Wave::fromBinary(Rebound(wave, ResponseCode::OK).serialize()).id(), Q_UINT64_C(0));
+
+    // Standard types which Hyperspace does not use are skipped, whatever their size
+    QByteArray extended = appendElement(valid, QByteArray("\x0A" "n\0", 3));
+    extended = appendElement(extended, QByteArray("\x07" "o\0" "0123456789ab", 15));
+    extended = appendElement(extended, QByteArray("\x0B" "r\0" "^a+$\0" "i\0", 10));
+    extended = appendElement(extended, QByteArray("\x13" "x\0" "0123456789abcdef", 19));
+    QVERIFY(Util::BSONDocument(extended).isValid());
+    decoded = Wave::fromBinary(extended);
+    QCOMPARE(decoded.id(), wave.id());
+    QCOMPARE(decoded.method(), wave.method());
+    QCOMPARE(decoded.payload(), wave.payload());
+
+    // Types outside of the specification can't be skipped
+    corrupted = appendElement(valid, QByteArray("\x20" "z\0", 3));
+    QVERIFY(!Util::BSONDocument(corrupted).isValid());
+    QVERIFY(Wave::fromBinary(corrupted).method().isEmpty());
+
+    Rebound rebound(wave, ResponseCode::OK);
+    rebound.addAttribute("attribute", "value");
+    rebound.setPayload("response");
+
+    const QByteArray validRebound = rebound.serialize();
+    QCOMPARE(Rebound::fromBinary(validRebound).id(), rebound.id());
+    QCOMPARE(Rebound::fromBinary(validRebound).payload(), rebound.payload());
+
+    corrupted = validRebound;
+    corrupted[corrupted.indexOf("value") - 4] = 0;
+    QCOMPARE(Rebound::fromBinary(corrupted).id(), (quint64) 0);
+}
+
+void BSONBasics::testArrays()
+{
+    QVector<double> doubles;
+    QVector<int64_t> integers;
+    for (int i = 0; i < 123; ++i) {
+        doubles.append(i * 0.5);
+        integers.append(int64_t(i) << 33);
+    }
+
+    const int size = Util::BSONSerializer::emptyDocumentSize() + Util::BSONSerializer::doubleArrayElementSize("d", doubles.count())
+                   + Util::BSONSerializer::int64ArrayElementSize("l", integers.count());
+    Util::BSONSerializer s;
+    s.appendDoubleArray("d", doubles);
+    s.appendInt64Array("l", integers);
+    s.beginArray("m");
+    s.appendInt32Value("0", 1);
+    s.appendInt64Value("1", 2);
+    s.endArray();
+    s.appendDoubleArray("e", QVector<double>());
+    s.appendEndOfDocument();
+    QCOMPARE(s.document().size(), size + Util::BSONSerializer::doubleArrayElementSize("e", 0)
+                                        + Util::BSONSerializer::elementSize("m", 5 + Util::BSONSerializer::int32ElementSize("0")
+                                                                                + Util::BSONSerializer::int64ElementSize("1")));
+
+    Util::BSONDocument doc = s.document();
+    QVERIFY(doc.isValid());
+    QCOMPARE(doc.doubleArrayValue("d"), doubles);
+    QCOMPARE(doc.int64ArrayValue("l"), integers);
+    QCOMPARE(doc.int64ArrayValue("m"), QVector<int64_t>() << 1 << 2);
+    QCOMPARE(doc.doubleArrayValue("m"), QVector<double>() << 1.0 << 2.0);
+    QVERIFY(doc.doubleArrayValue("e").isEmpty());
+    // Doubles are not integers, and plain values are not arrays
+    QVERIFY(doc.int64ArrayValue("d").isEmpty());
+    QVERIFY(Util::BSONDocument(s.document()).doubleArrayValue("missing").isEmpty());
+
+    // Keys are the indexes of the elements
+    int index = 0;
+    for (const Util::BSONElement &element : doc.begin()->toDocument()) {
+        QCOMPARE(element.key().toByteArray(), QByteArray::number(index++));
+    }
+    QCOMPARE(index, doubles.count());
+}
+
+void BSONBasics::testVisitor()
+{
+    Util::BSONSerializer s;
+    s.appendDoubleValue("d", 1.5);
+    s.appendInt32Value("i", 3);
+    s.appendInt64Value("l", 4);
+    s.appendBooleanValue("b", true);
+    s.appendASCIIString("s", "str");
+    s.appendBinaryValue("p", "bin");
+    s.appendDateTime("t", QDateTime::fromMSecsSinceEpoch(1234));
+    {
+        Util::BSONSerializer::DocumentGuard o(s, "o");
+        s.appendInt32Value("x", 7);
+    }
+    s.appendEndOfDocument();
+
+    Util::BSONDocument doc = s.document();
+    QByteArray record;
+    RecordingVisitor visitor = { &record };
+
+    QVERIFY(doc.visit("s", visitor));
+    QCOMPARE(record, QByteArray("sstr"));
+    QVERIFY(!doc.visit("missing", visitor));
+
+    record.clear();
+    doc.forEachTyped(visitor);
+    QCOMPARE(record, QByteArray("dd1.5ii3ll4bTssstrpbbintt1234oo7"));
+
+    QCOMPARE(doc.element("t").toMSecsSinceEpoch(), (int64_t)1234);
+    QVERIFY(doc.element("missing").isNull());
+}
+
+void BSONBasics::testDateTimes()
+{
+    const QDateTime now = QDateTime::currentDateTime();
+
+    Util::BSONSerializer s;
+    s.appendDateTime("t", now);
+    s.appendDateTimeMSecs("m", now.toMSecsSinceEpoch());
+    {
+        Util::BSONSerializer::DocumentGuard o(s, "o");
+        s.appendDateTimeMSecs("t", 1234);
+    }
+    s.appendEndOfDocument();
+
+    Util::BSONDocument doc = s.document();
+    QCOMPARE(doc.dateTimeMSecsValue("t"), (int64_t)now.toMSecsSinceEpoch());
+    QCOMPARE(doc.dateTimeMSecsValue("m"), (int64_t)now.toMSecsSinceEpoch());
+    QCOMPARE(doc.dateTimeMSecsValue("missing", -1), (int64_t)-1);
+    QCOMPARE(doc.dateTimeSpec(), Qt::LocalTime);
+    QCOMPARE(doc.dateTimeValue("t"), now);
+    QCOMPARE(doc.dateTimeValue("t").timeSpec(), Qt::LocalTime);
+
+    doc.setDateTimeSpec(Qt::UTC);
+    QCOMPARE(doc.dateTimeValue("m"), now);
+    QCOMPARE(doc.dateTimeValue("m").timeSpec(), Qt::UTC);
+    QCOMPARE(doc.subdocument("o").dateTimeValue("t"), QDateTime::fromMSecsSinceEpoch(1234, Qt::UTC));
+    QCOMPARE(doc.subdocument("o").dateTimeValue("t").timeSpec(), Qt::UTC);
+}
+
+void BSONBasics::testStrings()
+{
+    const QString unicode = QString::fromUtf8("h\xc3\xa9llo w\xc3\xb6rld, a string long enough to span several words");
+
+    Util::BSONSerializer s;
+    s.appendASCIIString("a", "io.hemera.Interface");
+    s.appendString("u", unicode);
+    s.appendASCIIString("n", QByteArray("nul\0inside", 10));
+    s.appendBinaryValue("p", "binary");
+    s.appendEndOfDocument();
+
+    Util::BSONDocument doc = s.document();
+    QCOMPARE(doc.stringValue("a"), QStringLiteral("io.hemera.Interface"));
+    QCOMPARE(doc.stringValue("u"), unicode);
+    QCOMPARE(doc.stringValue("p"), QStringLiteral("binary"));
+    QCOMPARE(doc.stringValue("missing", QStringLiteral("default")), QStringLiteral("default"));
+
+    QVERIFY(doc.latin1StringView("a") == QLatin1String("io.hemera.Interface"));
+    QVERIFY(doc.latin1StringView("p").isNull());
+    QVERIFY(doc.latin1StringView("missing").isNull());
+    QVERIFY(doc.element("a").toLatin1String() == QLatin1String("io.hemera.Interface"));
+    QCOMPARE(doc.element("u").toString(), unicode);
+
+    // The length prefix is authoritative, embedded NULs included
+    QCOMPARE(doc.byteArrayValue("n"), QByteArray("nul\0inside", 10));
+}
+
+void BSONBasics::testEndianness()
+{
+    verifyLittleEndianCodec<Util::BSONNativeHost>();
+    verifyLittleEndianCodec<EmulatedBigEndianHost>();
+}
+
+void BSONBasics::testStreamReader()
+{
+    QByteArrayList documents;
+    QByteArray stream;
+    for (int i = 0; i < 20; ++i) {
+        Util::BSONSerializer s;
+        s.appendInt32Value("y", i);
+        s.appendBinaryValue("p", QByteArray(i * 37, 'x'));
+        s.appendEndOfDocument();
+        documents.append(s.document());
+        stream.append(s.document());
+    }
+
+    // Feed the stream in chunks of every size, so that documents and length prefixes get split everywhere
+    for (int chunkSize = 1; chunkSize <= stream.size(); chunkSize += 7) {
+        Util::BSONStreamReader reader;
+        int dequeued = 0;
+        for (int offset = 0; offset < stream.size(); offset += chunkSize) {
+            reader.enqueueData(stream.mid(offset, chunkSize));
+            while (reader.canReadDocument()) {
+                QCOMPARE(reader.dequeueDocumentView().toByteArray(), documents.at(dequeued));
+                ++dequeued;
+            }
+        }
+
+        QCOMPARE(dequeued, documents.count());
+        QCOMPARE(reader.bytesBuffered(), 0);
+    }
+}
+
+void BSONBasics::testStreamReaderLimits()
+{
+    Util::BSONSerializer big;
+    big.appendBinaryValue("p", QByteArray(1000, 'x'));
+    big.appendEndOfDocument();
+    Util::BSONSerializer small;
+    small.appendInt32Value("y", 42);
+    small.appendEndOfDocument();
+
+    // Oversized documents get skipped, and the stream goes on
+    QByteArray stream = small.document() + big.document() + small.document();
+    Util::BSONStreamReader reader;
+    reader.setMaximumDocumentSize(100);
+    for (int offset = 0; offset < stream.size(); offset += 64) {
+        reader.enqueueData(stream.mid(offset, 64));
+    }
+    QVERIFY(reader.canReadDocument());
+    QCOMPARE(reader.dequeueDocumentData(), small.document());
+    QVERIFY(reader.canReadDocument());
+    QCOMPARE(reader.dequeueDocumentData(), small.document());
+    QVERIFY(!reader.canReadDocument());
+    QCOMPARE(reader.rejectedDocuments(), 1);
+    QCOMPARE(reader.lastError(), Util::BSONStreamReader::Error::DocumentTooLarge);
+    QVERIFY(!reader.isDesynchronized());
+    QCOMPARE(reader.bytesBuffered(), 0);
+
+    // A negative size cannot be framed: everything gets discarded until the reader is reset
+    Util::BSONStreamReader corrupted;
+    corrupted.enqueueData(QByteArray("\xff\xff\xff\xff", 4) + small.document());
+    QVERIFY(!corrupted.canReadDocument());
+    QVERIFY(corrupted.isDesynchronized());
+    QCOMPARE(corrupted.lastError(), Util::BSONStreamReader::Error::InvalidDocumentSize);
+    QCOMPARE(corrupted.bytesBuffered(), 0);
+    corrupted.enqueueData(small.document());
+    QVERIFY(!corrupted.canReadDocument());
+
+    corrupted.reset();
+    corrupted.enqueueData(small.document());
+    QVERIFY(corrupted.canReadDocument());
+}
+
 void BSONBasics::testParseBSONFromPython()
 {
     // This bytearray is kindly provided by python.
@@ -0,0 +1,276 @@
+#include <HemeraTest/Test>
+
+#include <QtCore/QObject>
+
+#include <HyperspaceCore/BSONDocument>
+#include <HyperspaceCore/BSONSerializer>
+#include <HyperspaceCore/BSONStreamReader>
+#include <HyperspaceCore/Fluctuation>
+#include <HyperspaceCore/Rebound>
+#include <HyperspaceCore/Wave>
+
+using namespace Hyperspace;
+
+class BSONBenchmarks : public Hemera::Test::Test
+{
+    Q_OBJECT
+
+public:
+    BSONBenchmarks(QObject *parent = 0)
+        : Test(parent)
+    { }
+
+private Q_SLOTS:
+    void initTestCase();
+    void init();
+
+    void benchmarkIndexedLookupWaveDecoding_data();
+    void benchmarkIndexedLookupWaveDecoding();
+    void benchmarkWaveDecoding_data();
+    void benchmarkWaveDecoding();
+    void benchmarkReboundDecoding_data();
+    void benchmarkReboundDecoding();
+    void benchmarkFluctuationDecoding_data();
+    void benchmarkFluctuationDecoding();
+    void benchmarkStreamReader_data();
+    void benchmarkStreamReader();
+    void benchmarkDoubleArrayDecoding_data();
+    void benchmarkDoubleArrayDecoding();
+
+    void cleanup();
+    void cleanupTestCase();
+
+private:
+    void populateMessageSizes();
+};
+
+void BSONBenchmarks::initTestCase()
+{
+    initTestCaseImpl();
+}
+
+void BSONBenchmarks::init()
+{
+    initImpl();
+}
+
+void BSONBenchmarks::populateMessageSizes()
+{
+    QTest::addColumn<QByteArray>("payload");
+    QTest::addColumn<ByteArrayHash>("attributes");
+
+    ByteArrayHash attributes;
+    attributes.insert("Content-Type", "application/bson");
+    attributes.insert("timestamp", "1476700000000");
+
+    // A datastream sample, a property document and a blob.
+    QTest::newRow("16 B payload, no attributes") << QByteArray(16, 'x') << ByteArrayHash();
+    QTest::newRow("16 B payload, 2 attributes") << QByteArray(16, 'x') << attributes;
+    QTest::newRow("1 KiB payload, 2 attributes") << QByteArray(1024, 'x') << attributes;
+    QTest::newRow("64 KiB payload, 2 attributes") << QByteArray(64 * 1024, 'x') << attributes;
+}
+
+void BSONBenchmarks::benchmarkIndexedLookupWaveDecoding_data()
+{
+    populateMessageSizes();
+}
+
+void BSONBenchmarks::benchmarkIndexedLookupWaveDecoding()
+{
+    QFETCH(QByteArray, payload);
+    QFETCH(ByteArrayHash, attributes);
+
+    Wave wave;
+    wave.setMethod("PUT");
+    wave.setInterface("com.ispirata.Hemera.Benchmarks");
+    wave.setTarget("/sensors/temperature/value");
+    wave.setAttributes(attributes);
+    wave.setPayload(payload);
+    QByteArray data = wave.serialize();
+
+    // Decodes the Wave through one keyed lookup per field on an indexed BSONDocument. This is not the
+    // original decoder, which scanned the whole document for every key: it is the fastest keyed path.
+    QBENCHMARK {
+        Util::BSONDocument doc(data);
+        QVERIFY(doc.isValid());
+        QCOMPARE(doc.int32Value("y"), (int32_t) Protocol::MessageType::Wave);
+
+        Wave w;
+        w.setId(doc.int64Value("u"));
+        w.setMethod(doc.byteArrayValue("m"));
+        w.setInterface(doc.byteArrayValue("i"));
+        w.setTarget(doc.byteArrayValue("t"));
+        w.setPayload(doc.byteArrayValue("p"));
+        if (doc.contains("a")) {
+            Util::BSONDocument attributesDoc = doc.subdocument("a");
+            QVERIFY(attributesDoc.isValid());
+            w.setAttributes(attributesDoc.byteArrayValuesHash());
+        }
+    }
+}
+
+void BSONBenchmarks::benchmarkWaveDecoding_data()
+{
+    populateMessageSizes();
+}
+
+void BSONBenchmarks::benchmarkWaveDecoding()
+{
+    QFETCH(QByteArray, payload);
+    QFETCH(ByteArrayHash, attributes);
+
+    Wave wave;
+    wave.setMethod("PUT");
+    wave.setInterface("com.ispirata.Hemera.Benchmarks");
+    wave.setTarget("/sensors/temperature/value");
+    wave.setAttributes(attributes);
+    wave.setPayload(payload);
+    QByteArray data = wave.serialize();
+
+    Wave decoded;
+    QBENCHMARK {
+        decoded = Wave::fromBinary(data);
+    }
+
+    QCOMPARE(decoded.id(), wave.id());
+    QCOMPARE(decoded.payload(), payload);
+    QCOMPARE(decoded.attributes(), attributes);
+}
+
+void BSONBenchmarks::benchmarkReboundDecoding_data()
+{
+    populateMessageSizes();
+}
+
+void BSONBenchmarks::benchmarkReboundDecoding()
+{
+    QFETCH(QByteArray, payload);
+    QFETCH(ByteArrayHash, attributes);
+
+    Rebound rebound(42, ResponseCode::OK);
+    rebound.setAttributes(attributes);
+    rebound.setPayload(payload);
+    QByteArray data = rebound.serialize();
+
+    Rebound decoded(0);
+    QBENCHMARK {
+        decoded = Rebound::fromBinary(data);
+    }
+
+    QCOMPARE(decoded.id(), (quint64) 42);
+    QCOMPARE(decoded.payload(), payload);
+}
+
+void BSONBenchmarks::benchmarkFluctuationDecoding_data()
+{
+    populateMessageSizes();
+}
+
+void BSONBenchmarks::benchmarkFluctuationDecoding()
+{
+    QFETCH(QByteArray, payload);
+    QFETCH(ByteArrayHash, attributes);
+
+    Fluctuation fluctuation;
+    fluctuation.setInterface("com.ispirata.Hemera.Benchmarks");
+    fluctuation.setTarget("/sensors/temperature/value");
+    fluctuation.setAttributes(attributes);
+    fluctuation.setPayload(payload);
+    QByteArray data = fluctuation.serialize();
+
+    Fluctuation decoded;
+    QBENCHMARK {
+        decoded = Fluctuation::fromBinary(data);
+    }
+
+    QCOMPARE(decoded, fluctuation);
+}
+
+void BSONBenchmarks::benchmarkStreamReader_data()
+{
+    QTest::addColumn<int>("documentSize");
+
+    // Each row pushes 16 MiB through the reader in 8 KiB socket reads
+    QTest::newRow("100 B documents") << 100;
+    QTest::newRow("8 KiB documents") << 8 * 1024;
+    QTest::newRow("4 MiB documents") << 4 * 1024 * 1024;
+}
+
+void BSONBenchmarks::benchmarkStreamReader()
+{
+    QFETCH(int, documentSize);
+
+    Util::BSONSerializer s;
+    s.appendBinaryValue("p", QByteArray(documentSize - Util::BSONSerializer::emptyDocumentSize()
+                                                    - Util::BSONSerializer::binaryElementSize("p", 0), 'x'));
+    s.appendEndOfDocument();
+    QCOMPARE(s.document().size(), documentSize);
+
+    const int documentCount = (16 * 1024 * 1024) / documentSize;
+    QByteArray stream;
+    stream.reserve(documentCount * documentSize);
+    for (int i = 0; i < documentCount; ++i) {
+        stream.append(s.document());
+    }
+
+    QByteArrayList chunks;
+    for (int offset = 0; offset < stream.size(); offset += 8192) {
+        chunks.append(stream.mid(offset, 8192));
+    }
+
+    QBENCHMARK {
+        Util::BSONStreamReader reader;
+        int dequeued = 0;
+        for (const QByteArray &chunk : chunks) {
+            reader.enqueueData(chunk);
+            while (reader.canReadDocument()) {
+                reader.dequeueDocumentView();
+                ++dequeued;
+            }
+        }
+        QCOMPARE(dequeued, documentCount);
+    }
+}
+
+void BSONBenchmarks::benchmarkDoubleArrayDecoding_data()
+{
+    QTest::addColumn<int>("count");
+
+    QTest::newRow("16 samples") << 16;
+    QTest::newRow("1024 samples") << 1024;
+    QTest::newRow("65536 samples") << 65536;
+}
+
+void BSONBenchmarks::benchmarkDoubleArrayDecoding()
+{
+    QFETCH(int, count);
+
+    QVector<double> samples;
+    samples.reserve(count);
+    for (int i = 0; i < count; ++i) {
+        samples.append(i * 0.25);
+    }
+
+    Util::BSONSerializer s(Util::BSONSerializer::emptyDocumentSize() + Util::BSONSerializer::doubleArrayElementSize("v", count));
+    s.appendDoubleArray("v", samples);
+    s.appendEndOfDocument();
+    const QByteArray document = s.document();
+
+    QBENCHMARK {
+        Util::BSONDocument doc(document);
+        QCOMPARE(doc.doubleArrayValue("v").count(), count);
+    }
+}
+
+void BSONBenchmarks::cleanup()
+{
+    cleanupImpl();
+}
+
+void BSONBenchmarks::cleanupTestCase()
+{
+    cleanupTestCaseImpl();
+}
+
+QTEST_MAIN(BSONBenchmarks)
+#include "bson-benchmarks.cpp.moc.hpp"
@@ -0,0 +1,197 @@
+/*
+ * Microbenchmarks for the BSON codec and the Hyperspace messages built on top of it.
+ *
+ * Every benchmark runs over a matrix of payload sizes and attribute counts, and prints one JSON
+ * object per line:
+ *
+ *   {"benchmark":"Wave::fromBinary","payload_bytes":1024,"attributes":4,"message_bytes":1187,
+ *    "iterations":524288,"ns_per_op":412.3,"bytes_per_op":1296.0,"allocs_per_op":9.00}
+ *
+ * bytes_per_op and allocs_per_op count the heap allocations made by each operation: they are null
+ * when allocations can't be counted on this platform.
+ *
+ * Usage: bson-codec-benchmark [--filter <substring>] [--min-time <milliseconds>]
+ */
+
+#include "lib/allocationcounter.h"
+
+#include <HyperspaceCore/BSONDocument>
+#include <HyperspaceCore/BSONSerializer>
+#include <HyperspaceCore/BSONStreamReader>
+#include <HyperspaceCore/Fluctuation>
+#include <HyperspaceCore/Rebound>
+#include <HyperspaceCore/Wave>
+
+#include <QtCore/QElapsedTimer>
+
+#include <stdio.h>
+#include <string.h>
+
+using namespace Hyperspace;
+
+static QByteArray s_filter;
+static qint64 s_minimumNSecs = 200 * 1000 * 1000;
+
+// Results are accumulated here, so that the compiler can't drop the operations being measured
+static volatile qint64 s_sink = 0;
+
+template <typename Operation>
+static void run(const char *name, int payloadSize, int attributeCount, int messageSize, Operation operation)
+{
+    if (!s_filter.isEmpty() && !QByteArray(name).contains(s_filter)) {
+        return;
+    }
+
+    // Warm up caches and allocator pools
+    operation();
+
+    qint64 iterations = 1;
+    for (;;) {
+        AllocationCounter allocations;
+        QElapsedTimer timer;
+        timer.start();
+        for (qint64 i = 0; i < iterations; ++i) {
+            operation();
+        }
+        const qint64 elapsed = timer.nsecsElapsed();
+        const quint64 allocationCount = allocations.allocations();
+        const quint64 allocatedBytes = allocations.allocatedBytes();
+
+        if (elapsed < s_minimumNSecs && iterations < (Q_INT64_C(1) << 32)) {
+            // Aim a bit past the minimum time, and at least double every round
+            iterations = qMax(iterations * 2, elapsed > 0 ? iterations * s_minimumNSecs / elapsed * 6 / 5 : iterations * 100);
+            continue;
+        }
+
+        printf("{\"benchmark\":\"%s\",\"payload_bytes\":%d,\"attributes\":%d,\"message_bytes\":%d,\"iterations\":%lld,\"ns_per_op\":%.1f,",
+               name, payloadSize, attributeCount, messageSize, (long long) iterations, (double) elapsed / iterations);
+        if (AllocationCounter::isAvailable()) {
+            printf("\"bytes_per_op\":%.1f,\"allocs_per_op\":%.2f}\n", (double) allocatedBytes / iterations, (double) allocationCount / iterations);
+        } else {
+            printf("\"bytes_per_op\":null,\"allocs_per_op\":null}\n");
+        }
+        fflush(stdout);
+        return;
+    }
+}
+
+static ByteArrayHash makeAttributes(int count)
+{
+    ByteArrayHash attributes;
+    for (int i = 0; i < count; ++i) {
+        attributes.insert("attribute-" + QByteArray::number(i), "value-" + QByteArray::number(i));
+    }
+
+    return attributes;
+}
+
+static void benchmarkMessages(int payloadSize, int attributeCount)
+{
+    const QByteArray payload(payloadSize, 'x');
+    const ByteArrayHash attributes = makeAttributes(attributeCount);
+
+    Wave wave;
+    wave.setMethod("PUT");
+    wave.setInterface("com.ispirata.Hemera.Benchmarks");
+    wave.setTarget("/sensors/temperature/value");
+    wave.setAttributes(attributes);
+    wave.setPayload(payload);
+    const QByteArray waveData = wave.serialize();
+
+    Rebound rebound(wave, ResponseCode::OK);
+    rebound.setAttributes(attributes);
+    rebound.setPayload(payload);
+    const QByteArray reboundData = rebound.serialize();
+
+    Fluctuation fluctuation;
+    fluctuation.setInterface("com.ispirata.Hemera.Benchmarks");
+    fluctuation.setTarget("/sensors/temperature/value");
+    fluctuation.setAttributes(attributes);
+    fluctuation.setPayload(payload);
+    const QByteArray fluctuationData = fluctuation.serialize();
+
+    run("Wave::serialize", payloadSize, attributeCount, waveData.size(), [&] {
+        s_sink += wave.serialize().size();
+    });
+    run("Wave::fromBinary", payloadSize, attributeCount, waveData.size(), [&] {
+        s_sink += Wave::fromBinary(waveData).payload().size();
+    });
+    run("Rebound::serialize", payloadSize, attributeCount, reboundData.size(), [&] {
+        s_sink += rebound.serialize().size();
+    });
+    run("Rebound::fromBinary", payloadSize, attributeCount, reboundData.size(), [&] {
+        s_sink += Rebound::fromBinary(reboundData).payload().size();
+    });
+    run("Fluctuation::serialize", payloadSize, attributeCount, fluctuationData.size(), [&] {
+        s_sink += fluctuation.serialize().size();
+    });
+    run("Fluctuation::fromBinary", payloadSize, attributeCount, fluctuationData.size(), [&] {
+        s_sink += Fluctuation::fromBinary(fluctuationData).payload().size();
+    });
+
+    // The producer path: one reused serializer writing a value document
+    Util::BSONSerializer serializer;
+    run("BSONSerializer::reset+append", payloadSize, attributeCount, waveData.size(), [&] {
+        serializer.reset();
+        serializer.appendInt32Value("y", 1);
+        serializer.appendASCIIString("m", "PUT");
+        serializer.appendASCIIString("t", "/sensors/temperature/value");
+        {
+            Util::BSONSerializer::DocumentGuard a(serializer, "a");
+            for (ByteArrayHash::const_iterator i = attributes.constBegin(); i != attributes.constEnd(); ++i) {
+                serializer.appendASCIIString(i.key(), i.value());
+            }
+        }
+        serializer.appendBinaryValue("p", payload);
+        serializer.appendEndOfDocument();
+        s_sink += serializer.document().size();
+    });
+
+    run("BSONDocument::lookup", payloadSize, attributeCount, waveData.size(), [&] {
+        Util::BSONDocument doc(waveData);
+        s_sink += doc.int64Value("u") + doc.byteArrayView("t").size() + doc.byteArrayView("p").size();
+    });
+    run("BSONDocument::isValid", payloadSize, attributeCount, waveData.size(), [&] {
+        s_sink += Util::BSONDocument(waveData).isValid();
+    });
+    run("BSONDocument::iterate", payloadSize, attributeCount, waveData.size(), [&] {
+        Util::BSONDocument doc(waveData);
+        for (const Util::BSONElement &element : doc) {
+            s_sink += element.keySize();
+        }
+    });
+
+    // One document per socket read, the common case for small messages
+    Util::BSONStreamReader reader;
+    run("BSONStreamReader::dequeueDocumentView", payloadSize, attributeCount, waveData.size(), [&] {
+        reader.enqueueData(waveData);
+        while (reader.canReadDocument()) {
+            s_sink += reader.dequeueDocumentView().size();
+        }
+    });
+}
+
+int main(int argc, char **argv)
+{
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--filter") && i + 1 < argc) {
+            s_filter = argv[++i];
+        } else if (!strcmp(argv[i], "--min-time") && i + 1 < argc) {
+            s_minimumNSecs = QByteArray(argv[++i]).toLongLong() * 1000 * 1000;
+        } else {
+            fprintf(stderr, "Usage: %s [--filter <substring>] [--min-time <milliseconds>]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    const int payloadSizes[] = { 16, 1024, 64 * 1024 };
+    const int attributeCounts[] = { 0, 4, 16 };
+
+    for (int payloadSize : payloadSizes) {
+        for (int attributeCount : attributeCounts) {
+            benchmarkMessages(payloadSize, attributeCount);
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,147 @@
+/*
+ *
+ */
+
+#include "allocationcounter.h"
+
+#include <QtTest/QTest>
+
+#include <stdlib.h>
+
+#if defined(__GLIBC__)
+
+#include <errno.h>
+
+// Initial-exec TLS never allocates, which matters here: these are updated from within malloc.
+static __thread quint64 s_allocations __attribute__((tls_model("initial-exec"))) = 0;
+static __thread quint64 s_allocatedBytes __attribute__((tls_model("initial-exec"))) = 0;
+
+static inline void countAllocation(size_t size)
+{
+    ++s_allocations;
+    s_allocatedBytes += size;
+}
+
+extern "C" {
+
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t count, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+void *__libc_memalign(size_t alignment, size_t size);
+
+void *malloc(size_t size)
+{
+    countAllocation(size);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size)
+{
+    countAllocation(count * size);
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    countAllocation(size);
+    return __libc_realloc(ptr, size);
+}
+
+void *memalign(size_t alignment, size_t size)
+{
+    countAllocation(size);
+    return __libc_memalign(alignment, size);
+}
+
+void *aligned_alloc(size_t alignment, size_t size)
+{
+    countAllocation(size);
+    return __libc_memalign(alignment, size);
+}
+
+int posix_memalign(void **ptr, size_t alignment, size_t size)
+{
+    countAllocation(size);
+    void *p = __libc_memalign(alignment, size);
+    if (!p) {
+        return ENOMEM;
+    }
+
+    *ptr = p;
+    return 0;
+}
+
+}
+
+#endif
+
+AllocationCounter::AllocationCounter()
+{
+    restart();
+}
+
+void AllocationCounter::restart()
+{
+#if defined(__GLIBC__)
+    m_startAllocations = s_allocations;
+    m_startBytes = s_allocatedBytes;
+#else
+    m_startAllocations = 0;
+    m_startBytes = 0;
+#endif
+}
+
+quint64 AllocationCounter::allocations() const
+{
+#if defined(__GLIBC__)
+    return s_allocations - m_startAllocations;
+#else
+    return 0;
+#endif
+}
+
+quint64 AllocationCounter::allocatedBytes() const
+{
+#if defined(__GLIBC__)
+    return s_allocatedBytes - m_startBytes;
+#else
+    return 0;
+#endif
+}
+
+bool AllocationCounter::isAvailable()
+{
+#if defined(__GLIBC__)
+    return true;
+#else
+    return false;
+#endif
+}
+
+AllocationScope::AllocationScope(quint64 maximum, const char *file, int line)
+    : m_maximum(maximum)
+    , m_file(file)
+    , m_line(line)
+    , m_entered(false)
+{
+}
+
+bool AllocationScope::enter()
+{
+    if (!m_entered) {
+        m_entered = true;
+        m_counter.restart();
+        return true;
+    }
+
+    // Read the counters before building the message, which allocates
+    const quint64 allocations = m_counter.allocations();
+    const quint64 allocatedBytes = m_counter.allocatedBytes();
+    if (AllocationCounter::isAvailable() && allocations > m_maximum) {
+        QByteArray message = "Block made " + QByteArray::number(allocations) + " allocations (" +
+                             QByteArray::number(allocatedBytes) + " bytes), at most " + QByteArray::number(m_maximum) + " allowed";
+        QTest::qFail(message.constData(), m_file, m_line);
+    }
+
+    return false;
+}
@@ -0,0 +1,76 @@
+/*
+ *
+ */
+
+#ifndef ALLOCATIONCOUNTER_H
+#define ALLOCATIONCOUNTER_H
+
+#include <QtCore/QtGlobal>
+
+/**
+ * @brief Counts the heap allocations made by the calling thread
+ *
+ * Linking the test library replaces malloc, calloc, realloc and the aligned allocators with thin
+ * wrappers around the C library's own, which count calls and requested bytes per thread. operator new
+ * goes through malloc, so C++ and Qt allocations are counted as well.
+ *
+ * A counter starts counting when it is constructed, or restarted. Only glibc is supported: elsewhere,
+ * isAvailable() returns false and counters stay at zero.
+ */
+class AllocationCounter
+{
+public:
+    AllocationCounter();
+
+    void restart();
+
+    /// @returns The number of allocations made by this thread since the counter was (re)started.
+    quint64 allocations() const;
+    /// @returns The number of bytes requested by this thread since the counter was (re)started.
+    quint64 allocatedBytes() const;
+
+    static bool isAvailable();
+
+private:
+    quint64 m_startAllocations;
+    quint64 m_startBytes;
+};
+
+/**
+ * @brief Implementation of HYPERSPACE_ASSERT_MAX_ALLOCS: don't use it directly
+ *
+ * enter() returns true once, starting the count, and false the second time, when it fails the
+ * current test if the block allocated more than allowed.
+ */
+class AllocationScope
+{
+public:
+    AllocationScope(quint64 maximum, const char *file, int line);
+
+    bool enter();
+
+private:
+    AllocationCounter m_counter;
+    quint64 m_maximum;
+    const char *m_file;
+    int m_line;
+    bool m_entered;
+};
+
+/**
+ * @brief Fails the current test if the following block makes more than @p maximum heap allocations
+ *
+ * @code
+ * HYPERSPACE_ASSERT_MAX_ALLOCS(1) {
+ *     data = rebound.serialize();
+ * }
+ * @endcode
+ *
+ * Allocations are counted on the calling thread only. The failure is recorded when the block ends:
+ * unlike QVERIFY, the test function keeps running. Where allocations can't be counted, the block runs
+ * unchecked.
+ */
+#define HYPERSPACE_ASSERT_MAX_ALLOCS(maximum) \
+    for (AllocationScope _hyperspaceAllocationScope(maximum, __FILE__, __LINE__); _hyperspaceAllocationScope.enter(); )
+
+#endif // ALLOCATIONCOUNTER_H
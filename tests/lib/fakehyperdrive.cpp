@@ -9,42 +9,125 @@
 
 #include <QtCore/QDebug>
 #include <QtCore/QFile>
+#include <QtCore/QSocketNotifier>
 
 #include <QtNetwork/QLocalServer>
 #include <QtNetwork/QLocalSocket>
 
-#include <QtTest/qbenchmark.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define GATES_SOCKET_PATH "/tmp/hyperdrive-gates-autotests"
 
 class FakeHyperdrive::Private
 {
 public:
-    Private() : lastRebound(0) {}
+    Private(FakeHyperdrive *q, Hyperspace::Socket::Transport transport)
+        : q(q), transport(transport), hyperServer(nullptr), socket(nullptr), listenFd(-1), packetSocket(nullptr), lastRebound(0) {}
+
+    FakeHyperdrive *q;
+    Hyperspace::Socket::Transport transport;
 
+    // Stream transport
     QLocalServer *hyperServer;
     QLocalSocket *socket;
-    Hyperspace::Rebound lastRebound;
     Hyperspace::Util::BSONStreamReader bsonStream;
+
+    // SOCK_SEQPACKET transport, which QLocalServer can't do
+    int listenFd;
+    Hyperspace::Socket *packetSocket;
+
+    Hyperspace::Rebound lastRebound;
+
+    bool listenForPackets();
+    void processDocument(const QByteArray &docData);
 };
 
-FakeHyperdrive::FakeHyperdrive(QObject* parent)
+bool FakeHyperdrive::Private::listenForPackets()
+{
+    listenFd = ::socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (listenFd < 0) {
+        return false;
+    }
+
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, GATES_SOCKET_PATH, sizeof(address.sun_path) - 1);
+    if (::bind(listenFd, (struct sockaddr *) &address, sizeof(address)) < 0 || ::listen(listenFd, 1) < 0) {
+        return false;
+    }
+
+    QSocketNotifier *notifier = new QSocketNotifier(listenFd, QSocketNotifier::Read, q);
+    QObject::connect(notifier, &QSocketNotifier::activated, q, [this] {
+        int fd = ::accept4(listenFd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd < 0) {
+            return;
+        }
+
+        qDebug() << "Fake hyperdrive got a connection";
+        packetSocket = new Hyperspace::Socket(fd, q);
+        // One document per datagram
+        QObject::connect(packetSocket, &Hyperspace::Socket::readyRead, q, [this] (const QByteArray &data, int payloadFd) {
+            if (payloadFd != -1) {
+                ::close(payloadFd);
+            }
+            processDocument(data);
+        });
+        packetSocket->init();
+    });
+
+    return true;
+}
+
+void FakeHyperdrive::Private::processDocument(const QByteArray &docData)
+{
+    Hyperspace::Util::BSONDocument doc(docData);
+
+    if (doc.int32Value("y") == (int32_t) Hyperspace::Protocol::MessageType::Waveguide) {
+        qDebug() << "Interfaces registered successfully." << Hyperspace::Waveguide::fromBinary(docData).interface();
+    } else if (doc.int32Value("y")  == (int32_t) Hyperspace::Protocol::MessageType::Rebound) {
+        lastRebound = Hyperspace::Rebound::fromBinary(docData);
+        Q_EMIT q->gotRebound();
+    } else {
+        qWarning() << "Message malformed on the hyperdrive!";
+    }
+}
+
+FakeHyperdrive::FakeHyperdrive(QObject* parent, Hyperspace::Socket::Transport transport)
     : Hemera::AsyncInitObject(parent)
-    , d(new Private)
+    , d(new Private(this, transport))
 {
     qRegisterMetaType<Hyperspace::Wave>();
 }
 
 FakeHyperdrive::~FakeHyperdrive()
 {
+    if (d->listenFd >= 0) {
+        ::close(d->listenFd);
+    }
 }
 
 void FakeHyperdrive::initImpl()
 {
-    if (QFile::exists(QStringLiteral("/tmp/hyperdrive-gates-autotests"))) {
-        QFile::remove(QStringLiteral("/tmp/hyperdrive-gates-autotests"));
+    if (QFile::exists(QStringLiteral(GATES_SOCKET_PATH))) {
+        QFile::remove(QStringLiteral(GATES_SOCKET_PATH));
+    }
+
+    if (d->transport == Hyperspace::Socket::SeqPacketTransport) {
+        if (!d->listenForPackets()) {
+            setInitError(QStringLiteral("register"), QStringLiteral("Could not listen for SOCK_SEQPACKET connections"));
+            return;
+        }
+
+        setReady();
+        return;
     }
 
     d->hyperServer = new QLocalServer(this);
-    if (!d->hyperServer->listen(QStringLiteral("/tmp/hyperdrive-gates-autotests"))) {
+    if (!d->hyperServer->listen(QStringLiteral(GATES_SOCKET_PATH))) {
         setInitError(QStringLiteral("register"), QStringLiteral("Could not set up QLocalServer"));
     }
 
@@ -56,18 +139,7 @@ void FakeHyperdrive::initImpl()
             QByteArray data = d->socket->read(d->socket->bytesAvailable());
             d->bsonStream.enqueueData(data);
             while (d->bsonStream.canReadDocument()) {
-                QByteArray docData = d->bsonStream.dequeueDocumentData();
-                Hyperspace::Util::BSONDocument doc(docData);
-
-                if (doc.int32Value("y") == (int32_t) Hyperspace::Protocol::MessageType::Waveguide) {
-                    qDebug() << "Interfaces registered successfully." << Hyperspace::Waveguide::fromBinary(docData).interface();
-                } else if (doc.int32Value("y")  == (int32_t) Hyperspace::Protocol::MessageType::Rebound) {
-                    d->lastRebound = Hyperspace::Rebound::fromBinary(docData);
-                    Q_EMIT gotRebound();
-                } else {
-                    qWarning() << "Message malformed on the hyperdrive!";
-                    return;
-                }
+                d->processDocument(d->bsonStream.dequeueDocumentData());
             }
         });
     });
@@ -80,9 +152,16 @@ Hyperspace::Rebound FakeHyperdrive::lastRebound() const
     return d->lastRebound;
 }
 
+bool FakeHyperdrive::hasGate() const
+{
+    return d->socket || d->packetSocket;
+}
+
 void FakeHyperdrive::sendWave(const Hyperspace::Wave &wave)
 {
-    QBENCHMARK_ONCE {
+    if (d->packetSocket) {
+        d->packetSocket->write(wave.serialize());
+    } else {
         d->socket->write(wave.serialize());
     }
 }
@@ -11,6 +11,7 @@
 
 #include <HyperspaceCore/Global>
 #include <HyperspaceCore/Rebound>
+#include <HyperspaceCore/Socket>
 #include <HyperspaceCore/Wave>
 #include <HyperspaceCore/Waveguide>
 
@@ -20,12 +21,14 @@ class FakeHyperdrive : public Hemera::AsyncInitObject
     Q_DISABLE_COPY(FakeHyperdrive)
 
 public:
-    FakeHyperdrive(QObject *parent);
+    FakeHyperdrive(QObject *parent, Hyperspace::Socket::Transport transport = Hyperspace::Socket::StreamTransport);
     virtual ~FakeHyperdrive();
 
     virtual void initImpl();
 
     Hyperspace::Rebound lastRebound() const;
+    /// Whether a Gate connected
+    bool hasGate() const;
 
 public Q_SLOTS:
     void sendWave(const Hyperspace::Wave &wave);
@@ -0,0 +1,750 @@
+#include <HemeraTest/Test>
+
+#include <QtCore/QCoreApplication>
+#include <QtCore/QObject>
+#include <QtTest/QSignalSpy>
+
+#include <HyperspaceCore/BSONDocument>
+#include <HyperspaceCore/BSONSerializer>
+#include <HyperspaceCore/LatencyHistogram>
+#include <HyperspaceCore/Rebound>
+#include <HyperspaceCore/Socket>
+#include <HyperspaceCore/Wave>
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+using namespace Hyperspace;
+
+class SocketBasics : public Hemera::Test::Test
+{
+    Q_OBJECT
+
+public:
+    SocketBasics(QObject *parent = 0)
+        : Test(parent)
+    { }
+
+private Q_SLOTS:
+    void initTestCase();
+    void init();
+
+    void testWriteOrdering();
+    void testWriteCoalescing();
+    void testBackpressure();
+    void testReads();
+    void testIOThread();
+    void testSharedPayload();
+    void testIOThreadSharedPayload();
+    void testSeqPacket();
+    void testIOUring();
+    void testWriteBatching();
+    void testStatistics();
+    void testLatencyHistogram();
+
+    void cleanup();
+    void cleanupTestCase();
+
+private:
+    Socket *connectedSocket(int *peer);
+    QByteArray readAvailable(int peer);
+    int receiveAvailable(int peer, QByteArray *received, QList<int> *fds, qint64 *fdChunkStart, qint64 *fdChunkEnd);
+};
+
+void SocketBasics::initTestCase()
+{
+    initTestCaseImpl();
+}
+
+void SocketBasics::init()
+{
+    initImpl();
+}
+
+Socket *SocketBasics::connectedSocket(int *peer)
+{
+    int fds[2];
+    if (::socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+        return nullptr;
+    }
+
+    // Small buffers, so that the write queue fills up quickly
+    int size = 4096;
+    ::setsockopt(fds[0], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    ::setsockopt(fds[1], SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    ::fcntl(fds[1], F_SETFL, ::fcntl(fds[1], F_GETFL) | O_NONBLOCK);
+
+    *peer = fds[1];
+    Socket *socket = new Socket(fds[0], this);
+    socket->init();
+    return socket;
+}
+
+QByteArray SocketBasics::readAvailable(int peer)
+{
+    QByteArray data;
+    char buffer[4096];
+    ssize_t count;
+    while ((count = ::read(peer, buffer, sizeof(buffer))) > 0) {
+        data.append(buffer, count);
+    }
+
+    return data;
+}
+
+// Reads whatever is available with recvmsg, and remembers which bytes came with the read which carried an fd.
+// Returns how many bytes were received so far.
+int SocketBasics::receiveAvailable(int peer, QByteArray *received, QList<int> *fds, qint64 *fdChunkStart, qint64 *fdChunkEnd)
+{
+    char buffer[4096];
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } cmsgu;
+
+    for (;;) {
+        struct iovec iov = { buffer, sizeof(buffer) };
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = cmsgu.buf;
+        msg.msg_controllen = sizeof(cmsgu.buf);
+
+        ssize_t count = ::recvmsg(peer, &msg, 0);
+        if (count <= 0) {
+            break;
+        }
+
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            int fd;
+            memcpy(&fd, CMSG_DATA(cmsg), sizeof(fd));
+            fds->append(fd);
+            *fdChunkStart = received->size();
+            *fdChunkEnd = received->size() + count;
+        }
+
+        received->append(buffer, count);
+    }
+
+    return received->size();
+}
+
+void SocketBasics::testWriteOrdering()
+{
+    int peer;
+    Socket *socket = connectedSocket(&peer);
+    QVERIFY(socket);
+    QTRY_VERIFY(socket->isReady());
+
+    // Way more than the socket can hold: the queue gets flushed in batches, across partial writes
+    QByteArray expected;
+    for (int i = 0; i < 1000; ++i) {
+        QByteArray message(1 + i % 97, 'a' + i % 26);
+        expected.append(message);
+        QCOMPARE(socket->write(message), message.size());
+    }
+
+    QByteArray received;
+    QTRY_COMPARE((received += readAvailable(peer)).size(), expected.size());
+    QCOMPARE(received, expected);
+    QCOMPARE(socket->bytesToWrite(), Q_INT64_C(0));
+
+    delete socket;
+    ::close(peer);
+}
+
+void SocketBasics::testWriteCoalescing()
+{
+    int peer;
+    Socket *socket = connectedSocket(&peer);
+    QVERIFY(socket);
+    QTRY_VERIFY(socket->isReady());
+
+    int pipeFds[2];
+    QCOMPARE(::pipe(pipeFds), 0);
+
+    // A message way larger than the socket's buffer, so that writes stop halfway through it, then lots of small
+    // messages to be gathered, one of which carries an fd
+    QList<QByteArray> messages;
+    messages.append(QByteArray(64 * 1024, 'L'));
+    for (int i = 0; i < 500; ++i) {
+        messages.append(QByteArray(1 + i % 37, 'a' + i % 26));
+    }
+
+    const int fdMessage = 250;
+    qint64 expectedFdOffset = 0;
+    QByteArray expected;
+    for (int i = 0; i < messages.size(); ++i) {
+        if (i == fdMessage) {
+            expectedFdOffset = expected.size();
+        }
+        expected.append(messages.at(i));
+        QCOMPARE(socket->write(messages.at(i), i == fdMessage ? pipeFds[0] : -1), messages.at(i).size());
+    }
+
+    QByteArray received;
+    QList<int> receivedFds;
+    qint64 fdChunkStart = -1;
+    qint64 fdChunkEnd = -1;
+    QTRY_COMPARE(receiveAvailable(peer, &received, &receivedFds, &fdChunkStart, &fdChunkEnd), expected.size());
+    QCOMPARE(received, expected);
+    QCOMPARE(socket->bytesToWrite(), Q_INT64_C(0));
+
+    // The fd went exactly once, and arrived with the read holding the first byte of its message
+    QCOMPARE(receivedFds.size(), 1);
+    QVERIFY(fdChunkStart <= expectedFdOffset && expectedFdOffset < fdChunkEnd);
+
+    struct stat sent;
+    struct stat arrived;
+    QCOMPARE(::fstat(pipeFds[0], &sent), 0);
+    QCOMPARE(::fstat(receivedFds.first(), &arrived), 0);
+    QCOMPARE(arrived.st_ino, sent.st_ino);
+
+    // Short writes stopped mid-message and were resumed from there, and messages went out in batches
+    Socket::Statistics statistics = socket->statistics();
+    QVERIFY(statistics.partialWrites > 0);
+    QCOMPARE(statistics.messagesWritten, quint64(messages.size()));
+    QCOMPARE(statistics.bytesWritten, quint64(expected.size()));
+    QVERIFY(statistics.syscalls < quint64(messages.size()) / 4);
+
+    delete socket;
+    ::close(peer);
+    ::close(receivedFds.first());
+    ::close(pipeFds[0]);
+    ::close(pipeFds[1]);
+}
+
+void SocketBasics::testBackpressure()
+{
+    int peer;
+    Socket *socket = connectedSocket(&peer);
+    QVERIFY(socket);
+    QTRY_VERIFY(socket->isReady());
+
+    QSignalSpy highWaterMarkSpy(socket, SIGNAL(highWaterMarkReached()));
+    QSignalSpy drainedSpy(socket, SIGNAL(drained()));
+
+    socket->setHighWaterMark(16 * 1024);
+    socket->setWriteBufferLimit(64 * 1024);
+    QCOMPARE(socket->overflowPolicy(), Socket::RefuseWrites);
+
+    const QByteArray message(8192, 'x');
+    int accepted = 0;
+    int refused = 0;
+    for (int i = 0; i < 100; ++i) {
+        if (socket->write(message) < 0) {
+            ++refused;
+        } else {
+            ++accepted;
+        }
+    }
+
+    QVERIFY(refused > 0);
+    QVERIFY(socket->bytesToWrite() <= socket->writeBufferLimit());
+    QCOMPARE(highWaterMarkSpy.count(), 1);
+    drainedSpy.clear();
+
+    // Everything which was accepted makes it through
+    QByteArray received;
+    QTRY_COMPARE((received += readAvailable(peer)).size(), accepted * message.size());
+    QTRY_COMPARE(drainedSpy.count(), 1);
+    QCOMPARE(socket->bytesToWrite(), Q_INT64_C(0));
+
+    // Once drained, the queue takes data again
+    QCOMPARE(socket->write(message), message.size());
+
+    delete socket;
+    ::close(peer);
+}
+
+void SocketBasics::testReads()
+{
+    int peer;
+    Socket *socket = connectedSocket(&peer);
+    QVERIFY(socket);
+    QTRY_VERIFY(socket->isReady());
+
+    QByteArray received;
+    int fd = -1;
+    connect(socket, &Socket::readyRead, this, [&received, &fd] (const QByteArray &data, int receivedFd) {
+        received.append(data.constData(), data.size());
+        if (receivedFd != -1) {
+            fd = receivedFd;
+        }
+    });
+
+    // Small messages, then a burst bigger than the initial receive buffer
+    QByteArray expected;
+    for (int i = 0; i < 100; ++i) {
+        QByteArray message(1 + i % 13, 'a' + i % 26);
+        expected.append(message);
+        QCOMPARE(::write(peer, message.constData(), message.size()), (ssize_t) message.size());
+    }
+    QByteArray burst(256 * 1024, 'b');
+    expected.append(burst);
+    for (int written = 0; written < burst.size();) {
+        ssize_t count = ::write(peer, burst.constData() + written, burst.size() - written);
+        if (count > 0) {
+            written += count;
+        }
+        QTest::qWait(1);
+    }
+
+    QTRY_COMPARE(received.size(), expected.size());
+    QCOMPARE(received, expected);
+
+    // An fd comes along with the data it was sent with
+    int pipeFds[2];
+    QCOMPARE(::pipe(pipeFds), 0);
+    Socket *writer = new Socket(peer, this);
+    writer->init();
+    QTRY_VERIFY(writer->isReady());
+    writer->write(QByteArray("with fd"), pipeFds[0]);
+
+    QTRY_VERIFY(fd != -1);
+    QVERIFY(received.endsWith("with fd"));
+
+    ::close(fd);
+    ::close(pipeFds[0]);
+    ::close(pipeFds[1]);
+    // The writer owns the peer now
+    delete writer;
+    delete socket;
+}
+
+void SocketBasics::testIOThread()
+{
+    int fds[2];
+    QCOMPARE(::socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+    ::fcntl(fds[1], F_SETFL, ::fcntl(fds[1], F_GETFL) | O_NONBLOCK);
+
+    Socket *socket = new Socket(fds[0], this);
+    socket->setIOThreadEnabled(true);
+    QVERIFY(socket->isIOThreadEnabled());
+    socket->init();
+    QTRY_VERIFY(socket->isReady());
+
+    QList<QByteArray> documents;
+    connect(socket, &Socket::readyRead, this, [&documents] (const QByteArray &data, int) {
+        documents.append(QByteArray(data.constData(), data.size()));
+    });
+    QSignalSpy disconnectedSpy(socket, SIGNAL(disconnected()));
+
+    // Documents come out one by one, however the stream was cut
+    QByteArray stream;
+    for (int i = 0; i < 200; ++i) {
+        Util::BSONSerializer serializer;
+        serializer.appendInt32Value("i", i);
+        serializer.appendBinaryValue("p", QByteArray(i, 'p'));
+        serializer.appendEndOfDocument();
+        stream.append(serializer.document());
+    }
+    for (int offset = 0; offset < stream.size();) {
+        ssize_t count = ::write(fds[1], stream.constData() + offset, qMin(777, stream.size() - offset));
+        if (count > 0) {
+            offset += count;
+        }
+        QTest::qWait(1);
+    }
+
+    QTRY_COMPARE(documents.count(), 200);
+    QByteArray joined;
+    for (int i = 0; i < documents.count(); ++i) {
+        QCOMPARE(Util::BSONDocument(documents.at(i)).int32Value("i"), i);
+        joined.append(documents.at(i));
+    }
+    QCOMPARE(joined, stream);
+
+    // And go out the same way
+    QSignalSpy drainedSpy(socket, SIGNAL(drained()));
+    for (const QByteArray &document : documents) {
+        QCOMPARE(socket->write(document), document.size());
+    }
+    QByteArray received;
+    QTRY_COMPARE((received += readAvailable(fds[1])).size(), stream.size());
+    QCOMPARE(received, stream);
+    QTRY_VERIFY(drainedSpy.count() > 0);
+    QCOMPARE(socket->bytesToWrite(), Q_INT64_C(0));
+
+    ::close(fds[1]);
+    QTRY_COMPARE(disconnectedSpy.count(), 1);
+
+    delete socket;
+}
+
+void SocketBasics::testSharedPayload()
+{
+    int fds[2];
+    QCOMPARE(::socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+
+    Socket *sender = new Socket(fds[0], this);
+    Socket *receiver = new Socket(fds[1], this);
+    sender->init();
+    receiver->init();
+    QTRY_VERIFY(sender->isReady() && receiver->isReady());
+
+    QByteArray received;
+    int receivedFd = -1;
+    connect(receiver, &Socket::readyRead, this, [&received, &receivedFd] (const QByteArray &data, int fd) {
+        received.append(data.constData(), data.size());
+        if (fd != -1) {
+            receivedFd = fd;
+        }
+    });
+
+    QByteArray payload(4 * 1024 * 1024, 'f');
+    payload[12345] = 'x';
+    Rebound rebound(42, ResponseCode::OK);
+    rebound.setPayload(payload);
+
+    // Below the threshold, the payload stays inline
+    int fd;
+    QCOMPARE(rebound.serialize(payload.size() + 1, &fd), rebound.serialize());
+    QCOMPARE(fd, -1);
+
+    // Above it, only a small header goes through the socket
+    QByteArray header = rebound.serialize(64 * 1024, &fd);
+    QVERIFY(fd != -1);
+    QVERIFY(header.size() < 64);
+    QCOMPARE(sender->write(header, fd, Socket::TakeFd), header.size());
+
+    QTRY_COMPARE(received.size(), header.size());
+    QTRY_VERIFY(receivedFd != -1);
+
+    // The payload is mapped, not copied, and outlives the fd
+    Rebound decoded = Rebound::fromBinary(received, receivedFd);
+    ::close(receivedFd);
+    QCOMPARE(decoded.id(), Q_UINT64_C(42));
+    QCOMPARE(decoded.payloadView(), payload);
+    QCOMPARE(decoded.payloadView().constData(), decoded.payloadView().constData());
+
+    // payload() copies it out of the mapping, and so does setPayload() when handed a view on it
+    QByteArray kept = decoded.payload();
+    QVERIFY(kept.constData() != decoded.payloadView().constData());
+    Rebound copy = decoded;
+    copy.setPayload(copy.payloadView());
+    decoded = Rebound(0);
+    QCOMPARE(kept, payload);
+    QCOMPARE(copy.payloadView(), payload);
+
+    // Without its fd, the message can't be decoded
+    QCOMPARE(Rebound::fromBinary(received).id(), Q_UINT64_C(0));
+
+    delete sender;
+    delete receiver;
+}
+
+void SocketBasics::testIOThreadSharedPayload()
+{
+    int fds[2];
+    QCOMPARE(::socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+
+    Socket *sender = new Socket(fds[0], this);
+    Socket *receiver = new Socket(fds[1], this);
+    receiver->setIOThreadEnabled(true);
+    sender->init();
+    receiver->init();
+    QTRY_VERIFY(sender->isReady() && receiver->isReady());
+
+    QList<Wave> received;
+    connect(receiver, &Socket::readyRead, this, [&received] (const QByteArray &data, int fd) {
+        received.append(Wave::fromBinary(data, fd));
+        if (fd != -1) {
+            ::close(fd);
+        }
+    });
+
+    // Small waves followed by one with a shared payload, in bursts: reads carrying an fd start with earlier waves
+    QList<Wave> sent;
+    for (int burst = 0; burst < 10; ++burst) {
+        for (int i = 0; i < 5; ++i) {
+            Wave wave;
+            wave.setPayload(QByteArray(16 + i, 's'));
+            QCOMPARE(sender->write(wave.serialize()), wave.serialize().size());
+            sent.append(wave);
+        }
+
+        QByteArray payload(256 * 1024, 'b');
+        payload[burst] = 'x';
+        Wave wave;
+        wave.setPayload(payload);
+        int fd;
+        QByteArray header = wave.serialize(64 * 1024, &fd);
+        QVERIFY(fd != -1);
+        QCOMPARE(sender->write(header, fd, Socket::TakeFd), header.size());
+        sent.append(wave);
+    }
+
+    QTRY_COMPARE(received.count(), sent.count());
+    for (int i = 0; i < sent.count(); ++i) {
+        QCOMPARE(received.at(i).id(), sent.at(i).id());
+        QCOMPARE(received.at(i).payload(), sent.at(i).payload());
+    }
+
+    delete sender;
+    delete receiver;
+}
+
+void SocketBasics::testSeqPacket()
+{
+    int fds[2];
+    QCOMPARE(::socketpair(AF_UNIX, SOCK_SEQPACKET, 0, fds), 0);
+
+    // The transport comes from the fd
+    Socket *sender = new Socket(fds[0], this);
+    Socket *receiver = new Socket(fds[1], this);
+    sender->init();
+    receiver->init();
+    QTRY_VERIFY(sender->isReady() && receiver->isReady());
+    QCOMPARE(sender->transport(), Socket::SeqPacketTransport);
+    QCOMPARE(receiver->transport(), Socket::SeqPacketTransport);
+
+    QList<QByteArray> messages;
+    QList<int> receivedFds;
+    connect(receiver, &Socket::readyRead, this, [&messages, &receivedFds] (const QByteArray &data, int fd) {
+        messages.append(QByteArray(data.constData(), data.size()));
+        receivedFds.append(fd);
+    });
+
+    // Every message comes out whole, with exactly the fd it was sent with
+    int pipeFds[2];
+    QCOMPARE(::pipe(pipeFds), 0);
+    for (int i = 0; i < 100; ++i) {
+        QByteArray message(1 + (i * 37) % 5000, 'a' + i % 26);
+        QCOMPARE(sender->write(message, i % 7 == 0 ? pipeFds[0] : -1), message.size());
+    }
+
+    QTRY_COMPARE(messages.count(), 100);
+    for (int i = 0; i < 100; ++i) {
+        QCOMPARE(messages.at(i), QByteArray(1 + (i * 37) % 5000, 'a' + i % 26));
+        QCOMPARE(receivedFds.at(i) != -1, i % 7 == 0);
+        if (receivedFds.at(i) != -1) {
+            ::close(receivedFds.at(i));
+        }
+    }
+
+    ::close(pipeFds[0]);
+    ::close(pipeFds[1]);
+    delete sender;
+    delete receiver;
+
+    // A stream server gets a stream connection
+    const QString path = QStringLiteral("/tmp/hyperspace-socket-basics-%1").arg(QCoreApplication::applicationPid());
+    int server = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, path.toLatin1().constData(), sizeof(address.sun_path) - 1);
+    ::unlink(address.sun_path);
+    QCOMPARE(::bind(server, (struct sockaddr *) &address, sizeof(address)), 0);
+    QCOMPARE(::listen(server, 1), 0);
+
+    Socket *client = new Socket(path, this);
+    client->setTransport(Socket::SeqPacketTransport);
+    client->init();
+    QTRY_VERIFY(client->isReady());
+    QCOMPARE(client->transport(), Socket::StreamTransport);
+
+    delete client;
+    ::close(server);
+    ::unlink(address.sun_path);
+}
+
+void SocketBasics::testIOUring()
+{
+    int fds[2];
+    QCOMPARE(::socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+    ::fcntl(fds[1], F_SETFL, ::fcntl(fds[1], F_GETFL) | O_NONBLOCK);
+
+    Socket *socket = new Socket(fds[0], this);
+    socket->setIOUringEnabled(true);
+    socket->init();
+    // Without io_uring, it falls back to notifiers: either way, it has to behave the same
+    QTRY_VERIFY(socket->isReady());
+
+    QByteArray received;
+    connect(socket, &Socket::readyRead, this, [&received] (const QByteArray &data, int) {
+        received.append(data.constData(), data.size());
+    });
+    QSignalSpy disconnectedSpy(socket, SIGNAL(disconnected()));
+
+    // Way more than a single provided buffer
+    QByteArray stream;
+    for (int i = 0; i < 2000; ++i) {
+        stream.append(QByteArray(1 + i % 97, 'a' + i % 26));
+    }
+    for (int offset = 0; offset < stream.size();) {
+        ssize_t count = ::write(fds[1], stream.constData() + offset, stream.size() - offset);
+        if (count > 0) {
+            offset += count;
+        }
+        QTest::qWait(1);
+    }
+    QTRY_COMPARE(received.size(), stream.size());
+    QCOMPARE(received, stream);
+
+    // Writes go out in order, fds included
+    int pipeFds[2];
+    QCOMPARE(::pipe(pipeFds), 0);
+    QSignalSpy drainedSpy(socket, SIGNAL(drained()));
+    QCOMPARE(socket->write(stream.left(1000)), 1000);
+    QCOMPARE(socket->write(stream.mid(1000, 1000), pipeFds[0]), 1000);
+    QCOMPARE(socket->write(stream.mid(2000)), stream.size() - 2000);
+
+    QByteArray written;
+    QTRY_COMPARE((written += readAvailable(fds[1])).size(), stream.size());
+    QCOMPARE(written, stream);
+    QTRY_VERIFY(drainedSpy.count() > 0);
+    QCOMPARE(socket->bytesToWrite(), Q_INT64_C(0));
+
+    ::close(pipeFds[0]);
+    ::close(pipeFds[1]);
+    ::close(fds[1]);
+    QTRY_COMPARE(disconnectedSpy.count(), 1);
+
+    delete socket;
+}
+
+void SocketBasics::testWriteBatching()
+{
+    int peer;
+    Socket *socket = connectedSocket(&peer);
+    QVERIFY(socket);
+    QTRY_VERIFY(socket->isReady());
+    // Let the first write notification go by
+    QTest::qWait(10);
+
+    socket->setWriteBatching(20000, 1000);
+    QCOMPARE(socket->writeLatencyBudget(), 20000);
+    QCOMPARE(socket->writeBatchSize(), Q_INT64_C(1000));
+
+    // Held until the budget expires...
+    QSignalSpy bytesWrittenSpy(socket, SIGNAL(bytesWritten(qint64)));
+    for (int i = 0; i < 10; ++i) {
+        QCOMPARE(socket->write(QByteArray(10, 'a')), 10);
+    }
+    QCOMPARE(readAvailable(peer).size(), 0);
+    QCOMPARE(socket->bytesToWrite(), Q_INT64_C(100));
+
+    // ...then written at once
+    QTRY_COMPARE(socket->bytesToWrite(), Q_INT64_C(0));
+    QCOMPARE(readAvailable(peer), QByteArray(100, 'a'));
+    QCOMPARE(bytesWrittenSpy.count(), 1);
+
+    // Unless flushed
+    QCOMPARE(socket->write(QByteArray(10, 'b')), 10);
+    QCOMPARE(readAvailable(peer).size(), 0);
+    socket->flush();
+    QCOMPARE(readAvailable(peer), QByteArray(10, 'b'));
+
+    // Or unless enough has been queued
+    QCOMPARE(socket->write(QByteArray(500, 'c')), 500);
+    QCOMPARE(socket->write(QByteArray(600, 'c')), 600);
+    QCOMPARE(readAvailable(peer), QByteArray(1100, 'c'));
+
+    // Turning it off sends whatever is being held
+    QCOMPARE(socket->write(QByteArray(10, 'd')), 10);
+    socket->setWriteBatching(0);
+    QCOMPARE(readAvailable(peer), QByteArray(10, 'd'));
+
+    ::close(peer);
+    delete socket;
+}
+
+void SocketBasics::testStatistics()
+{
+    int peer;
+    Socket *socket = connectedSocket(&peer);
+    QVERIFY(socket);
+    QTRY_VERIFY(socket->isReady());
+    QTest::qWait(10);
+
+    // Held, then written at once
+    socket->setWriteBatching(1000000);
+    QCOMPARE(socket->write(QByteArray(10, 'a')), 10);
+    QCOMPARE(socket->write(QByteArray(20, 'b')), 20);
+    QCOMPARE(socket->write(QByteArray(30, 'c')), 30);
+    Socket::Statistics before = socket->statistics();
+    socket->flush();
+    QCOMPARE(readAvailable(peer).size(), 60);
+
+    Socket::Statistics statistics = socket->statistics();
+    QCOMPARE(statistics.messagesWritten, Q_UINT64_C(3));
+    QCOMPARE(statistics.bytesWritten, Q_UINT64_C(60));
+    QCOMPARE(statistics.syscalls, before.syscalls + 1);
+    QCOMPARE(statistics.writeQueuePeak, Q_INT64_C(60));
+
+    // Reads count until the socket runs dry
+    QByteArray data(100, 'd');
+    QCOMPARE(::write(peer, data.constData(), data.size()), (ssize_t) data.size());
+    QSignalSpy readSpy(socket, SIGNAL(readyRead(QByteArray,int)));
+    QTRY_COMPARE(readSpy.count(), 1);
+    statistics = socket->statistics();
+    QCOMPARE(statistics.messagesRead, Q_UINT64_C(1));
+    QCOMPARE(statistics.bytesRead, Q_UINT64_C(100));
+    QVERIFY(statistics.wouldBlock > 0);
+
+    // And come out periodically
+    qRegisterMetaType<Socket::Statistics>();
+    QSignalSpy statisticsSpy(socket, SIGNAL(statisticsUpdated(Hyperspace::Socket::Statistics)));
+    socket->setStatisticsInterval(10);
+    QCOMPARE(socket->statisticsInterval(), 10);
+    QTRY_VERIFY(statisticsSpy.count() >= 2);
+    socket->setStatisticsInterval(0);
+    QCOMPARE(socket->statisticsInterval(), 0);
+
+    ::close(peer);
+    delete socket;
+}
+
+void SocketBasics::testLatencyHistogram()
+{
+    LatencyHistogram histogram;
+    QCOMPARE(histogram.count(), Q_UINT64_C(0));
+    QCOMPARE(histogram.valueAtPercentile(50), Q_UINT64_C(0));
+
+    for (quint64 i = 1; i <= 100000; ++i) {
+        histogram.record(i);
+    }
+    QCOMPARE(histogram.count(), Q_UINT64_C(100000));
+    QCOMPARE(histogram.minimum(), Q_UINT64_C(1));
+    QCOMPARE(histogram.maximum(), Q_UINT64_C(100000));
+    QVERIFY(qAbs(histogram.mean() - 50000.5) < 1);
+
+    // Within the histogram's precision, whatever the magnitude
+    const QList<double> percentiles = { 1, 50, 90, 99, 99.9, 100 };
+    for (double percentile : percentiles) {
+        double expected = percentile * 1000;
+        QVERIFY2(qAbs(histogram.valueAtPercentile(percentile) - expected) / expected <= 1.0 / 64,
+                 QByteArray::number(percentile).constData());
+    }
+
+    // Copies are independent
+    LatencyHistogram copy = histogram;
+    copy.record(Q_UINT64_C(18446744073709551615));
+    QCOMPARE(copy.valueAtPercentile(100), Q_UINT64_C(18446744073709551615));
+    QCOMPARE(histogram.maximum(), Q_UINT64_C(100000));
+
+    histogram.reset();
+    QCOMPARE(histogram.count(), Q_UINT64_C(0));
+    QCOMPARE(copy.count(), Q_UINT64_C(100001));
+}
+
+void SocketBasics::cleanup()
+{
+    cleanupImpl();
+}
+
+void SocketBasics::cleanupTestCase()
+{
+    cleanupTestCaseImpl();
+}
+
+QTEST_MAIN(SocketBasics)
+#include "socket-basics.cpp.moc.hpp"
@@ -0,0 +1,130 @@
+#include <HemeraTest/Test>
+
+#include <QtCore/QCoreApplication>
+#include <QtCore/QEventLoop>
+#include <QtCore/QObject>
+
+#include <HyperspaceCore/Gate>
+#include <HyperspaceCore/Socket>
+#include <HyperspaceCore/Wave>
+
+#include "lib/fakehyperdrive.h"
+
+using namespace Hyperspace;
+
+// Waves in flight per iteration
+static const int s_burstSize = 64;
+
+// A Gate without targets: every wave comes back as a NotFound rebound
+class EchoGate : public Gate
+{
+public:
+    EchoGate(QObject *parent = nullptr) : Gate(parent) {}
+};
+
+class TransportBenchmarks : public Hemera::Test::Test
+{
+    Q_OBJECT
+
+public:
+    TransportBenchmarks(QObject *parent = 0)
+        : Test(parent)
+    { }
+
+private Q_SLOTS:
+    void initTestCase();
+    void init();
+
+    void benchmarkRoundTrip_data();
+    void benchmarkRoundTrip();
+
+    void cleanup();
+    void cleanupTestCase();
+};
+
+void TransportBenchmarks::initTestCase()
+{
+    initTestCaseImpl();
+}
+
+void TransportBenchmarks::init()
+{
+    initImpl();
+}
+
+void TransportBenchmarks::benchmarkRoundTrip_data()
+{
+    QTest::addColumn<int>("transport");
+    QTest::addColumn<QByteArray>("payload");
+
+    // The same datastream sample, property document and blob sizes as the codec benchmarks
+    QTest::newRow("stream, 16 B payload") << (int) Socket::StreamTransport << QByteArray(16, 'x');
+    QTest::newRow("seqpacket, 16 B payload") << (int) Socket::SeqPacketTransport << QByteArray(16, 'x');
+    QTest::newRow("stream, 1 KiB payload") << (int) Socket::StreamTransport << QByteArray(1024, 'x');
+    QTest::newRow("seqpacket, 1 KiB payload") << (int) Socket::SeqPacketTransport << QByteArray(1024, 'x');
+    QTest::newRow("stream, 64 KiB payload") << (int) Socket::StreamTransport << QByteArray(64 * 1024, 'x');
+    QTest::newRow("seqpacket, 64 KiB payload") << (int) Socket::SeqPacketTransport << QByteArray(64 * 1024, 'x');
+}
+
+void TransportBenchmarks::benchmarkRoundTrip()
+{
+    QFETCH(int, transport);
+    QFETCH(QByteArray, payload);
+
+#ifndef ENABLE_TEST_CODEPATHS
+    QSKIP("A Gate can only be brought up with test codepaths enabled");
+#endif
+    // Gates connect to the fake Hyperdrive when running autotests
+    qputenv("RUNNING_AUTOTESTS", "1");
+    qputenv("HYPERSPACE_GATE_SEQPACKET", transport == Socket::SeqPacketTransport ? "1" : "0");
+
+    FakeHyperdrive hyperdrive(nullptr, (Socket::Transport) transport);
+    hyperdrive.init();
+    QTRY_VERIFY_WITH_TIMEOUT(hyperdrive.isReady(), 5000);
+
+    // A fake Hyperdrive only takes connections of its own transport: the Gate can't fall back here
+    EchoGate gate;
+    gate.init();
+    QTRY_VERIFY_WITH_TIMEOUT(gate.isReady(), 5000);
+    QTRY_VERIFY_WITH_TIMEOUT(hyperdrive.hasGate(), 5000);
+
+    Wave wave;
+    wave.setMethod("PUT");
+    wave.setInterface("com.ispirata.Hemera.TransportBenchmarks");
+    wave.setTarget("/value");
+    wave.setPayload(payload);
+
+    int rebounds = 0;
+    connect(&hyperdrive, &FakeHyperdrive::gotRebound, this, [&rebounds] { ++rebounds; });
+
+    QBENCHMARK {
+        rebounds = 0;
+        for (int i = 0; i < s_burstSize; ++i) {
+            hyperdrive.sendWave(wave);
+        }
+        while (rebounds < s_burstSize) {
+            QCoreApplication::processEvents(QEventLoop::WaitForMoreEvents);
+        }
+    }
+
+    // Every rebound answered a wave the Gate saw coming in
+    Gate::Statistics statistics = gate.statistics();
+    QCOMPARE(statistics.reboundsSent, statistics.wavesReceived);
+    QCOMPARE(statistics.reboundLatency.count(), statistics.reboundsSent);
+    QVERIFY(statistics.socket.messagesWritten >= statistics.reboundsSent);
+
+    qunsetenv("HYPERSPACE_GATE_SEQPACKET");
+}
+
+void TransportBenchmarks::cleanup()
+{
+    cleanupImpl();
+}
+
+void TransportBenchmarks::cleanupTestCase()
+{
+    cleanupTestCaseImpl();
+}
+
+QTEST_MAIN(TransportBenchmarks)
+#include "transport-benchmarks.cpp.moc.hpp"